@@ -1,15 +1,152 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <zlib.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+#include <sys/utsname.h>
+#include <ftw.h>
+#include <linux/io_uring.h>
+#include <linux/errqueue.h>
+#include <poll.h>
 
 #define BUFFER_SIZE 1024
+#define CONTROL_BUFFER_SIZE 8192  // Буфер приёма управляющего соединения
+
+// Возможности сервера из ответа FEAT
+#define FEAT_SIZE  0x01
+#define FEAT_MDTM  0x02
+#define FEAT_REST  0x04
+#define FEAT_MLST  0x08
+#define FEAT_EPSV  0x10
+#define FEAT_MODEZ 0x20
+#define FEAT_UTF8  0x40
+#define ZERO_COPY_CHUNK (8 * 1024 * 1024)  // Размер одного вызова sendfile/splice
+#define DEFAULT_RECV_BUFFER (1024 * 1024)  // Буфер приёма по умолчанию
+#define MIN_RECV_BUFFER (4 * 1024)
+#define MAX_RECV_BUFFER (64 * 1024 * 1024)
+#define PIPE_BUFFER_SIZE (1024 * 1024)     // Желаемая ёмкость канала для splice
+#define MODEZ_PROBE (1024 * 1024)          // Объём, после которого оценивается степень сжатия
+#define MODEZ_SAMPLE (64 * 1024)           // Проба файла перед отправкой в MODE Z
+#define MODEZ_POOR_RATIO 0.9               // Сжатие хуже этого считается бесполезным
+#define MODEZ_DEFAULT_LEVEL 6
+#define MODEZ_LEARNED 16                   // Запоминаемых плохо сжимаемых расширений
+#define PROGRESS_RATE 4                    // Перерисовок индикатора в секунду
+#define MSGZC_CHUNK (1024 * 1024)          // Порция одного send с MSG_ZEROCOPY
+#define MSGZC_INFLIGHT 32                  // Неподтверждённых порций: предел закреплённых страниц
+#define MSGZC_MIN_SIZE (64LL << 20)        // Меньшие файлы не стоят mmap и уведомлений
+#define MSGZC_UNSUPPORTED (-2)             // Ядро или сокет не умеют MSG_ZEROCOPY, ничего не отправлено
+#define URING_SLOTS 8                      // Буферов в конвейере io_uring
+#define URING_MIN_CHUNK (64 * 1024)
+#define RESUME_RETRY_DELAY_MS 500          // Пауза перед повтором, умножается на номер попытки
+#define MAX_SEGMENTS 16                    // Максимум параллельных сегментов pdownload
+#define MAX_WORKERS 32                     // Максимум сессий в пуле mget/mput
+#define TAR_BLOCK 512
+#define ARCHIVE_CHUNK (256 * 1024)         // Порция чтения/сжатия при архивации
+#define TAR_META_LIMIT (64 * 1024)         // Предел для длинных имён и pax-заголовков
+#define PGZIP_BLOCK (1024 * 1024)          // Блок, сжимаемый отдельным потоком
+#define PGZIP_DICT (32 * 1024)             // Хвост предыдущего блока - словарь следующего
+#define MAX_ARCHIVE_WORKERS 64
+#define DIR_LARGE_FILE (8LL << 20)         // Файл от этого размера - "большой" при выборе способа
+#define DIR_BUNDLE_MIN 32                  // Мелких файлов, ради которых стоит собирать архив
+#define DIR_SAMPLE_FILES 16                // Больших файлов, проверяемых на сжимаемость
+#define DIR_COMPRESSIBLE 0.7               // Большие файлы сжимаются сильнее - выгоднее архив
+#define QUEUE_FILE ".ftp_queue"           // Очередь передач по умолчанию, в $HOME
+#define DIR_BUNDLE_NAME "_ftp_bundle.tar"  // Архив мелких файлов при гибридной передаче (+ расширение кодека)
 #define CMD_SIZE 256
 #define MAX_PATH 512
+#define BENCH_CASE_BYTES (256LL << 20)     // Объём, набираемый повторами на мелких файлах
+#define BENCH_MAX_OPS 200
+#define BENCH_SMALL_FILE (4 * 1024)        // Размер файлов в тестах mput/mget/upload_dir
+#define BENCH_LIST_OPS 50
+#define BENCH_QUANTUM_TOLERANCE 0.001      // Допуск проверки на замер периода ожидания, с
+#define METRICS_BUCKETS 32                 // Корзины гистограммы: [2^i, 2^(i+1)) мкс
+#define METRICS_MAX_NAMES 64
+#define METRICS_PENDING 8                  // Команд в полёте, ожидающих ответа
+#define TRACE_EVENT_LIMIT (1 << 20)
+#define LISTING_LINE_MAX 4096              // Строки листинга длиннее пропускаются
+#define NAME_ARENA_BLOCK (64 * 1024)       // Блок арены имён листинга
+#define LISTING_CACHE_SLOTS 32             // Каталогов в кэше листингов сессии
+#define LISTING_CACHE_TTL 30.0             // Срок жизни листинга в кэше по умолчанию, с
+
+// Гистограмма задержек одной команды или фазы
+typedef struct {
+    char name[16];
+    const char *category;
+    long long count;
+    double total;
+    double min;
+    double max;
+    long long buckets[METRICS_BUCKETS];
+} metrics_histogram_t;
+
+// Событие временной шкалы (Chrome trace, "ph":"X")
+typedef struct {
+    char name[16];
+    const char *category;
+    int session;
+    int code;               // Код ответа или 0
+    double start;
+    double duration;
+} trace_event_t;
+
+// Разбивка одной передачи данных по фазам
+typedef struct {
+    char verb[8];
+    int session;
+    long long bytes;
+    double first_byte;      // От команды передачи до первого байта данных
+    double data;            // От первого до последнего байта
+    double drain;           // От конца данных до финального ответа
+} transfer_record_t;
+
+// Метрики, общие для основной и дополнительных сессий
+typedef struct ftp_metrics {
+    pthread_mutex_t lock;
+    double epoch;           // Начало отсчёта временной шкалы
+    metrics_histogram_t histograms[METRICS_MAX_NAMES];
+    int histogram_count;
+    trace_event_t *events;
+    int event_count;
+    int event_capacity;
+    long long events_dropped;
+    transfer_record_t *transfers;
+    int transfer_count;
+    int transfer_capacity;
+    char (*sessions)[64];   // Имена сессий; номер сессии - индекс + 1
+    int session_count;
+    int session_capacity;
+} ftp_metrics_t;
+
+// Команда, отправленная, но ещё не получившая ответ
+typedef struct {
+    char verb[8];
+    double sent;
+} pending_command_t;
+
+// Кодеки архива каталога (см. archive_codecs)
+enum { CODEC_NONE, CODEC_GZIP, CODEC_ZSTD, CODEC_LZ4, CODEC_COUNT };
 
 typedef struct {
     int control_socket;
@@ -20,435 +157,7375 @@ typedef struct {
     char password[256];
     int passive_mode;
     char current_dir[512];  // Добавлено для отслеживания текущего каталога
+    int zero_copy;          // Передача файлов через sendfile/splice
+    int io_uring;           // При выключенном zero_copy - io_uring вместо цикла копирования
+    int msg_zerocopy;       // Большие файлы отправлять из mmap через MSG_ZEROCOPY
+    size_t buffer_size;     // Размер буфера приёма при копировании
+    int verbose;            // Печатать ли команды протокола
+    int pipelining;         // Отправлять независимые команды пакетом
+    int mode_z;             // Сжимать передачи (MODE Z), если сервер умеет
+    int compress_level;     // Уровень deflate для MODE Z
+    char incompressible[MODEZ_LEARNED][16];  // Расширения, плохо сжавшиеся в этой сессии
+    int incompressible_count;
+    char control_buffer[CONTROL_BUFFER_SIZE];  // Принятые, но ещё не разобранные байты
+    size_t control_start;   // Начало неразобранных данных в control_buffer
+    size_t control_end;     // Конец принятых данных в control_buffer
+    // Подтверждённое состояние сессии, позволяющее пропускать лишние команды
+    char transfer_type;     // Установленный TYPE ('I', 'A') или 0, если неизвестен
+    char transfer_mode;     // Установленный MODE ('S', 'Z') или 0 - по умолчанию (S)
+    int server_z_level;     // Уровень, сообщённый серверу OPTS MODE Z (0 - не сообщался)
+    int cwd_confirmed;      // current_dir подтверждён ответом сервера
+    int features_known;     // FEAT уже запрошен
+    unsigned int features;  // Битовая маска FEAT_*
+    int no_mlsd;            // Сервер объявил MLST, но отверг MLSD
+    long long last_transfer_bytes;  // Объём данных последней передачи
+    double last_setup_seconds;      // Подготовка последней передачи (до ответа 150)
+    int interrupted;        // Последняя передача оборвалась (можно докачать)
+    int resume_retries;     // Повторов с докачкой после обрыва, 0 - без повторов
+    long long resume_overlap;       // Байт перекрытия, сверяемых при докачке; 0 - без проверки
+    int disconnected;       // Управляющее соединение потеряно (разрыв или 421)
+    ftp_metrics_t *metrics; // Сбор метрик (NULL - выключен)
+    int session_id;         // Номер сессии в метриках, 0 - ещё не назначен
+    pending_command_t pending[METRICS_PENDING];  // Очередь команд, ждущих ответа
+    int pending_head;
+    int pending_count;
+    double transfer_sent;   // Время отправки последней команды передачи
+    struct listing_cache *listing_cache;  // Кэш листингов (NULL - пуст)
+    double listing_ttl;     // Срок жизни листинга в кэше, с; 0 - без кэша
+    int archive_workers;    // Потоков сжатия архива каталога; 1 - без распараллеливания
+    int archive_codec;      // Кодек архива каталога (CODEC_*)
+    int archive_level;      // Уровень сжатия архива, 0 - по умолчанию для кодека
+    char queue_file[MAX_PATH];  // Файл очереди передач; пусто - $HOME/QUEUE_FILE
 } ftp_client_t;
 
 int ftp_pwd(ftp_client_t *client);
+void ftp_cache_clear(ftp_client_t *client);
+void ftp_cache_invalidate(ftp_client_t *client, const char *path);
 
-// Функция для чтения ответа от FTP сервера
-int read_response(int socket, char *buffer, int size) {
-    int bytes_read = recv(socket, buffer, size - 1, 0);
-    if (bytes_read > 0) {
-        buffer[bytes_read] = '\0';
-        printf("Server: %s", buffer);
-    }
-    return bytes_read;
+// Сброс закэшированного состояния сессии (переподключение, вход, ошибка)
+void ftp_reset_session_state(ftp_client_t *client) {
+    client->transfer_type = 0;
+    client->transfer_mode = 0;
+    client->server_z_level = 0;
+    client->cwd_confirmed = 0;
+    client->features_known = 0;
+    client->features = 0;
+    client->no_mlsd = 0;
+    ftp_cache_clear(client);
 }
 
-// Функция для отправки команды FTP серверу
-int send_command(ftp_client_t *client, const char *command) {
-    char cmd[CMD_SIZE];
-    snprintf(cmd, sizeof(cmd), "%s\r\n", command);
+// Потоков сжатия архива по умолчанию - по числу процессоров
+int default_archive_workers(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-    printf("Client: %s", cmd);
-    return send(client->control_socket, cmd, strlen(cmd), 0);
+    if (cpus < 1) return 1;
+    return cpus > MAX_ARCHIVE_WORKERS ? MAX_ARCHIVE_WORKERS : (int)cpus;
 }
 
-// Установка соединения с FTP сервером
-int ftp_connect(ftp_client_t *client, const char *server, int port) {
-    struct sockaddr_in server_addr;
-    struct hostent *host_entry;
-    char buffer[BUFFER_SIZE];
+// Инициализация структуры клиента значениями по умолчанию
+void ftp_client_init(ftp_client_t *client) {
+    memset(client, 0, sizeof(*client));
+    client->control_socket = -1;
+    client->data_socket = -1;
+    client->zero_copy = 1;
+    client->io_uring = 1;
+    client->buffer_size = DEFAULT_RECV_BUFFER;
+    client->verbose = 1;
+    client->pipelining = 1;
+    client->listing_ttl = LISTING_CACHE_TTL;
+    client->compress_level = MODEZ_DEFAULT_LEVEL;
+    client->archive_workers = default_archive_workers();
+    client->archive_codec = CODEC_GZIP;
+}
 
-    // Создание сокета
-    client->control_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (client->control_socket < 0) {
-        perror("Socket creation failed");
-        return -1;
-    }
+// Разбор размера с необязательным суффиксом K/M/G
+long long parse_size(const char *text) {
+    char *end;
+    long long value = strtoll(text, &end, 10);
 
-    // Получение IP адреса сервера
-    host_entry = gethostbyname(server);
-    if (!host_entry) {
-        fprintf(stderr, "Failed to resolve hostname: %s\n", server);
-        return -1;
+    if (end == text || value < 0) return -1;
+    switch (*end) {
+        case 'k': case 'K': value *= 1024; end++; break;
+        case 'm': case 'M': value *= 1024 * 1024; end++; break;
+        case 'g': case 'G': value *= 1024LL * 1024 * 1024; end++; break;
     }
-
-    // Настройка адреса сервера
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    memcpy(&server_addr.sin_addr, host_entry->h_addr_list[0], host_entry->h_length);
-
-    // Подключение к серверу
-    if (connect(client->control_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connection failed");
-        return -1;
+    if (strcmp(end, "") == 0 || strcmp(end, "B") == 0 || strcmp(end, "iB") == 0) {
+        return value;
     }
+    return -1;
+}
 
-    strcpy(client->server, server);
-    client->port = port;
-    strcpy(client->current_dir, "/");  // Инициализация текущего каталога
+// Текущее время в секундах (монотонные часы)
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    // Чтение приветственного сообщения
-    read_response(client->control_socket, buffer, sizeof(buffer));
+// Вывод статистики передачи
+void print_transfer_stats(const char *method, long long bytes, double seconds) {
+    double rate = seconds > 0 ? bytes / seconds : 0;
+    printf("Transferred %lld bytes in %.3f s (%.0f bytes/sec, %.2f MB/s) via %s\n",
+           bytes, seconds, rate, rate / (1024 * 1024), method);
+}
 
-    return 0;
+void print_compression_stats(long long bytes, long long wire) {
+    printf("Compressed on the wire: %lld bytes (%.1f%% of original)\n", wire,
+           bytes > 0 ? 100.0 * wire / bytes : 100.0);
 }
 
+// Индикатор хода передачи. Перерисовывается не чаще PROGRESS_RATE раз в
+// секунду и молчит, если stdout не терминал
+typedef struct {
+    int enabled;
+    long long expected;     // Ожидаемый объём (по SIZE или fstat), -1 если неизвестен
+    long long done;
+    double started;
+    double next_update;     // Раньше этого времени строка не перерисовывается
+    int drawn;              // Строка выведена и требует очистки
+    double first_byte;      // Время первого переданного байта (для метрик)
+} progress_t;
 
-// Аутентификация на FTP сервере
-int ftp_login(ftp_client_t *client, const char *username, const char *password) {
-    char buffer[BUFFER_SIZE];
-    char command[CMD_SIZE];
+void progress_start(progress_t *progress, int enabled, long long expected) {
+    memset(progress, 0, sizeof(*progress));
+    progress->enabled = enabled && isatty(STDOUT_FILENO);
+    progress->expected = expected;
+    progress->started = now_seconds();
+    progress->next_update = progress->started + 1.0 / PROGRESS_RATE;
+}
 
-    // Отправка имени пользователя
-    snprintf(command, sizeof(command), "USER %s", username);
-    send_command(client, command);
-    read_response(client->control_socket, buffer, sizeof(buffer));
+// Ожидание сигнала от рабочих потоков под захваченным lock. На терминале
+// ожидание ограничено периодом перерисовки прогресса, иначе - до сигнала
+void wait_progress(pthread_cond_t *changed, pthread_mutex_t *lock, int tty) {
+    struct timespec deadline;
 
-    // Отправка пароля
-    snprintf(command, sizeof(command), "PASS %s", password);
-    send_command(client, command);
-    read_response(client->control_socket, buffer, sizeof(buffer));
+    if (!tty) {
+        pthread_cond_wait(changed, lock);
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 1000000000L / PROGRESS_RATE;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(changed, lock, &deadline);
+}
 
-    strcpy(client->username, username);
-    strcpy(client->password, password);
+// Запись объёма в человекочитаемом виде
+void format_bytes(char *text, size_t size, double bytes) {
+    static const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
 
-    // После успешной авторизации получаем текущий каталог
-    if (strncmp(buffer, "230", 3) == 0) {
-        ftp_pwd(client);  // Получаем текущий каталог
-        return 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
     }
+    snprintf(text, size, unit ? "%.1f %s" : "%.0f %s", bytes, units[unit]);
+}
 
-    return -1;
+void progress_draw(progress_t *progress, double now) {
+    double elapsed = now - progress->started;
+    double rate = elapsed > 0 ? progress->done / elapsed : 0;
+    char done[32], total[32], speed[32];
+
+    format_bytes(done, sizeof(done), progress->done);
+    format_bytes(speed, sizeof(speed), rate);
+    if (progress->expected > 0) {
+        long long left = progress->expected - progress->done;
+        int eta = rate > 0 && left > 0 ? (int)(left / rate) : 0;
+
+        format_bytes(total, sizeof(total), progress->expected);
+        printf("\r%s / %s  %3d%%  %s/s  ETA %d:%02d\033[K", done, total,
+               (int)(progress->done * 100 / progress->expected), speed, eta / 60, eta % 60);
+    } else {
+        printf("\r%s  %s/s\033[K", done, speed);
+    }
+    fflush(stdout);
+    progress->drawn = 1;
 }
 
-// Получение текущего рабочего каталога
-int ftp_pwd(ftp_client_t *client) {
-    char buffer[BUFFER_SIZE];
+// Учёт переданных байт; стоимость вызова между перерисовками - одно чтение часов
+void progress_update(progress_t *progress, long long bytes) {
+    double now;
 
-    send_command(client, "PWD");
-    read_response(client->control_socket, buffer, sizeof(buffer));
+    if (!progress) {
+        return;
+    }
+    if (progress->first_byte == 0 && bytes > 0) {
+        progress->first_byte = now_seconds();
+    }
+    if (!progress->enabled) {
+        return;
+    }
+    progress->done += bytes;
+    now = now_seconds();
+    if (now >= progress->next_update) {
+        progress->next_update = now + 1.0 / PROGRESS_RATE;
+        progress_draw(progress, now);
+    }
+}
 
-    if (strncmp(buffer, "257", 3) == 0) {
-        // Парсинг ответа PWD для извлечения пути
-        char *start = strchr(buffer, '"');
-        if (start) {
-            start++;
-            char *end = strchr(start, '"');
-            if (end) {
-                *end = '\0';
-                strcpy(client->current_dir, start);
-            }
-        }
-        return 0;
+// Очистка строки индикатора перед итоговым сообщением
+void progress_finish(progress_t *progress) {
+    if (progress->enabled && progress->drawn) {
+        printf("\r\033[K");
+        fflush(stdout);
     }
+}
 
-    return -1;
+ftp_metrics_t *metrics_create(void) {
+    ftp_metrics_t *metrics = calloc(1, sizeof(*metrics));
+
+    if (metrics) {
+        pthread_mutex_init(&metrics->lock, NULL);
+        metrics->epoch = now_seconds();
+    }
+    return metrics;
 }
 
-// Смена рабочего каталога
-int ftp_cwd(ftp_client_t *client, const char *directory) {
-    char buffer[BUFFER_SIZE];
-    char command[CMD_SIZE];
+void metrics_free(ftp_metrics_t *metrics) {
+    if (!metrics) return;
+    pthread_mutex_destroy(&metrics->lock);
+    free(metrics->events);
+    free(metrics->transfers);
+    free(metrics->sessions);
+    free(metrics);
+}
 
-    snprintf(command, sizeof(command), "CWD %s", directory);
-    send_command(client, command);
-    read_response(client->control_socket, buffer, sizeof(buffer));
+// Номер сессии в метриках; назначается при первом событии сессии
+int metrics_session(ftp_client_t *client) {
+    ftp_metrics_t *metrics = client->metrics;
 
-    if (strncmp(buffer, "250", 3) == 0) {
-        // Обновляем локальное представление текущего каталога
-        if (strcmp(directory, "..") == 0) {
-            // Переход в родительский каталог
-            char *last_slash = strrchr(client->current_dir, '/');
-            if (last_slash && last_slash != client->current_dir) {
-                *last_slash = '\0';
-            } else if (last_slash == client->current_dir) {
-                strcpy(client->current_dir, "/");
-            }
-        } else if (directory[0] == '/') {
-            // Абсолютный путь
-            strcpy(client->current_dir, directory);
-        } else {
-            // Относительный путь
-            if (strcmp(client->current_dir, "/") != 0) {
-                strcat(client->current_dir, "/");
+    if (client->session_id == 0) {
+        pthread_mutex_lock(&metrics->lock);
+        if (metrics->session_count == metrics->session_capacity) {
+            int capacity = metrics->session_capacity ? metrics->session_capacity * 2 : 16;
+            char (*grown)[64] = realloc(metrics->sessions, sizeof(*grown) * capacity);
+            if (grown) {
+                metrics->sessions = grown;
+                metrics->session_capacity = capacity;
             }
-            strcat(client->current_dir, directory);
         }
+        if (metrics->session_count < metrics->session_capacity) {
+            client->session_id = ++metrics->session_count;
+            snprintf(metrics->sessions[client->session_id - 1], 64, "session %d %.40s:%d",
+                     client->session_id, client->server, client->port);
+        }
+        pthread_mutex_unlock(&metrics->lock);
+    }
+    return client->session_id;
+}
 
-        printf("Changed to directory: %s\n", client->current_dir);
-        return 0;
+// Учёт интервала: гистограмма по имени и событие временной шкалы
+void metrics_record(ftp_client_t *client, const char *category, const char *name,
+                    double start, double end, int code) {
+    ftp_metrics_t *metrics = client->metrics;
+    metrics_histogram_t *histogram = NULL;
+    double seconds = end - start;
+    long long micros = (long long)(seconds * 1e6);
+    int session = metrics_session(client);
+    int bucket = 0;
+
+    while (bucket < METRICS_BUCKETS - 1 && micros >= (2LL << bucket)) {
+        bucket++;
     }
 
-    return -1;
-}
+    pthread_mutex_lock(&metrics->lock);
+    for (int i = 0; i < metrics->histogram_count; i++) {
+        if (strcmp(metrics->histograms[i].name, name) == 0) {
+            histogram = &metrics->histograms[i];
+            break;
+        }
+    }
+    if (!histogram && metrics->histogram_count < METRICS_MAX_NAMES) {
+        histogram = &metrics->histograms[metrics->histogram_count++];
+        snprintf(histogram->name, sizeof(histogram->name), "%s", name);
+        histogram->category = category;
+        histogram->min = seconds;
+    }
+    if (histogram) {
+        histogram->count++;
+        histogram->total += seconds;
+        if (seconds < histogram->min) histogram->min = seconds;
+        if (seconds > histogram->max) histogram->max = seconds;
+        histogram->buckets[bucket]++;
+    }
 
-// Переход в пассивный режим
-int ftp_passive_mode(ftp_client_t *client) {
-    char buffer[BUFFER_SIZE];
-    char *start, *end;
-    int ip[4], port[2];
-    struct sockaddr_in data_addr;
+    if (metrics->event_count == metrics->event_capacity && metrics->event_capacity < TRACE_EVENT_LIMIT) {
+        int capacity = metrics->event_capacity ? metrics->event_capacity * 2 : 1024;
+        trace_event_t *grown = realloc(metrics->events, sizeof(*grown) * capacity);
+        if (grown) {
+            metrics->events = grown;
+            metrics->event_capacity = capacity;
+        }
+    }
+    if (metrics->event_count < metrics->event_capacity) {
+        trace_event_t *event = &metrics->events[metrics->event_count++];
+        snprintf(event->name, sizeof(event->name), "%s", name);
+        event->category = category;
+        event->session = session;
+        event->code = code;
+        event->start = start - metrics->epoch;
+        event->duration = seconds;
+    } else {
+        metrics->events_dropped++;
+    }
+    pthread_mutex_unlock(&metrics->lock);
+}
 
-    send_command(client, "PASV");
-    read_response(client->control_socket, buffer, sizeof(buffer));
+// Команда ушла на сервер: запоминаем глагол и время до прихода ответа
+void metrics_command_sent(ftp_client_t *client, const char *command, double sent) {
+    pending_command_t *pending;
+    size_t length = strcspn(command, " ");
 
-    if (strncmp(buffer, "227", 3) != 0) {
-        return -1;
+    if (!client->metrics || client->pending_count == METRICS_PENDING) {
+        return;
     }
+    pending = &client->pending[(client->pending_head + client->pending_count) % METRICS_PENDING];
+    if (length >= sizeof(pending->verb)) length = sizeof(pending->verb) - 1;
+    memcpy(pending->verb, command, length);
+    pending->verb[length] = '\0';
+    pending->sent = sent;
+    client->pending_count++;
 
-    // Парсинг IP адреса и порта из ответа PASV
-    start = strchr(buffer, '(');
-    if (!start) return -1;
-    start++;
+    if (strcmp(pending->verb, "RETR") == 0 || strcmp(pending->verb, "STOR") == 0 ||
+        strcmp(pending->verb, "APPE") == 0) {
+        client->transfer_sent = sent;
+    }
+}
 
-    sscanf(start, "%d,%d,%d,%d,%d,%d", &ip[0], &ip[1], &ip[2], &ip[3], &port[0], &port[1]);
+// Пришёл ответ: задержка засчитывается самой старой ожидающей команде.
+// Предварительный ответ (1xx) тоже закрывает команду, финальный ответ
+// передачи учитывается отдельно как фаза drain
+void metrics_reply(ftp_client_t *client, int code) {
+    pending_command_t *pending;
 
-    // Создание data соединения
-    client->data_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (client->data_socket < 0) {
-        perror("Data socket creation failed");
-        return -1;
+    if (!client->metrics || client->pending_count == 0) {
+        return;
+    }
+    if (code < 0) {
+        client->pending_count = 0;
+        return;
     }
+    pending = &client->pending[client->pending_head];
+    client->pending_head = (client->pending_head + 1) % METRICS_PENDING;
+    client->pending_count--;
+    metrics_record(client, "command", pending->verb, pending->sent, now_seconds(), code);
+}
 
-    memset(&data_addr, 0, sizeof(data_addr));
-    data_addr.sin_family = AF_INET;
-    data_addr.sin_port = htons(port[0] * 256 + port[1]);
-    data_addr.sin_addr.s_addr = htonl((ip[0] << 24) | (ip[1] << 16) | (ip[2] << 8) | ip[3]);
+// Учёт фаз завершённой передачи
+void metrics_transfer(ftp_client_t *client, const char *verb, long long bytes,
+                      double first_byte, double data_end, double reply_end) {
+    ftp_metrics_t *metrics = client->metrics;
+    double start = first_byte > 0 ? first_byte : data_end;
 
-    if (connect(client->data_socket, (struct sockaddr*)&data_addr, sizeof(data_addr)) < 0) {
-        perror("Data connection failed");
-        close(client->data_socket);
-        return -1;
+    if (!metrics) {
+        return;
     }
+    metrics_record(client, "transfer", "first byte", client->transfer_sent, start, 0);
+    metrics_record(client, "transfer", "data", start, data_end, 0);
+    metrics_record(client, "transfer", "drain", data_end, reply_end, 0);
 
-    client->passive_mode = 1;
-    return 0;
+    pthread_mutex_lock(&metrics->lock);
+    if (metrics->transfer_count == metrics->transfer_capacity) {
+        int capacity = metrics->transfer_capacity ? metrics->transfer_capacity * 2 : 64;
+        transfer_record_t *grown = realloc(metrics->transfers, sizeof(*grown) * capacity);
+        if (grown) {
+            metrics->transfers = grown;
+            metrics->transfer_capacity = capacity;
+        }
+    }
+    if (metrics->transfer_count < metrics->transfer_capacity) {
+        transfer_record_t *record = &metrics->transfers[metrics->transfer_count++];
+        snprintf(record->verb, sizeof(record->verb), "%s", verb);
+        record->session = client->session_id;
+        record->bytes = bytes;
+        record->first_byte = start - client->transfer_sent;
+        record->data = data_end - start;
+        record->drain = reply_end - data_end;
+    }
+    pthread_mutex_unlock(&metrics->lock);
 }
 
-// Создание tar архива из каталога
-int create_tar_archive(const char *directory, const char *archive_name) {
-    char command[CMD_SIZE * 2];
+// Приближённый перцентиль по корзинам (верхняя граница корзины), секунды
+double metrics_percentile(const metrics_histogram_t *histogram, double p) {
+    long long rank = (long long)(histogram->count * p / 100.0 + 0.5), seen = 0;
 
-    printf("Creating tar archive: %s from directory: %s\n", archive_name, directory);
-
-    snprintf(command, sizeof(command), "tar -czf %s -C %s .", archive_name, directory);
+    if (rank < 1) rank = 1;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            double upper = (2LL << i) / 1e6;
+            return upper < histogram->max ? upper : histogram->max;
+        }
+    }
+    return histogram->max;
+}
 
-    if (system(command) != 0) {
-        fprintf(stderr, "Failed to create tar archive\n");
-        return -1;
+void metrics_print(ftp_metrics_t *metrics) {
+    pthread_mutex_lock(&metrics->lock);
+    printf("%-12s %-9s %8s %10s %10s %10s %10s %10s\n", "name", "category", "count",
+           "avg ms", "min ms", "p50 ms", "p99 ms", "max ms");
+    for (int i = 0; i < metrics->histogram_count; i++) {
+        metrics_histogram_t *h = &metrics->histograms[i];
+        printf("%-12s %-9s %8lld %10.3f %10.3f %10.3f %10.3f %10.3f\n", h->name, h->category,
+               h->count, h->total / h->count * 1000, h->min * 1000,
+               metrics_percentile(h, 50) * 1000, metrics_percentile(h, 99) * 1000, h->max * 1000);
     }
+    printf("%d sessions, %d transfers, %d trace events", metrics->session_count,
+           metrics->transfer_count, metrics->event_count);
+    if (metrics->events_dropped) {
+        printf(" (%lld dropped)", metrics->events_dropped);
+    }
+    printf("\n");
+    pthread_mutex_unlock(&metrics->lock);
+}
 
-    return 0;
+// Вывод строки в JSON с экранированием
+void json_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') {
+            fprintf(out, "\\%c", *text);
+        } else if ((unsigned char)*text < 0x20) {
+            fprintf(out, "\\u%04x", *text);
+        } else {
+            fputc(*text, out);
+        }
+    }
+    fputc('"', out);
 }
 
-// Извлечение tar архива
-int extract_tar_archive(const char *archive_name, const char *destination) {
-    char command[CMD_SIZE * 2];
+// Сводка в JSON: гистограммы по командам и фазам, список передач
+int metrics_save_stats(ftp_metrics_t *metrics, const char *path) {
+    FILE *out = fopen(path, "w");
 
-    printf("Extracting tar archive: %s to directory: %s\n", archive_name, destination);
+    if (!out) {
+        perror(path);
+        return -1;
+    }
+    pthread_mutex_lock(&metrics->lock);
+    fprintf(out, "{\n  \"histograms\": {");
+    for (int i = 0; i < metrics->histogram_count; i++) {
+        metrics_histogram_t *h = &metrics->histograms[i];
+        int first = 1;
 
-    // Создание целевого каталога если он не существует
-    mkdir(destination, 0755);
+        fprintf(out, "%s\n    ", i ? "," : "");
+        json_string(out, h->name);
+        fprintf(out, ": {\"category\": \"%s\", \"count\": %lld, \"mean_ms\": %.3f, \"min_ms\": %.3f, "
+                "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, \"buckets_us\": {",
+                h->category, h->count, h->total / h->count * 1000, h->min * 1000,
+                metrics_percentile(h, 50) * 1000, metrics_percentile(h, 99) * 1000, h->max * 1000);
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            if (h->buckets[b] == 0) continue;
+            fprintf(out, "%s\"%lld\": %lld", first ? "" : ", ", b ? 1LL << b : 0, h->buckets[b]);
+            first = 0;
+        }
+        fprintf(out, "}}");
+    }
+    fprintf(out, "\n  },\n  \"transfers\": [");
+    for (int i = 0; i < metrics->transfer_count; i++) {
+        transfer_record_t *t = &metrics->transfers[i];
+        fprintf(out, "%s\n    {\"session\": %d, \"verb\": \"%s\", \"bytes\": %lld, \"first_byte_ms\": %.3f, "
+                "\"data_ms\": %.3f, \"drain_ms\": %.3f}", i ? "," : "", t->session, t->verb, t->bytes,
+                t->first_byte * 1000, t->data * 1000, t->drain * 1000);
+    }
+    fprintf(out, "\n  ],\n  \"sessions\": [");
+    for (int i = 0; i < metrics->session_count; i++) {
+        fprintf(out, "%s", i ? ", " : "");
+        json_string(out, metrics->sessions[i]);
+    }
+    fprintf(out, "],\n  \"trace_events_dropped\": %lld\n}\n", metrics->events_dropped);
+    pthread_mutex_unlock(&metrics->lock);
+    return fclose(out) == 0 ? 0 : -1;
+}
 
-    snprintf(command, sizeof(command), "tar -xzf %s -C %s", archive_name, destination);
+// Временная шкала в формате Chrome trace (chrome://tracing, Perfetto):
+// каждая сессия - отдельная дорожка
+int metrics_save_trace(ftp_metrics_t *metrics, const char *path) {
+    FILE *out = fopen(path, "w");
 
-    if (system(command) != 0) {
-        fprintf(stderr, "Failed to extract tar archive\n");
+    if (!out) {
+        perror(path);
         return -1;
     }
+    pthread_mutex_lock(&metrics->lock);
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    for (int i = 0; i < metrics->session_count; i++) {
+        fprintf(out, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": ",
+                i ? "," : "", i + 1);
+        json_string(out, metrics->sessions[i]);
+        fprintf(out, "}}");
+    }
+    for (int i = 0; i < metrics->event_count; i++) {
+        trace_event_t *e = &metrics->events[i];
+        fprintf(out, "%s\n{\"name\": ", i || metrics->session_count ? "," : "");
+        json_string(out, e->name);
+        fprintf(out, ", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+                e->category, e->session, e->start * 1e6, e->duration * 1e6);
+        if (e->code) {
+            fprintf(out, ", \"args\": {\"code\": %d}", e->code);
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n]}\n");
+    pthread_mutex_unlock(&metrics->lock);
+    return fclose(out) == 0 ? 0 : -1;
+}
 
+// Отправка всего буфера в сокет с учётом частичной записи
+int send_all(int socket, const char *data, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t n = send(socket, data + sent, length - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        sent += n;
+    }
     return 0;
 }
 
-// Отправка файла на FTP сервер
-int ftp_upload_file(ftp_client_t *client, const char *local_file, const char *remote_file) {
+// Копирование файла в сокет через промежуточный буфер
+long long send_file_copy(int socket, int fd, long long already_sent, progress_t *progress) {
     char buffer[BUFFER_SIZE];
-    char command[CMD_SIZE];
-    FILE *file;
-    int bytes_read, bytes_sent;
+    long long total = already_sent;
+    ssize_t bytes_read;
 
-    // Переход в пассивный режим
-    if (ftp_passive_mode(client) < 0) {
-        return -1;
+    while ((bytes_read = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            perror("Failed to read local file");
+            return -1;
+        }
+        if (send_all(socket, buffer, bytes_read) < 0) {
+            perror("Failed to send data");
+            return -1;
+        }
+        total += bytes_read;
+        progress_update(progress, bytes_read);
     }
 
-    // Установка бинарного режима
-    send_command(client, "TYPE I");
-    read_response(client->control_socket, buffer, sizeof(buffer));
+    return total;
+}
 
-    // Команда STOR
-    snprintf(command, sizeof(command), "STOR %s", remote_file);
-    send_command(client, command);
-    read_response(client->control_socket, buffer, sizeof(buffer));
+// Отправка файла в режиме MODE Z: поток zlib поверх соединения данных.
+// Если после MODEZ_PROBE байт данные сжимаются хуже MODEZ_POOR_RATIO,
+// уровень сжатия сбрасывается в 0: поток остаётся корректным, но процессор
+// не тратится на несжимаемые данные. В *wire - число байт, ушедших в сеть
+long long send_file_deflate(int socket, int fd, int level, long long *wire, progress_t *progress) {
+    unsigned char *in, *out;
+    long long total = 0;
+    int flush = Z_NO_FLUSH, downgraded = 0, status = 0;
+    z_stream zs;
 
-    if (strncmp(buffer, "150", 3) != 0 && strncmp(buffer, "125", 3) != 0) {
-        close(client->data_socket);
+    *wire = 0;
+    memset(&zs, 0, sizeof(zs));
+    in = malloc(ARCHIVE_CHUNK * 2);
+    if (!in || deflateInit(&zs, level) != Z_OK) {
+        fprintf(stderr, "Failed to initialize deflate\n");
+        free(in);
         return -1;
     }
+    out = in + ARCHIVE_CHUNK;
 
-    // Открытие локального файла
-    file = fopen(local_file, "rb");
-    if (!file) {
-        perror("Failed to open local file");
-        close(client->data_socket);
+    while (flush != Z_FINISH && status == 0) {
+        ssize_t n = read(fd, in, ARCHIVE_CHUNK);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Failed to read local file");
+            status = -1;
+            break;
+        }
+        if (n == 0) flush = Z_FINISH;
+
+        zs.next_in = in;
+        zs.avail_in = n;
+        do {
+            int result;
+
+            zs.next_out = out;
+            zs.avail_out = ARCHIVE_CHUNK;
+            result = deflate(&zs, flush);
+            // Z_BUF_ERROR допустим, только если сжимать было нечего; без
+            // продвижения при непустом входе или при Z_FINISH поток испорчен
+            if (result == Z_STREAM_ERROR ||
+                (result == Z_BUF_ERROR && zs.avail_out == ARCHIVE_CHUNK && (zs.avail_in > 0 || flush == Z_FINISH))) {
+                fprintf(stderr, "Compression failed: %s\n", zs.msg ? zs.msg : "deflate error");
+                status = -1;
+                break;
+            }
+            if (send_all(socket, (char *)out, ARCHIVE_CHUNK - zs.avail_out) < 0) {
+                perror("Failed to send data");
+                status = -1;
+                break;
+            }
+        } while (zs.avail_out == 0);
+        total += n;
+        progress_update(progress, n);
+
+        if (!downgraded && total >= MODEZ_PROBE && zs.total_out > total * MODEZ_POOR_RATIO) {
+            // deflateParams выталкивает уже сжатое; выход отправляем целиком
+            int result;
+            downgraded = 1;
+            do {
+                zs.next_out = out;
+                zs.avail_out = ARCHIVE_CHUNK;
+                result = deflateParams(&zs, 0, Z_DEFAULT_STRATEGY);
+                if (result == Z_STREAM_ERROR) {
+                    fprintf(stderr, "Compression failed: %s\n", zs.msg ? zs.msg : "deflateParams error");
+                    status = -1;
+                    break;
+                }
+                if (send_all(socket, (char *)out, ARCHIVE_CHUNK - zs.avail_out) < 0) {
+                    status = -1;
+                    break;
+                }
+            } while (result == Z_BUF_ERROR);
+        }
+    }
+
+    *wire = zs.total_out;
+    deflateEnd(&zs);
+    free(in);
+    return status < 0 ? -1 : total;
+}
+
+// Отправка файла в сокет без копирования в пользовательское пространство.
+// Обычные файлы идут через sendfile, каналы и прочие потоки - через splice.
+// Если ядро не поддерживает нужный вызов, используется цикл копирования.
+// Метод передачи записывается в *method.
+long long send_file_zero_copy(int socket, int fd, const char **method, progress_t *progress) {
+    struct stat st;
+    long long total = 0;
+    ssize_t n;
+
+    if (fstat(fd, &st) < 0) {
+        perror("fstat failed");
         return -1;
     }
 
-    // Отправка данных
-    printf("Uploading file: %s\n", local_file);
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-        bytes_sent = send(client->data_socket, buffer, bytes_read, 0);
-        if (bytes_sent < 0) {
-            perror("Failed to send data");
+    if (S_ISREG(st.st_mode)) {
+        // Передача с текущей позиции файла (после lseek при докачке)
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (offset < 0) offset = 0;
+        *method = "sendfile";
+        while (1) {
+            n = sendfile(socket, fd, &offset, ZERO_COPY_CHUNK);
+            if (n == 0) break;
+            if (n < 0) {
+                if (errno == EINTR || errno == EAGAIN) continue;
+                if (errno == EINVAL || errno == ENOSYS) {
+                    // sendfile недоступен для этой пары дескрипторов
+                    if (lseek(fd, offset, SEEK_SET) < 0) return -1;
+                    *method = "copy";
+                    return send_file_copy(socket, fd, total, progress);
+                }
+                perror("sendfile failed");
+                return -1;
+            }
+            total += n;
+            progress_update(progress, n);
+        }
+        return total;
+    }
+
+    if (S_ISFIFO(st.st_mode)) {
+        // Источник уже является каналом - splice напрямую в сокет
+        *method = "splice";
+        while (1) {
+            n = splice(fd, NULL, socket, NULL, ZERO_COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n == 0) break;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                    *method = "copy";
+                    return send_file_copy(socket, fd, 0, progress);
+                }
+                perror("splice failed");
+                return -1;
+            }
+            total += n;
+            progress_update(progress, n);
+        }
+        return total;
+    }
+
+    // Прочие потоки (сокеты, устройства) - splice через промежуточный канал
+    int pipefd[2];
+    if (pipe(pipefd) < 0) {
+        *method = "copy";
+        return send_file_copy(socket, fd, 0, progress);
+    }
+    *method = "splice";
+    while (1) {
+        n = splice(fd, NULL, pipefd[1], NULL, ZERO_COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                close(pipefd[0]);
+                close(pipefd[1]);
+                *method = "copy";
+                return send_file_copy(socket, fd, 0, progress);
+            }
+            perror("splice failed");
+            total = -1;
             break;
         }
-        printf(".");
-        fflush(stdout);
+        // Выгружаем из канала всё, что в него попало
+        while (n > 0) {
+            ssize_t out = splice(pipefd[0], NULL, socket, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0) {
+                if (errno == EINTR) continue;
+                perror("splice failed");
+                close(pipefd[0]);
+                close(pipefd[1]);
+                return -1;
+            }
+            n -= out;
+            total += out;
+            progress_update(progress, out);
+        }
     }
-    printf("\n");
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return total;
+}
 
-    fclose(file);
-    close(client->data_socket);
+// Разбор уведомлений MSG_ZEROCOPY из очереди ошибок сокета. Каждое
+// уведомление закрывает диапазон номеров вызовов send; copied - ядро
+// было вынуждено скопировать данные (например, на loopback).
+// wait - ждать хотя бы одного уведомления
+int msgzc_reap(int socket, long long *completed, int *copied, int wait) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 4];
+    struct msghdr msg;
+    struct cmsghdr *cm;
 
-    // Чтение финального ответа
-    read_response(client->control_socket, buffer, sizeof(buffer));
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN || !wait) return errno == EAGAIN ? 0 : -1;
+            // Очередь ошибок пуста: уведомление придёт с подтверждением данных
+            struct pollfd pfd = {socket, 0, 0};
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return -1;
+            continue;
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cm);
 
-    return 0;
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0) {
+                errno = err->ee_errno ? (int)err->ee_errno : EIO;
+                return -1;
+            }
+            *completed += (long long)err->ee_data - err->ee_info + 1;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) *copied = 1;
+        }
+        wait = 0;
+    }
 }
 
-// Получение файла с FTP сервера
-int ftp_download_file(ftp_client_t *client, const char *remote_file, const char *local_file) {
-    char buffer[BUFFER_SIZE];
-    char command[CMD_SIZE];
-    FILE *file;
-    int bytes_received;
+// Отправка обычного файла из mmap через send(MSG_ZEROCOPY): ядро отдаёт
+// сетевой карте страницы кэша напрямую, без копирования в буфер сокета.
+// Страницы закреплены до подтверждения из очереди ошибок, поэтому в полёте
+// не больше MSGZC_INFLIGHT порций. Если ядро сообщает, что всё равно
+// копирует, оставшиеся данные уходят обычным send из того же отображения.
+// Файл не должен укорачиваться во время передачи (SIGBUS при чтении отображения).
+// Без поддержки в ядре возвращается MSGZC_UNSUPPORTED
+long long send_file_msg_zerocopy(int socket, int fd, const char **method, progress_t *progress) {
+    long long total = 0, calls = 0, completed = 0;
+    off_t start = lseek(fd, 0, SEEK_CUR), aligned;
+    int one = 1, copied = 0, flags = MSG_ZEROCOPY;
+    size_t length, skip;
+    struct stat st;
+    char *map;
 
-    // Переход в пассивный режим
-    if (ftp_passive_mode(client) < 0) {
-        return -1;
+    if (start < 0 || fstat(fd, &st) < 0 || start >= st.st_size) {
+        return MSGZC_UNSUPPORTED;
+    }
+    if (setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        return MSGZC_UNSUPPORTED;
+    }
+    // mmap требует смещения, кратного странице; лишнее в начале пропускается
+    aligned = start & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+    skip = start - aligned;
+    length = st.st_size - aligned;
+    map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, aligned);
+    if (map == MAP_FAILED) {
+        return MSGZC_UNSUPPORTED;
+    }
+    madvise(map, length, MADV_SEQUENTIAL);
+    *method = "MSG_ZEROCOPY";
+
+    for (size_t position = skip; position < length; ) {
+        size_t chunk = length - position < MSGZC_CHUNK ? length - position : MSGZC_CHUNK;
+        ssize_t n;
+
+        if (flags && calls - completed >= MSGZC_INFLIGHT &&
+            msgzc_reap(socket, &completed, &copied, 1) < 0) {
+            perror("MSG_ZEROCOPY completion failed");
+            total = -1;
+            break;
+        }
+        if (flags && copied) {
+            // Ядро копирует данные само: уведомления только добавляют работу
+            flags = 0;
+            *method = "mmap+send (zero-copy unavailable on this route)";
+        }
+        n = send(socket, map + position, chunk, flags | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // Исчерпан лимит памяти уведомлений (optmem_max): ждём подтверждений
+            if (errno == ENOBUFS && flags && calls > completed &&
+                msgzc_reap(socket, &completed, &copied, 1) == 0) {
+                continue;
+            }
+            if (errno == ENOBUFS && flags) {
+                flags = 0;
+                continue;
+            }
+            perror("Failed to send data");
+            total = -1;
+            break;
+        }
+        if (flags) {
+            calls++;
+            msgzc_reap(socket, &completed, &copied, 0);
+        }
+        position += n;
+        total += n;
+        progress_update(progress, n);
     }
 
-    // Установка бинарного режима
-    send_command(client, "TYPE I");
-    read_response(client->control_socket, buffer, sizeof(buffer));
+    // Отображение снимается только после подтверждения всех отправок
+    while (total >= 0 && completed < calls) {
+        if (msgzc_reap(socket, &completed, &copied, 1) < 0) {
+            perror("MSG_ZEROCOPY completion failed");
+            total = -1;
+        }
+    }
+    munmap(map, length);
+    return total;
+}
 
-    // Команда RETR
-    snprintf(command, sizeof(command), "RETR %s", remote_file);
-    send_command(client, command);
-    read_response(client->control_socket, buffer, sizeof(buffer));
+// Дочитывание данных управляющего соединения в буфер клиента
+int fill_control_buffer(ftp_client_t *client) {
+    ssize_t n;
 
-    if (strncmp(buffer, "150", 3) != 0 && strncmp(buffer, "125", 3) != 0) {
-        close(client->data_socket);
+    // Сдвигаем неразобранный остаток в начало буфера
+    if (client->control_start > 0) {
+        memmove(client->control_buffer, client->control_buffer + client->control_start,
+                client->control_end - client->control_start);
+        client->control_end -= client->control_start;
+        client->control_start = 0;
+    }
+
+    if (client->control_end == CONTROL_BUFFER_SIZE) {
+        errno = EMSGSIZE;
         return -1;
     }
 
-    // Создание локального файла
-    file = fopen(local_file, "wb");
-    if (!file) {
-        perror("Failed to create local file");
-        close(client->data_socket);
-        return -1;
+    do {
+        n = recv(client->control_socket, client->control_buffer + client->control_end,
+                 CONTROL_BUFFER_SIZE - client->control_end, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        if (n == 0) errno = ECONNRESET;
+        return -1;
+    }
+    client->control_end += n;
+    return 0;
+}
+
+// Код ответа в начале строки ("123 ..." или "123-...") или -1
+int reply_line_code(const char *line, size_t length) {
+    if (length >= 3 && line[0] >= '1' && line[0] <= '5' &&
+        line[1] >= '0' && line[1] <= '9' && line[2] >= '0' && line[2] <= '9') {
+        return (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+    }
+    return -1;
+}
+
+// Разбор одного полного ответа из уже принятых данных без чтения из сокета
+// (для неблокирующих сессий). Возвращает код ответа, 0 если ответ принят
+// не полностью, -1 если ответ не помещается в буфер
+int parse_buffered_reply(ftp_client_t *client, char *reply, int size) {
+    size_t pos = client->control_start;
+    int code = -1;
+
+    while (1) {
+        char *line = client->control_buffer + pos;
+        char *newline = memchr(line, '\n', client->control_end - pos);
+        size_t length;
+        int line_code, last;
+
+        if (!newline) {
+            if (client->control_start == 0 && client->control_end == CONTROL_BUFFER_SIZE) {
+                return -1;
+            }
+            return 0;
+        }
+        length = newline - line;
+        line_code = reply_line_code(line, length);
+        pos = newline - client->control_buffer + 1;
+
+        if (code < 0) {
+            if (line_code < 0) {
+                client->control_start = pos;  // Мусор вне ответа
+                continue;
+            }
+            code = line_code;
+            last = length < 4 || line[3] != '-';
+        } else {
+            last = line_code == code && (length < 4 || line[3] != '-');
+        }
+
+        if (last) {
+            if (reply && size > 0) {
+                size_t total = pos - client->control_start;
+                if (total >= (size_t)size) total = size - 1;
+                memcpy(reply, client->control_buffer + client->control_start, total);
+                reply[total] = '\0';
+            }
+            client->control_start = pos;
+            return code;
+        }
+    }
+}
+
+// Чтение одной строки из управляющего соединения без завершающего CRLF.
+// Строки длиннее буфера усекаются, остаток до перевода строки отбрасывается.
+// Возвращает длину строки или -1 при разрыве соединения
+int read_control_line(ftp_client_t *client, char *line, size_t size) {
+    size_t length = 0;
+    int truncated = 0;
+
+    while (1) {
+        char *start = client->control_buffer + client->control_start;
+        size_t avail = client->control_end - client->control_start;
+        char *newline = memchr(start, '\n', avail);
+        size_t take = newline ? (size_t)(newline - start) : avail;
+
+        if (!truncated) {
+            size_t copy = take < size - 1 - length ? take : size - 1 - length;
+            memcpy(line + length, start, copy);
+            length += copy;
+            truncated = copy < take;
+        }
+
+        if (newline) {
+            client->control_start += take + 1;
+            if (length > 0 && line[length - 1] == '\r') {
+                length--;
+            }
+            line[length] = '\0';
+            return (int)length;
+        }
+
+        // Перевода строки ещё нет - весь остаток уже скопирован
+        client->control_start = client->control_end;
+        if (fill_control_buffer(client) < 0) {
+            return -1;
+        }
+    }
+}
+
+// Чтение полного ответа сервера с учётом многострочных ответов RFC 959
+// ("230-..." до строки "230 ..."). Текст ответа построчно через '\n'
+// сохраняется в buffer (если он задан). Возвращает трёхзначный код
+// ответа или -1 при разрыве соединения
+int read_response(ftp_client_t *client, char *buffer, int size) {
+    char line[BUFFER_SIZE];
+    int code = -1, used = 0, length;
+
+    if (buffer && size > 0) {
+        buffer[0] = '\0';
+    }
+
+    while ((length = read_control_line(client, line, sizeof(line))) >= 0) {
+        int line_code = reply_line_code(line, length);
+
+        if (client->verbose) {
+            printf("Server: %s\n", line);
+        }
+        if (buffer && used + length + 2 <= size) {
+            memcpy(buffer + used, line, length);
+            used += length;
+            buffer[used++] = '\n';
+            buffer[used] = '\0';
+        }
+
+        if (code < 0) {
+            // Первая строка ответа задаёт код; без '-' ответ однострочный
+            if (line_code < 0) continue;
+            code = line_code;
+            if (line[3] != '-') break;
+        } else if (line_code == code && line[3] != '-') {
+            // Последняя строка многострочного ответа
+            break;
+        }
+    }
+
+    metrics_reply(client, length < 0 ? -1 : code);
+
+    // После разрыва или 421 состояние сессии на сервере больше не известно
+    if (length < 0 || code == 421) {
+        ftp_reset_session_state(client);
+        client->disconnected = 1;
+        return length < 0 ? -1 : code;
+    }
+    return code;
+}
+
+// Функция для отправки команды FTP серверу
+int send_command(ftp_client_t *client, const char *command) {
+    char cmd[CMD_SIZE];
+    snprintf(cmd, sizeof(cmd), "%s\r\n", command);
+
+    if (client->verbose) {
+        printf("Client: %s", cmd);
+    }
+    metrics_command_sent(client, command, now_seconds());
+    return send(client->control_socket, cmd, strlen(cmd), MSG_NOSIGNAL);
+}
+
+// Отправка нескольких команд одним пакетом без ожидания ответов.
+// Ответы затем читаются по одному через read_response в том же порядке
+int send_pipelined(ftp_client_t *client, const char **commands, int count) {
+    char batch[CMD_SIZE * 4];
+    size_t used = 0;
+
+    for (int i = 0; i < count; i++) {
+        int n = snprintf(batch + used, sizeof(batch) - used, "%s\r\n", commands[i]);
+        if (n < 0 || used + n >= sizeof(batch)) {
+            return -1;
+        }
+        if (client->verbose) {
+            printf("Client: %s", batch + used);
+        }
+        used += n;
+        metrics_command_sent(client, commands[i], now_seconds());
+    }
+    return send_all(client->control_socket, batch, used);
+}
+
+// Отправка команды и чтение ответа. Возвращает код ответа или -1
+int ftp_command(ftp_client_t *client, const char *command, char *reply, int size) {
+    if (send_command(client, command) < 0) {
+        return -1;
+    }
+    return read_response(client, reply, size);
+}
+
+// Установка соединения с FTP сервером
+int ftp_connect(ftp_client_t *client, const char *server, int port) {
+    struct addrinfo hints, *address;
+    char port_text[16];
+    double started, resolved, connected;
+    int code;
+
+    // Создание сокета
+    client->control_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (client->control_socket < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    // Получение IP адреса сервера. getaddrinfo, в отличие от gethostbyname,
+    // безопасен при подключении сразу из нескольких потоков (пул, сегменты)
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_text, sizeof(port_text), "%d", port);
+    started = now_seconds();
+    code = getaddrinfo(server, port_text, &hints, &address);
+    resolved = now_seconds();
+    if (code != 0) {
+        fprintf(stderr, "Failed to resolve hostname: %s (%s)\n", server, gai_strerror(code));
+        close(client->control_socket);
+        return -1;
+    }
+
+    // Подключение к серверу
+    if (connect(client->control_socket, address->ai_addr, address->ai_addrlen) < 0) {
+        perror("Connection failed");
+        freeaddrinfo(address);
+        close(client->control_socket);
+        return -1;
+    }
+    freeaddrinfo(address);
+    connected = now_seconds();
+
+    strcpy(client->server, server);
+    client->port = port;
+    strcpy(client->current_dir, "/");  // Инициализация текущего каталога
+
+    client->control_start = 0;
+    client->control_end = 0;
+    client->disconnected = 0;
+    ftp_reset_session_state(client);
+
+    // Приветствие учитывается в метриках как ответ на установку соединения
+    client->pending_count = 0;
+    if (client->metrics) {
+        metrics_record(client, "connect", "DNS", started, resolved, 0);
+        metrics_record(client, "connect", "TCP connect", resolved, connected, 0);
+        metrics_command_sent(client, "BANNER", connected);
+    }
+
+    // Чтение приветственного сообщения (120 - сервер просит подождать)
+    code = read_response(client, NULL, 0);
+    if (code == 120) {
+        code = read_response(client, NULL, 0);
+    }
+    if (code != 220) {
+        fprintf(stderr, "Unexpected greeting from server\n");
+        close(client->control_socket);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Аутентификация на FTP сервере
+int ftp_login(ftp_client_t *client, const char *username, const char *password) {
+    char command[CMD_SIZE];
+    int code;
+
+    // Отправка имени пользователя
+    snprintf(command, sizeof(command), "USER %s", username);
+    code = ftp_command(client, command, NULL, 0);
+
+    // Отправка пароля (230 на USER означает вход без пароля)
+    if (code == 331 || code == 332) {
+        snprintf(command, sizeof(command), "PASS %s", password);
+        code = ftp_command(client, command, NULL, 0);
+    }
+
+    strcpy(client->username, username);
+    strcpy(client->password, password);
+    ftp_reset_session_state(client);
+
+    // После успешной авторизации получаем текущий каталог
+    if (code == 230 || code == 202) {
+        ftp_pwd(client);  // Получаем текущий каталог
+        return 0;
+    }
+
+    return -1;
+}
+
+// Получение текущего рабочего каталога
+int ftp_pwd(ftp_client_t *client) {
+    char buffer[BUFFER_SIZE];
+
+    if (ftp_command(client, "PWD", buffer, sizeof(buffer)) == 257) {
+        // Парсинг ответа PWD для извлечения пути
+        char *start = strchr(buffer, '"');
+        if (start) {
+            start++;
+            char *end = strchr(start, '"');
+            if (end) {
+                *end = '\0';
+                snprintf(client->current_dir, sizeof(client->current_dir), "%s", start);
+                client->cwd_confirmed = 1;
+            }
+        }
+        return 0;
+    }
+
+    return -1;
+}
+
+// Построение абсолютного пути на сервере относительно base
+// с обработкой компонентов "." и ".."
+void resolve_remote_path(const char *base, const char *path, char *out, size_t size) {
+    char joined[MAX_PATH * 2];
+    char *parts[MAX_PATH];
+    char *token, *saveptr;
+    int count = 0;
+    size_t used;
+
+    if (path[0] == '/') {
+        snprintf(joined, sizeof(joined), "%s", path);
+    } else {
+        snprintf(joined, sizeof(joined), "%s/%s", base, path);
+    }
+
+    for (token = strtok_r(joined, "/", &saveptr); token; token = strtok_r(NULL, "/", &saveptr)) {
+        if (strcmp(token, ".") == 0) continue;
+        if (strcmp(token, "..") == 0) {
+            if (count > 0) count--;
+            continue;
+        }
+        parts[count++] = token;
+    }
+
+    out[0] = '\0';
+    used = 0;
+    for (int i = 0; i < count && used < size; i++) {
+        used += snprintf(out + used, size - used, "/%s", parts[i]);
+    }
+    if (count == 0) {
+        snprintf(out, size, "/");
+    }
+}
+
+// Смена рабочего каталога. Переход в уже подтверждённый текущий каталог
+// не требует обращения к серверу
+int ftp_cwd(ftp_client_t *client, const char *directory) {
+    char command[CMD_SIZE];
+    char target[MAX_PATH];
+
+    resolve_remote_path(client->current_dir, directory, target, sizeof(target));
+    if (client->cwd_confirmed && strcmp(target, client->current_dir) == 0) {
+        printf("Already in directory: %s\n", client->current_dir);
+        return 0;
+    }
+
+    snprintf(command, sizeof(command), "CWD %s", directory);
+    if (ftp_command(client, command, NULL, 0) == 250) {
+        // Обновляем локальное представление текущего каталога
+        snprintf(client->current_dir, sizeof(client->current_dir), "%s", target);
+        client->cwd_confirmed = 1;
+
+        printf("Changed to directory: %s\n", client->current_dir);
+        return 0;
+    }
+
+    return -1;
+}
+
+// Запрос возможностей сервера (FEAT) один раз за сессию
+void ftp_feat(ftp_client_t *client) {
+    char buffer[CONTROL_BUFFER_SIZE];
+    char *line, *saveptr;
+
+    client->features_known = 1;
+    client->features = 0;
+    if (ftp_command(client, "FEAT", buffer, sizeof(buffer)) != 211) {
+        return;
+    }
+
+    // Каждая возможность - отдельная строка, начинающаяся с пробела
+    for (line = strtok_r(buffer, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        if (line[0] != ' ') continue;
+        line++;
+        if (strncasecmp(line, "SIZE", 4) == 0) client->features |= FEAT_SIZE;
+        else if (strncasecmp(line, "MDTM", 4) == 0) client->features |= FEAT_MDTM;
+        else if (strncasecmp(line, "REST STREAM", 11) == 0) client->features |= FEAT_REST;
+        else if (strncasecmp(line, "MLST", 4) == 0) client->features |= FEAT_MLST;
+        else if (strncasecmp(line, "EPSV", 4) == 0) client->features |= FEAT_EPSV;
+        else if (strncasecmp(line, "MODE Z", 6) == 0) client->features |= FEAT_MODEZ;
+        else if (strncasecmp(line, "UTF8", 4) == 0) client->features |= FEAT_UTF8;
+    }
+}
+
+// Проверка возможности сервера; FEAT запрашивается при первом обращении.
+// Если сервер не поддерживает FEAT, считаем, что возможность есть
+int ftp_has_feature(ftp_client_t *client, unsigned int feature) {
+    if (!client->features_known) {
+        ftp_feat(client);
+    }
+    return client->features == 0 || (client->features & feature) != 0;
+}
+
+// Установка типа передачи, если он ещё не установлен
+int ftp_set_type(ftp_client_t *client, char type) {
+    char command[CMD_SIZE];
+
+    if (client->transfer_type == type) {
+        return 0;
+    }
+
+    snprintf(command, sizeof(command), "TYPE %c", type);
+    if (ftp_command(client, command, NULL, 0) != 200) {
+        client->transfer_type = 0;
+        return -1;
+    }
+    client->transfer_type = type;
+    return 0;
+}
+
+// Установка режима передачи (MODE S или Z), если он ещё не установлен.
+// Режим по умолчанию - S. Для MODE Z серверу сообщается уровень сжатия;
+// отказ в OPTS не мешает сжатию с уровнем сервера по умолчанию
+int ftp_set_mode(ftp_client_t *client, char mode) {
+    char command[CMD_SIZE];
+
+    if (client->transfer_mode == mode || (mode == 'S' && client->transfer_mode == 0)) {
+        return 0;
+    }
+
+    snprintf(command, sizeof(command), "MODE %c", mode);
+    if (ftp_command(client, command, NULL, 0) != 200) {
+        return -1;
+    }
+    client->transfer_mode = mode;
+    if (mode == 'Z' && client->server_z_level != client->compress_level) {
+        snprintf(command, sizeof(command), "OPTS MODE Z LEVEL %d", client->compress_level);
+        ftp_command(client, command, NULL, 0);
+        client->server_z_level = client->compress_level;
+    }
+    return 0;
+}
+
+// Расширения уже сжатых форматов: MODE Z для них бесполезен
+static const char *compressed_extensions[] = {
+    "gz", "tgz", "bz2", "xz", "zst", "lz4", "zip", "7z", "rar", "jar",
+    "jpg", "jpeg", "png", "gif", "webp", "mp3", "mp4", "mkv", "avi", "mov", NULL
+};
+
+const char *file_extension(const char *name) {
+    const char *base = strrchr(name, '/');
+    const char *dot;
+
+    base = base ? base + 1 : name;
+    dot = strrchr(base, '.');
+    return dot && dot != base ? dot + 1 : "";
+}
+
+// Запоминание расширения, файлы с которым плохо сжались в этой сессии
+void ftp_mode_z_learn(ftp_client_t *client, const char *name, long long raw, long long wire) {
+    const char *extension = file_extension(name);
+
+    if (raw < MODEZ_PROBE || wire <= raw * MODEZ_POOR_RATIO || !extension[0] ||
+        strlen(extension) >= sizeof(client->incompressible[0]) || client->incompressible_count == MODEZ_LEARNED) {
+        return;
+    }
+    for (int i = 0; i < client->incompressible_count; i++) {
+        if (strcasecmp(client->incompressible[i], extension) == 0) return;
+    }
+    strcpy(client->incompressible[client->incompressible_count++], extension);
+    if (client->verbose) {
+        printf("*.%s compresses poorly (%.0f%%), MODE Z disabled for it\n", extension, 100.0 * wire / raw);
+    }
+}
+
+// Файл заведомо сжатого формата (по расширению)
+int known_compressed(const char *name) {
+    const char *extension = file_extension(name);
+
+    for (int i = 0; compressed_extensions[i]; i++) {
+        if (strcasecmp(extension, compressed_extensions[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+// Проба сжимаемости: до MODEZ_SAMPLE байт файла с offset сжимаются
+// уровнем 1. Возвращается размер результата, в raw - размер пробы;
+// -1, если файл слишком мал для оценки
+long long compress_sample(int fd, off_t offset, long long *raw) {
+    unsigned char *sample = malloc(MODEZ_SAMPLE + compressBound(MODEZ_SAMPLE));
+    uLongf packed = compressBound(MODEZ_SAMPLE);
+    ssize_t n = sample ? pread(fd, sample, MODEZ_SAMPLE, offset) : -1;
+    long long result = -1;
+
+    if (n >= 4096 && compress2(sample + MODEZ_SAMPLE, &packed, sample, n, 1) == Z_OK) {
+        *raw = n;
+        result = packed;
+    }
+    free(sample);
+    return result;
+}
+
+// Стоит ли передавать файл в MODE Z: сжатие включено, сервер его
+// поддерживает, формат не из заведомо сжатых и не плохо сжавшихся ранее.
+// Для отправляемого файла (fd >= 0) сжимаемость оценивается по пробе
+int ftp_mode_z_useful(ftp_client_t *client, const char *name, int fd) {
+    const char *extension = file_extension(name);
+
+    if (!client->mode_z || !ftp_has_feature(client, FEAT_MODEZ) || known_compressed(name)) {
+        return 0;
+    }
+    for (int i = 0; i < client->incompressible_count; i++) {
+        if (strcasecmp(extension, client->incompressible[i]) == 0) return 0;
+    }
+
+    if (fd >= 0) {
+        long long raw, packed = compress_sample(fd, 0, &raw);
+
+        return packed < 0 || packed <= raw * MODEZ_POOR_RATIO;
+    }
+    return 1;
+}
+
+// Запись всего буфера в файл с учётом частичной записи
+int write_all(int fd, const char *data, size_t length) {
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = write(fd, data + written, length - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+// Приём данных из сокета в файл через выровненный буфер большого размера
+long long recv_file_buffered(int socket, int fd, size_t buffer_size, long long already_received,
+                             progress_t *progress) {
+    long long total = already_received;
+    ssize_t bytes_received;
+    void *buffer;
+
+    if (posix_memalign(&buffer, 4096, buffer_size) != 0) {
+        fprintf(stderr, "Failed to allocate %zu byte receive buffer\n", buffer_size);
+        return -1;
+    }
+
+    while ((bytes_received = recv(socket, buffer, buffer_size, 0)) != 0) {
+        if (bytes_received < 0) {
+            if (errno == EINTR) continue;
+            perror("Failed to receive data");
+            total = -1;
+            break;
+        }
+        if (write_all(fd, buffer, bytes_received) < 0) {
+            perror("Failed to write local file");
+            total = -1;
+            break;
+        }
+        total += bytes_received;
+        progress_update(progress, bytes_received);
+    }
+
+    free(buffer);
+    return total;
+}
+
+// Приём файла в режиме MODE Z: распаковка потока zlib из соединения
+// данных. В *wire - число принятых из сети байт
+long long recv_file_inflate(int socket, int fd, size_t buffer_size, long long *wire, progress_t *progress) {
+    unsigned char *in, *out;
+    long long total = 0;
+    int status = Z_OK;
+    z_stream zs;
+
+    *wire = 0;
+    memset(&zs, 0, sizeof(zs));
+    in = malloc(buffer_size + ARCHIVE_CHUNK);
+    if (!in || inflateInit(&zs) != Z_OK) {
+        fprintf(stderr, "Failed to initialize inflate\n");
+        free(in);
+        return -1;
+    }
+    out = in + buffer_size;
+
+    while (status != Z_STREAM_END) {
+        ssize_t n = recv(socket, in, buffer_size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("Failed to receive data");
+            total = -1;
+            break;
+        }
+        if (n == 0) {
+            fprintf(stderr, "Compressed stream ended prematurely\n");
+            total = -1;
+            break;
+        }
+        *wire += n;
+
+        zs.next_in = in;
+        zs.avail_in = n;
+        do {
+            size_t produced;
+
+            zs.next_out = out;
+            zs.avail_out = ARCHIVE_CHUNK;
+            status = inflate(&zs, Z_NO_FLUSH);
+            if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+                fprintf(stderr, "Corrupt compressed stream: %s\n", zs.msg ? zs.msg : "inflate failed");
+                total = -1;
+                break;
+            }
+            produced = ARCHIVE_CHUNK - zs.avail_out;
+            if (produced && write_all(fd, (char *)out, produced) < 0) {
+                perror("Failed to write local file");
+                total = -1;
+                break;
+            }
+            total += produced;
+            progress_update(progress, produced);
+        } while (zs.avail_out == 0 && status != Z_STREAM_END);
+        if (total < 0) break;
+    }
+
+    inflateEnd(&zs);
+    free(in);
+    return total;
+}
+
+// Приём данных из сокета в файл через канал (socket -> pipe -> file) без
+// копирования в пользовательское пространство. Если splice не поддерживается
+// для сокета или файловой системы, используется буферизованный приём.
+long long recv_file_splice(int socket, int fd, size_t buffer_size, const char **method,
+                           progress_t *progress) {
+    long long total = 0;
+    int pipefd[2];
+    ssize_t n;
+
+    if (pipe(pipefd) < 0) {
+        *method = "copy";
+        return recv_file_buffered(socket, fd, buffer_size, 0, progress);
+    }
+    // Увеличиваем канал, чтобы за один вызов переносить больше данных
+    fcntl(pipefd[1], F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+
+    *method = "splice";
+    while (1) {
+        n = splice(socket, NULL, pipefd[1], NULL, PIPE_BUFFER_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                close(pipefd[0]);
+                close(pipefd[1]);
+                *method = "copy";
+                return recv_file_buffered(socket, fd, buffer_size, 0, progress);
+            }
+            perror("splice failed");
+            total = -1;
+            break;
+        }
+        while (n > 0) {
+            ssize_t out = splice(pipefd[0], NULL, fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0) {
+                if (errno == EINTR) continue;
+                perror("splice failed");
+                close(pipefd[0]);
+                close(pipefd[1]);
+                return -1;
+            }
+            n -= out;
+            total += out;
+            progress_update(progress, out);
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return total;
+}
+
+// Кольцо io_uring поверх системных вызовов (без liburing)
+typedef struct {
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    int fixed_buffers;      // Буферы зарегистрированы: чтение/запись файла через *_FIXED
+} ftp_ring_t;
+
+// Состояния буфера в конвейере io_uring
+enum {
+    SLOT_FREE,
+    SLOT_BUSY,    // Чтение из файла или приём из сокета в процессе
+    SLOT_FILLED,  // Данные готовы к отправке или записи
+    SLOT_DRAIN    // Отправка или запись в процессе
+};
+
+typedef struct {
+    char *data;
+    size_t length;          // Байт данных в буфере
+    size_t done;            // Уже отправлено/записано
+    long long offset;       // Смещение данных в файле
+    int state;
+    int result;             // Результат последней операции над буфером
+} ring_slot_t;
+
+void ring_close(ftp_ring_t *ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+}
+
+int ring_init(ftp_ring_t *ring, unsigned int entries) {
+    struct io_uring_params params;
+    char *sq, *cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        ring_close(ring);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            ring_close(ring);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        ring_close(ring);
+        return -1;
+    }
+
+    sq = ring->sq_ring;
+    cq = ring->cq_ring;
+    ring->entries = params.sq_entries;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+// Проверка (один раз на процесс), что ядро умеет всё нужное: цепочки с
+// повтором неполных send/recv (IORING_FEAT_LINKED_FILE появился в том же
+// выпуске) и операции READ_FIXED, WRITE_FIXED, SEND, RECV
+int ring_supported(void) {
+    static int supported = -1;
+    int result = __atomic_load_n(&supported, __ATOMIC_ACQUIRE);
+    struct io_uring_params params;
+    struct io_uring_probe *probe;
+    size_t probe_size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    static const int required[] = {
+        IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_SEND, IORING_OP_RECV
+    };
+    int fd;
+
+    if (result >= 0) {
+        return result;
+    }
+
+    result = 0;
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, 4, &params);
+    probe = calloc(1, probe_size);
+    if (fd >= 0 && probe && (params.features & IORING_FEAT_LINKED_FILE) &&
+        syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        result = 1;
+        for (size_t i = 0; i < sizeof(required) / sizeof(required[0]); i++) {
+            if (required[i] > probe->last_op ||
+                !(probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED)) {
+                result = 0;
+            }
+        }
+    }
+    free(probe);
+    if (fd >= 0) close(fd);
+
+    __atomic_store_n(&supported, result, __ATOMIC_RELEASE);
+    return result;
+}
+
+// Следующий свободный SQE; ядро увидит его после ring_submit_and_wait
+struct io_uring_sqe *ring_get_sqe(ftp_ring_t *ring, unsigned int *queued) {
+    unsigned int tail = *ring->sq_tail + *queued;
+    unsigned int index;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries) {
+        return NULL;
+    }
+    index = tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    (*queued)++;
+    return sqe;
+}
+
+// Подготовка SQE операции над буфером слота
+void ring_prep(ftp_ring_t *ring, struct io_uring_sqe *sqe, int opcode, int fd, int slot,
+               char *data, size_t length, long long offset) {
+    // Без зарегистрированных буферов используются обычные READ/WRITE
+    if (!ring->fixed_buffers && opcode == IORING_OP_READ_FIXED) opcode = IORING_OP_READ;
+    if (!ring->fixed_buffers && opcode == IORING_OP_WRITE_FIXED) opcode = IORING_OP_WRITE;
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)data;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = slot;
+    if (opcode == IORING_OP_READ_FIXED || opcode == IORING_OP_WRITE_FIXED) {
+        sqe->buf_index = slot;
+    }
+    if (opcode == IORING_OP_SEND || opcode == IORING_OP_RECV) {
+        // MSG_WAITALL: ядро само дозаписывает неполные операции, а неполный
+        // результат рвёт цепочку, не допуская перестановки данных в потоке
+        sqe->msg_flags = MSG_WAITALL | (opcode == IORING_OP_SEND ? MSG_NOSIGNAL : 0);
+    }
+}
+
+// Отправка подготовленных SQE и ожидание всех их завершений.
+// Результаты записываются в slots[user_data].result
+int ring_submit_and_wait(ftp_ring_t *ring, unsigned int queued, ring_slot_t *slots) {
+    unsigned int completed = 0;
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + queued, __ATOMIC_RELEASE);
+    while (completed < queued) {
+        unsigned int head = *ring->cq_head;
+        unsigned int pending = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            slots[cqe->user_data].result = cqe->res;
+            head++;
+            completed++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        if (completed >= queued) break;
+
+        if (syscall(__NR_io_uring_enter, ring->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR) {
+            perror("io_uring_enter failed");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Выделение и регистрация буферов конвейера
+int ring_setup_slots(ftp_ring_t *ring, ring_slot_t *slots, size_t chunk) {
+    struct iovec iov[URING_SLOTS];
+
+    memset(slots, 0, sizeof(ring_slot_t) * URING_SLOTS);
+    for (int i = 0; i < URING_SLOTS; i++) {
+        if (posix_memalign((void **)&slots[i].data, 4096, chunk) != 0) {
+            return -1;
+        }
+        iov[i].iov_base = slots[i].data;
+        iov[i].iov_len = chunk;
+    }
+    // Регистрация может не пройти (лимит памяти) - тогда обычные READ/WRITE
+    ring->fixed_buffers = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+                                  iov, URING_SLOTS) == 0;
+    return 0;
+}
+
+void ring_free_slots(ring_slot_t *slots) {
+    for (int i = 0; i < URING_SLOTS; i++) {
+        free(slots[i].data);
+    }
+}
+
+// Размер буфера одного слота: bufsize делится между половинами конвейера
+size_t ring_chunk_size(size_t buffer_size) {
+    size_t chunk = buffer_size / (URING_SLOTS / 2);
+    return chunk < URING_MIN_CHUNK ? URING_MIN_CHUNK : chunk;
+}
+
+// Отправка обычного файла через io_uring. За один вход в ядро половина буферов
+// читается из файла (READ_FIXED по явным смещениям, параллельно), а уже
+// прочитанные уходят в сокет цепочкой связанных SEND, сохраняющей порядок.
+// Если кольцо создать не удалось, используется цикл копирования
+long long ring_send_file(int socket, int fd, size_t buffer_size, const char **method,
+                         progress_t *progress) {
+    ring_slot_t slots[URING_SLOTS];
+    size_t chunk = ring_chunk_size(buffer_size);
+    long long file_end, start, read_pos, sent_pos;
+    ftp_ring_t ring;
+    struct stat st;
+
+    // Чтение идёт по явным смещениям, начиная с текущей позиции файла
+    start = lseek(fd, 0, SEEK_CUR);
+    if (start < 0) start = 0;
+    read_pos = sent_pos = start;
+
+    if (fstat(fd, &st) < 0 || ring_init(&ring, URING_SLOTS * 2) < 0) {
+        *method = "copy";
+        return send_file_copy(socket, fd, 0, progress);
+    }
+    if (ring_setup_slots(&ring, slots, chunk) < 0) {
+        fprintf(stderr, "Failed to allocate io_uring buffers\n");
+        ring_free_slots(slots);
+        ring_close(&ring);
+        return -1;
+    }
+    *method = ring.fixed_buffers ? "io_uring" : "io_uring (unregistered buffers)";
+    file_end = st.st_size;
+
+    while (sent_pos < file_end) {
+        struct io_uring_sqe *sqe, *previous = NULL;
+        int order[URING_SLOTS], sends = 0, reads = 0;
+        unsigned int queued = 0;
+        long long pos = sent_pos;
+
+        // Цепочка отправок заполненных буферов строго по порядку смещений
+        for (int found = 1; found; ) {
+            found = 0;
+            for (int i = 0; i < URING_SLOTS; i++) {
+                if (slots[i].state == SLOT_FILLED && slots[i].offset + (long long)slots[i].done == pos) {
+                    sqe = ring_get_sqe(&ring, &queued);
+                    ring_prep(&ring, sqe, IORING_OP_SEND, socket, i, slots[i].data + slots[i].done,
+                              slots[i].length - slots[i].done, 0);
+                    if (previous) previous->flags |= IOSQE_IO_LINK;
+                    previous = sqe;
+                    slots[i].state = SLOT_DRAIN;
+                    order[sends++] = i;
+                    pos = slots[i].offset + slots[i].length;
+                    found = 1;
+                }
+            }
+        }
+
+        // Упреждающее чтение в свободные буферы, не больше половины за раз
+        for (int i = 0; i < URING_SLOTS && reads < URING_SLOTS / 2 && read_pos < file_end; i++) {
+            if (slots[i].state == SLOT_FREE) {
+                size_t length = file_end - read_pos < (long long)chunk ? (size_t)(file_end - read_pos) : chunk;
+                sqe = ring_get_sqe(&ring, &queued);
+                ring_prep(&ring, sqe, IORING_OP_READ_FIXED, fd, i, slots[i].data, length, read_pos);
+                slots[i].state = SLOT_BUSY;
+                slots[i].offset = read_pos;
+                slots[i].length = length;
+                slots[i].done = 0;
+                read_pos += length;
+                reads++;
+            }
+        }
+
+        if (ring_submit_and_wait(&ring, queued, slots) < 0) {
+            sent_pos = -1;
+            break;
+        }
+
+        // Итоги отправки: после первого неполного результата цепочка прервана
+        for (int k = 0, broken = 0; k < sends; k++) {
+            ring_slot_t *slot = &slots[order[k]];
+            int result = slot->result;
+
+            if (result > 0 && broken) {
+                // Ядро продолжило цепочку после неполной отправки - порядок нарушен
+                fprintf(stderr, "io_uring send chain reordered data\n");
+                sent_pos = -1;
+                break;
+            }
+            slot->state = SLOT_FILLED;
+            if (result == -ECANCELED || result == -EINTR || result == -EAGAIN) {
+                broken = 1;
+                continue;
+            }
+            if (result < 0) {
+                errno = -result;
+                perror("Failed to send data");
+                sent_pos = -1;
+                break;
+            }
+            slot->done += result;
+            sent_pos += result;
+            progress_update(progress, result);
+            if (slot->done == slot->length) {
+                slot->state = SLOT_FREE;
+            } else {
+                broken = 1;
+            }
+        }
+        if (sent_pos < 0) break;
+
+        // Итоги чтения; короткое чтение означает, что файл укоротился
+        for (int i = 0; i < URING_SLOTS; i++) {
+            if (slots[i].state != SLOT_BUSY) continue;
+            if (slots[i].result < 0) {
+                errno = -slots[i].result;
+                perror("Failed to read local file");
+                sent_pos = -1;
+                break;
+            }
+            slots[i].state = SLOT_FILLED;
+            if ((size_t)slots[i].result < slots[i].length) {
+                slots[i].length = slots[i].result;
+                if (slots[i].offset + (long long)slots[i].length < file_end) {
+                    file_end = slots[i].offset + slots[i].length;
+                }
+            }
+        }
+        if (sent_pos < 0) break;
+    }
+
+    ring_free_slots(slots);
+    ring_close(&ring);
+    return sent_pos < 0 ? -1 : sent_pos - start;
+}
+
+// Приём из сокета в файл через io_uring. Приём идёт цепочкой связанных RECV
+// в половину буферов, одновременно заполненные буферы пишутся в файл
+// WRITE_FIXED по своим смещениям. Если кольцо создать не удалось,
+// используется буферизованный приём
+long long ring_recv_file(int socket, int fd, size_t buffer_size, const char **method,
+                         progress_t *progress) {
+    ring_slot_t slots[URING_SLOTS];
+    size_t chunk = ring_chunk_size(buffer_size);
+    long long stream_pos, written = 0;
+    int eof = 0, failed = 0;
+    ftp_ring_t ring;
+
+    // Запись идёт по явным смещениям, начиная с текущей позиции файла
+    stream_pos = lseek(fd, 0, SEEK_CUR);
+    if (stream_pos < 0) stream_pos = 0;
+
+    if (ring_init(&ring, URING_SLOTS * 2) < 0) {
+        *method = "copy";
+        return recv_file_buffered(socket, fd, buffer_size, 0, progress);
+    }
+    if (ring_setup_slots(&ring, slots, chunk) < 0) {
+        fprintf(stderr, "Failed to allocate io_uring buffers\n");
+        ring_free_slots(slots);
+        ring_close(&ring);
+        return -1;
+    }
+    *method = ring.fixed_buffers ? "io_uring" : "io_uring (unregistered buffers)";
+
+    while (!failed) {
+        struct io_uring_sqe *sqe, *previous = NULL;
+        int order[URING_SLOTS], receives = 0, writes = 0;
+        unsigned int queued = 0;
+
+        // Запись принятых буферов; смещения явные, порядок не важен
+        for (int i = 0; i < URING_SLOTS; i++) {
+            if (slots[i].state == SLOT_FILLED) {
+                sqe = ring_get_sqe(&ring, &queued);
+                ring_prep(&ring, sqe, IORING_OP_WRITE_FIXED, fd, i, slots[i].data + slots[i].done,
+                          slots[i].length - slots[i].done, slots[i].offset + slots[i].done);
+                slots[i].state = SLOT_DRAIN;
+                writes++;
+            }
+        }
+
+        // Цепочка приёма: данные ложатся в буферы в порядке цепочки
+        for (int i = 0; i < URING_SLOTS && !eof && receives < URING_SLOTS / 2; i++) {
+            if (slots[i].state == SLOT_FREE) {
+                sqe = ring_get_sqe(&ring, &queued);
+                ring_prep(&ring, sqe, IORING_OP_RECV, socket, i, slots[i].data, chunk, 0);
+                if (previous) previous->flags |= IOSQE_IO_LINK;
+                previous = sqe;
+                slots[i].state = SLOT_BUSY;
+                order[receives++] = i;
+            }
+        }
+
+        if (queued == 0) break;
+        if (ring_submit_and_wait(&ring, queued, slots) < 0) {
+            failed = 1;
+            break;
+        }
+
+        for (int k = 0; k < receives; k++) {
+            ring_slot_t *slot = &slots[order[k]];
+
+            slot->state = SLOT_FREE;
+            if (slot->result == 0) {
+                eof = 1;
+            } else if (slot->result > 0) {
+                if (eof) {
+                    // Данные после конца потока возможны только при нарушении цепочки
+                    fprintf(stderr, "io_uring receive chain reordered data\n");
+                    failed = 1;
+                    break;
+                }
+                slot->state = SLOT_FILLED;
+                slot->offset = stream_pos;
+                slot->length = slot->result;
+                slot->done = 0;
+                stream_pos += slot->result;
+            } else if (slot->result != -ECANCELED && slot->result != -EINTR && slot->result != -EAGAIN) {
+                errno = -slot->result;
+                perror("Failed to receive data");
+                failed = 1;
+                break;
+            }
+        }
+
+        for (int i = 0; i < URING_SLOTS && writes > 0; i++) {
+            if (slots[i].state != SLOT_DRAIN) continue;
+            if (slots[i].result < 0 && slots[i].result != -EINTR && slots[i].result != -EAGAIN) {
+                errno = -slots[i].result;
+                perror("Failed to write local file");
+                failed = 1;
+                break;
+            }
+            if (slots[i].result > 0) {
+                slots[i].done += slots[i].result;
+                written += slots[i].result;
+                progress_update(progress, slots[i].result);
+            }
+            slots[i].state = slots[i].done == slots[i].length ? SLOT_FREE : SLOT_FILLED;
+        }
+    }
+
+    if (failed) {
+        // Буферы пишутся не по порядку: оставляем только непрерывно записанное
+        // начало, чтобы докачка не приняла дыру в файле за полученные данные
+        long long intact = stream_pos;
+        for (int i = 0; i < URING_SLOTS; i++) {
+            if ((slots[i].state == SLOT_FILLED || slots[i].state == SLOT_DRAIN) &&
+                slots[i].offset + (long long)slots[i].done < intact) {
+                intact = slots[i].offset + slots[i].done;
+            }
+        }
+        if (ftruncate(fd, intact) == 0) lseek(fd, intact, SEEK_SET);
+    }
+
+    ring_free_slots(slots);
+    ring_close(&ring);
+    return failed ? -1 : written;
+}
+
+// Извлечение размера файла из ответа 150 вида "... (12345 bytes)"
+long long parse_size_from_reply(const char *reply) {
+    const char *p = strrchr(reply, '(');
+    long long size;
+
+    if (p && sscanf(p, "(%lld bytes)", &size) == 1) {
+        return size;
+    }
+    return -1;
+}
+
+// Получение размера файла на сервере командой SIZE
+long long ftp_size(ftp_client_t *client, const char *remote_file) {
+    char buffer[BUFFER_SIZE];
+    char command[CMD_SIZE];
+    long long size;
+
+    if (!ftp_has_feature(client, FEAT_SIZE)) {
+        return -1;
+    }
+
+    snprintf(command, sizeof(command), "SIZE %s", remote_file);
+    if (ftp_command(client, command, buffer, sizeof(buffer)) == 213 &&
+        sscanf(buffer + 4, "%lld", &size) == 1) {
+        return size;
+    }
+    return -1;
+}
+
+// Открытие соединения данных по адресу из ответа 227 на PASV
+int ftp_open_data_connection(ftp_client_t *client, const char *reply) {
+    const char *start;
+    int ip[4], port[2];
+    struct sockaddr_in data_addr;
+
+    // Парсинг IP адреса и порта из ответа PASV
+    start = strchr(reply, '(');
+    if (!start) return -1;
+    start++;
+
+    if (sscanf(start, "%d,%d,%d,%d,%d,%d", &ip[0], &ip[1], &ip[2], &ip[3], &port[0], &port[1]) != 6) {
+        return -1;
+    }
+
+    // Создание data соединения
+    client->data_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (client->data_socket < 0) {
+        perror("Data socket creation failed");
+        return -1;
+    }
+
+    memset(&data_addr, 0, sizeof(data_addr));
+    data_addr.sin_family = AF_INET;
+    data_addr.sin_port = htons(port[0] * 256 + port[1]);
+    data_addr.sin_addr.s_addr = htonl((ip[0] << 24) | (ip[1] << 16) | (ip[2] << 8) | ip[3]);
+
+    if (connect(client->data_socket, (struct sockaddr*)&data_addr, sizeof(data_addr)) < 0) {
+        perror("Data connection failed");
+        close(client->data_socket);
+        return -1;
+    }
+
+    client->passive_mode = 1;
+    return 0;
+}
+
+// Переход в пассивный режим
+int ftp_passive_mode(ftp_client_t *client) {
+    char buffer[BUFFER_SIZE];
+
+    if (ftp_command(client, "PASV", buffer, sizeof(buffer)) != 227) {
+        return -1;
+    }
+
+    return ftp_open_data_connection(client, buffer);
+}
+
+// Кодек архива каталога. gzip сжимается в процессе, zstd и lz4 - внешними
+// программами, через которые пропускается tar-поток. При распаковке кодек
+// определяется по сигнатуре в начале потока
+typedef struct {
+    const char *name;
+    unsigned char magic[4];
+    size_t magic_length;    // 0 - без сигнатуры (несжатый tar)
+    const char *program;    // Внешний фильтр; NULL - обработка в процессе
+    int max_level;
+    int default_level;
+    const char *extension;  // Добавляется к имени ".tar" архива
+} archive_codec_t;
+
+static const archive_codec_t archive_codecs[CODEC_COUNT] = {
+    {"none", {0}, 0, NULL, 0, 0, ""},
+    {"gzip", {0x1f, 0x8b}, 2, NULL, 9, 6, ".gz"},
+    {"zstd", {0x28, 0xb5, 0x2f, 0xfd}, 4, "zstd", 19, 3, ".zst"},
+    {"lz4", {0x04, 0x22, 0x4d, 0x18}, 4, "lz4", 12, 1, ".lz4"},
+};
+
+const archive_codec_t *find_archive_codec(const char *name) {
+    for (int i = 0; i < CODEC_COUNT; i++) {
+        if (strcasecmp(archive_codecs[i].name, name) == 0) return &archive_codecs[i];
+    }
+    return NULL;
+}
+
+// Кодек по первым байтам потока; без известной сигнатуры - несжатый tar
+const archive_codec_t *detect_archive_codec(const unsigned char *data, size_t length) {
+    for (int i = 0; i < CODEC_COUNT; i++) {
+        const archive_codec_t *codec = &archive_codecs[i];
+
+        if (codec->magic_length && length >= codec->magic_length &&
+            memcmp(data, codec->magic, codec->magic_length) == 0) {
+            return codec;
+        }
+    }
+    return &archive_codecs[CODEC_NONE];
+}
+
+// Есть ли исполняемая программа в PATH
+int program_available(const char *program) {
+    const char *path = getenv("PATH");
+    char candidate[MAX_PATH];
+
+    while (path && *path) {
+        const char *end = strchr(path, ':');
+        int length = end ? (int)(end - path) : (int)strlen(path);
+
+        snprintf(candidate, sizeof(candidate), "%.*s/%s", length, length ? path : ".", program);
+        if (access(candidate, X_OK) == 0) return 1;
+        path = end ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+// Кодек можно использовать: встроенный или его программа установлена
+int archive_codec_available(const archive_codec_t *codec) {
+    return !codec->program || program_available(codec->program);
+}
+
+// Запуск внешнего фильтра с заданными stdin и stdout. Остальные
+// дескрипторы закрываются, чтобы фильтр не держал чужие каналы открытыми
+pid_t spawn_filter(char *const argv[], int in_fd, int out_fd) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        dup2(in_fd, STDIN_FILENO);
+        dup2(out_fd, STDOUT_FILENO);
+#ifdef SYS_close_range
+        syscall(SYS_close_range, 3, ~0U, 0);
+#else
+        for (int fd = 3; fd < 1024; fd++) close(fd);
+#endif
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("fork failed");
+    }
+    return pid;
+}
+
+// Ожидание завершения фильтра; 0 - успешно
+int wait_filter(pid_t pid, const char *name) {
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        return 0;
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+        fprintf(stderr, "%s: program not found\n", name);
+    } else {
+        fprintf(stderr, "%s failed\n", name);
+    }
+    return -1;
+}
+
+// Блок параллельного сжатия. Каждый блок сжимается в сырой deflate
+// независимо, со словарём из хвоста предыдущего блока, и завершается
+// синхронизирующим сбросом - склеенные блоки образуют один поток deflate
+typedef struct {
+    unsigned char *in;
+    size_t in_length;
+    unsigned char dict[PGZIP_DICT];
+    size_t dict_length;
+    unsigned char *out;
+    size_t out_length, out_capacity;
+    uLong crc;
+    int last;
+    int state;              // PGZIP_FREE, PGZIP_QUEUED или PGZIP_DONE
+    int failed;
+} pgzip_block_t;
+
+enum { PGZIP_FREE, PGZIP_QUEUED, PGZIP_DONE };
+
+// Параллельное gzip-сжатие в стиле pigz. Блоки образуют кольцо: производитель
+// заполняет блоки по порядку, потоки сжимают их, а производитель перед
+// повторным использованием блока записывает его результат - так вывод
+// сохраняет порядок без отдельного потока записи
+typedef struct {
+    pgzip_block_t *blocks;
+    int count;              // Блоков в кольце
+    int current;            // Заполняемый блок
+    long long submitted;    // Блоков отдано на сжатие
+    long long taken;        // Блоков взято потоками
+    int level;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;  // Появился блок для сжатия
+    pthread_cond_t done;    // Блок сжат
+    pthread_t threads[MAX_ARCHIVE_WORKERS];
+    int thread_count;
+    uLong crc;
+} pgzip_t;
+
+// Поток сжатия архива, пишущий результат в файловый дескриптор.
+// gzip при workers > 1 сжимается блоками в нескольких потоках (parallel);
+// для внешнего кодека out_fd - вход процесса filter
+typedef struct {
+    const archive_codec_t *codec;
+    z_stream zs;
+    int out_fd;
+    pid_t filter;
+    unsigned char out[ARCHIVE_CHUNK];
+    long long raw_bytes;
+    pgzip_t *parallel;
+    long long large_file_size;  // Файлы от этого размера не попадают в архив (0 - все)
+} archive_writer_t;
+
+// Сжатие одного блока. Поток держит свой z_stream и переиспользует его
+int pgzip_compress_block(z_stream *zs, pgzip_block_t *block) {
+    int status;
+
+    block->crc = crc32(0, block->in, block->in_length);
+    if (deflateReset(zs) != Z_OK ||
+        (block->dict_length && deflateSetDictionary(zs, block->dict, block->dict_length) != Z_OK)) {
+        return -1;
+    }
+    zs->next_in = block->in;
+    zs->avail_in = block->in_length;
+    block->out_length = 0;
+    do {
+        if (block->out_length == block->out_capacity) {
+            size_t capacity = block->out_capacity + block->out_capacity / 4 + 1024;
+            unsigned char *out = realloc(block->out, capacity);
+
+            if (!out) return -1;
+            block->out = out;
+            block->out_capacity = capacity;
+        }
+        zs->next_out = block->out + block->out_length;
+        zs->avail_out = block->out_capacity - block->out_length;
+        status = deflate(zs, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (status == Z_STREAM_ERROR) return -1;
+        block->out_length = block->out_capacity - zs->avail_out;
+    } while (zs->avail_out == 0 || (block->last && status != Z_STREAM_END));
+    return 0;
+}
+
+void *pgzip_worker(void *arg) {
+    pgzip_t *pz = arg;
+    z_stream zs;
+    int ready;
+
+    memset(&zs, 0, sizeof(zs));
+    // Отрицательное окно - сырой deflate: заголовок и CRC пишет производитель
+    ready = deflateInit2(&zs, pz->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    pthread_mutex_lock(&pz->lock);
+    while (1) {
+        pgzip_block_t *block;
+
+        while (pz->taken == pz->submitted && !pz->stop) {
+            pthread_cond_wait(&pz->queued, &pz->lock);
+        }
+        if (pz->taken == pz->submitted) break;
+        block = &pz->blocks[pz->taken++ % pz->count];
+        pthread_mutex_unlock(&pz->lock);
+
+        block->failed = !ready || pgzip_compress_block(&zs, block) < 0;
+
+        pthread_mutex_lock(&pz->lock);
+        block->state = PGZIP_DONE;
+        pthread_cond_broadcast(&pz->done);
+    }
+    pthread_mutex_unlock(&pz->lock);
+    if (ready) deflateEnd(&zs);
+    return NULL;
+}
+
+// Ожидание сжатия блока и запись результата; блок освобождается
+int pgzip_drain_block(archive_writer_t *writer, pgzip_block_t *block) {
+    pgzip_t *pz = writer->parallel;
+    int result = 0;
+
+    pthread_mutex_lock(&pz->lock);
+    while (block->state == PGZIP_QUEUED) {
+        pthread_cond_wait(&pz->done, &pz->lock);
+    }
+    pthread_mutex_unlock(&pz->lock);
+    if (block->state != PGZIP_DONE) {
+        return 0;
+    }
+    if (block->failed) {
+        fprintf(stderr, "deflate failed\n");
+        result = -1;
+    } else {
+        pz->crc = crc32_combine(pz->crc, block->crc, block->in_length);
+        result = write_all(writer->out_fd, (char *)block->out, block->out_length);
+    }
+    block->state = PGZIP_FREE;
+    block->in_length = 0;
+    return result;
+}
+
+// Отдача заполненного блока на сжатие и переход к следующему блоку кольца
+int pgzip_submit(archive_writer_t *writer, int last) {
+    pgzip_t *pz = writer->parallel;
+    pgzip_block_t *block = &pz->blocks[pz->current];
+    pgzip_block_t *next = &pz->blocks[(pz->current + 1) % pz->count];
+    int result;
+
+    block->last = last;
+    pthread_mutex_lock(&pz->lock);
+    block->state = PGZIP_QUEUED;
+    pz->submitted++;
+    pthread_cond_signal(&pz->queued);
+    pthread_mutex_unlock(&pz->lock);
+
+    // Следующий блок - самый старый в кольце: его результат пишется первым
+    result = pgzip_drain_block(writer, next);
+    if (!last) {
+        size_t tail = block->in_length < PGZIP_DICT ? block->in_length : PGZIP_DICT;
+
+        memcpy(next->dict, block->in + block->in_length - tail, tail);
+        next->dict_length = tail;
+    }
+    pz->current = (pz->current + 1) % pz->count;
+    return result;
+}
+
+int pgzip_write(archive_writer_t *writer, const void *data, size_t length) {
+    pgzip_t *pz = writer->parallel;
+    const unsigned char *p = data;
+
+    while (length > 0) {
+        pgzip_block_t *block = &pz->blocks[pz->current];
+        size_t part = PGZIP_BLOCK - block->in_length;
+
+        if (part > length) part = length;
+        memcpy(block->in + block->in_length, p, part);
+        block->in_length += part;
+        p += part;
+        length -= part;
+        if (block->in_length == PGZIP_BLOCK && pgzip_submit(writer, 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Остановка потоков и освобождение кольца
+void pgzip_free(pgzip_t *pz) {
+    pthread_mutex_lock(&pz->lock);
+    pz->stop = 1;
+    pthread_cond_broadcast(&pz->queued);
+    pthread_mutex_unlock(&pz->lock);
+    for (int i = 0; i < pz->thread_count; i++) {
+        pthread_join(pz->threads[i], NULL);
+    }
+    for (int i = 0; pz->blocks && i < pz->count; i++) {
+        free(pz->blocks[i].in);
+        free(pz->blocks[i].out);
+    }
+    free(pz->blocks);
+    pthread_mutex_destroy(&pz->lock);
+    pthread_cond_destroy(&pz->queued);
+    pthread_cond_destroy(&pz->done);
+    free(pz);
+}
+
+int pgzip_init(archive_writer_t *writer, int level, int workers) {
+    // Минимальный gzip-заголовок: deflate, без имени и времени, ОС - Unix
+    static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+    pgzip_t *pz = calloc(1, sizeof(*pz));
+
+    if (!pz) return -1;
+    if (workers > MAX_ARCHIVE_WORKERS) workers = MAX_ARCHIVE_WORKERS;
+    pz->level = level;
+    pz->crc = crc32(0, NULL, 0);
+    // Вдвое больше блоков, чем потоков: пока одни сжимаются, другие заполняются
+    pz->count = workers * 2;
+    pz->blocks = calloc(pz->count, sizeof(pgzip_block_t));
+    pthread_mutex_init(&pz->lock, NULL);
+    pthread_cond_init(&pz->queued, NULL);
+    pthread_cond_init(&pz->done, NULL);
+    writer->parallel = pz;
+    if (!pz->blocks) {
+        pgzip_free(pz);
+        writer->parallel = NULL;
+        return -1;
+    }
+    for (int i = 0; i < pz->count; i++) {
+        pz->blocks[i].out_capacity = compressBound(PGZIP_BLOCK) + 64;
+        pz->blocks[i].in = malloc(PGZIP_BLOCK);
+        pz->blocks[i].out = malloc(pz->blocks[i].out_capacity);
+        if (!pz->blocks[i].in || !pz->blocks[i].out) {
+            pgzip_free(pz);
+            writer->parallel = NULL;
+            return -1;
+        }
+    }
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&pz->threads[i], NULL, pgzip_worker, pz) != 0) break;
+        pz->thread_count++;
+    }
+    if (pz->thread_count == 0) {
+        pgzip_free(pz);
+        writer->parallel = NULL;
+        return -1;
+    }
+    return write_all(writer->out_fd, (const char *)header, sizeof(header));
+}
+
+// Последний блок, ожидание всех блоков и gzip-трейлер (CRC32 и длина)
+int pgzip_finish(archive_writer_t *writer) {
+    pgzip_t *pz = writer->parallel;
+    unsigned char trailer[8];
+    int result = pgzip_submit(writer, 1);
+
+    for (int i = 0; i < pz->count; i++) {
+        pgzip_block_t *block = &pz->blocks[(pz->current + i) % pz->count];
+
+        if (pgzip_drain_block(writer, block) < 0) result = -1;
+    }
+    for (int i = 0; i < 4; i++) {
+        trailer[i] = (unsigned char)(pz->crc >> (8 * i));
+        trailer[4 + i] = (unsigned char)((unsigned long long)writer->raw_bytes >> (8 * i));
+    }
+    if (result == 0) {
+        result = write_all(writer->out_fd, (const char *)trailer, sizeof(trailer));
+    }
+    return result;
+}
+
+// Запуск внешнего компрессора, пишущего в out_fd; писатель пишет в его вход
+int archive_writer_spawn(archive_writer_t *writer, int out_fd, int level, int workers) {
+    char level_arg[16], threads_arg[16];
+    char *argv[8];
+    int argc = 0, pipefd[2];
+
+    snprintf(level_arg, sizeof(level_arg), "-%d", level);
+    snprintf(threads_arg, sizeof(threads_arg), "-T%d", workers);
+    argv[argc++] = (char *)writer->codec->program;
+    argv[argc++] = "-q";
+    argv[argc++] = "-c";
+    argv[argc++] = level_arg;
+    // zstd сам сжимает в нескольких потоках
+    if (strcmp(writer->codec->program, "zstd") == 0 && workers > 1) {
+        argv[argc++] = threads_arg;
+    }
+    argv[argc] = NULL;
+
+    if (pipe(pipefd) < 0) {
+        perror("pipe failed");
+        return -1;
+    }
+    fcntl(pipefd[1], F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+    writer->filter = spawn_filter(argv, pipefd[0], out_fd);
+    close(pipefd[0]);
+    if (writer->filter < 0) {
+        close(pipefd[1]);
+        return -1;
+    }
+    writer->out_fd = pipefd[1];
+    return 0;
+}
+
+// Инициализация писателя; level 0 - уровень кодека по умолчанию,
+// workers > 1 включает параллельное сжатие
+int archive_writer_init(archive_writer_t *writer, int out_fd, const archive_codec_t *codec,
+                        int level, int workers) {
+    memset(&writer->zs, 0, sizeof(writer->zs));
+    writer->codec = codec;
+    writer->out_fd = out_fd;
+    writer->filter = 0;
+    writer->raw_bytes = 0;
+    writer->parallel = NULL;
+    if (level <= 0) {
+        level = codec->default_level;
+    }
+    if (codec->program) {
+        return archive_writer_spawn(writer, out_fd, level, workers);
+    }
+    if (codec != &archive_codecs[CODEC_GZIP]) {
+        return 0;
+    }
+    if (workers > 1) {
+        if (pgzip_init(writer, level, workers) == 0) {
+            return 0;
+        }
+        if (writer->parallel) {
+            pgzip_free(writer->parallel);
+            writer->parallel = NULL;
+            return -1;
+        }
+        // Потоки не создались - сжатие в одном потоке
+    }
+    // 15 + 16: окно 32 КБ и gzip-заголовок вместо zlib
+    if (deflateInit2(&writer->zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "deflateInit2 failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Сжатие порции данных; flush = Z_FINISH завершает поток
+int archive_writer_deflate(archive_writer_t *writer, const void *data, size_t length, int flush) {
+    writer->zs.next_in = (unsigned char *)data;
+    writer->zs.avail_in = length;
+    writer->raw_bytes += length;
+    do {
+        writer->zs.next_out = writer->out;
+        writer->zs.avail_out = sizeof(writer->out);
+        if (deflate(&writer->zs, flush) == Z_STREAM_ERROR) {
+            fprintf(stderr, "deflate failed\n");
+            return -1;
+        }
+        size_t produced = sizeof(writer->out) - writer->zs.avail_out;
+        if (produced && write_all(writer->out_fd, (char *)writer->out, produced) < 0) {
+            return -1;
+        }
+    } while (writer->zs.avail_out == 0);
+    return 0;
+}
+
+int archive_writer_write(archive_writer_t *writer, const void *data, size_t length) {
+    if (writer->codec != &archive_codecs[CODEC_GZIP]) {
+        writer->raw_bytes += length;
+        return write_all(writer->out_fd, data, length);
+    }
+    if (writer->parallel) {
+        writer->raw_bytes += length;
+        return pgzip_write(writer, data, length);
+    }
+    return archive_writer_deflate(writer, data, length, Z_NO_FLUSH);
+}
+
+int archive_writer_finish(archive_writer_t *writer) {
+    int result;
+
+    if (writer->filter > 0) {
+        // Закрытие входа завершает поток компрессора
+        close(writer->out_fd);
+        return wait_filter(writer->filter, writer->codec->program);
+    }
+    if (writer->codec != &archive_codecs[CODEC_GZIP]) {
+        return 0;
+    }
+    if (writer->parallel) {
+        result = pgzip_finish(writer);
+        pgzip_free(writer->parallel);
+        writer->parallel = NULL;
+        return result;
+    }
+    result = archive_writer_deflate(writer, NULL, 0, Z_FINISH);
+    deflateEnd(&writer->zs);
+    return result;
+}
+
+// Запись числа в восьмеричное поле tar-заголовка. Значения, не влезающие
+// в поле, кодируются в base-256 (расширение GNU, понимает любой tar)
+void tar_set_number(char *field, size_t width, unsigned long long value) {
+    if (value < (1ULL << (3 * (width - 1)))) {
+        snprintf(field, width, "%0*llo", (int)(width - 1), value);
+        return;
+    }
+    memset(field, 0, width);
+    field[0] = (char)0x80;
+    for (size_t i = width - 1; i > 0 && value; i--) {
+        field[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+// Запись одного 512-байтного заголовка ustar
+int tar_write_block_header(archive_writer_t *writer, const char *name, const struct stat *st,
+                           char type, unsigned long long size, const char *linkname) {
+    char header[TAR_BLOCK];
+    unsigned int checksum = 0;
+
+    memset(header, 0, sizeof(header));
+    strncpy(header, name, 100);
+    tar_set_number(header + 100, 8, st->st_mode & 07777);
+    tar_set_number(header + 108, 8, st->st_uid);
+    tar_set_number(header + 116, 8, st->st_gid);
+    tar_set_number(header + 124, 12, size);
+    tar_set_number(header + 136, 12, st->st_mtime > 0 ? st->st_mtime : 0);
+    header[156] = type;
+    if (linkname) {
+        strncpy(header + 157, linkname, 100);
+    }
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+
+    // Контрольная сумма считается с полем checksum, заполненным пробелами
+    memset(header + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        checksum += (unsigned char)header[i];
+    }
+    snprintf(header + 148, 8, "%06o", checksum);
+
+    return archive_writer_write(writer, header, sizeof(header));
+}
+
+// Запись данных с дополнением нулями до границы блока
+int tar_write_padded(archive_writer_t *writer, const char *data, size_t length) {
+    static const char zeros[TAR_BLOCK];
+
+    if (archive_writer_write(writer, data, length) < 0) return -1;
+    if (length % TAR_BLOCK) {
+        return archive_writer_write(writer, zeros, TAR_BLOCK - length % TAR_BLOCK);
+    }
+    return 0;
+}
+
+// Запись заголовка записи. Длинные имена передаются записями GNU 'L'/'K'
+int tar_write_header(archive_writer_t *writer, const char *name, const struct stat *st,
+                     char type, unsigned long long size, const char *linkname) {
+    struct stat meta;
+
+    memset(&meta, 0, sizeof(meta));
+    meta.st_mode = 0644;
+    if (strlen(name) >= 100) {
+        if (tar_write_block_header(writer, "././@LongLink", &meta, 'L', strlen(name) + 1, NULL) < 0 ||
+            tar_write_padded(writer, name, strlen(name) + 1) < 0) {
+            return -1;
+        }
+    }
+    if (linkname && strlen(linkname) >= 100) {
+        if (tar_write_block_header(writer, "././@LongLink", &meta, 'K', strlen(linkname) + 1, NULL) < 0 ||
+            tar_write_padded(writer, linkname, strlen(linkname) + 1) < 0) {
+            return -1;
+        }
+    }
+    return tar_write_block_header(writer, name, st, type, size, linkname);
+}
+
+// Запись содержимого обычного файла. Если файл изменился во время чтения,
+// в архив попадает ровно заявленный в заголовке размер
+int tar_write_file_data(archive_writer_t *writer, const char *path, unsigned long long size) {
+    static const char zeros[TAR_BLOCK];
+    char *buffer;
+    unsigned long long written = 0;
+    int fd, result = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    buffer = malloc(ARCHIVE_CHUNK);
+    if (!buffer) {
+        close(fd);
+        return -1;
+    }
+
+    while (written < size) {
+        size_t want = size - written < ARCHIVE_CHUNK ? size - written : ARCHIVE_CHUNK;
+        ssize_t n = read(fd, buffer, want);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            // Файл укоротился - добиваем нулями до заявленного размера
+            memset(buffer, 0, want);
+            n = want;
+        }
+        if (archive_writer_write(writer, buffer, n) < 0) {
+            result = -1;
+            break;
+        }
+        written += n;
+    }
+    if (result == 0 && size % TAR_BLOCK) {
+        result = archive_writer_write(writer, zeros, TAR_BLOCK - size % TAR_BLOCK);
+    }
+
+    free(buffer);
+    close(fd);
+    return result;
+}
+
+// Рекурсивное добавление содержимого каталога в архив.
+// path - путь на диске, name - путь внутри архива ("./...")
+int tar_add_directory(archive_writer_t *writer, const char *path, const char *name) {
+    char child_path[MAX_PATH * 2];
+    char child_name[MAX_PATH * 2];
+    char linkname[MAX_PATH];
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir;
+    int result = 0;
+
+    dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        return -1;
+    }
+
+    while (result == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(child_path, sizeof(child_path), "%s/%s", path, entry->d_name);
+        snprintf(child_name, sizeof(child_name), "%s%s", name, entry->d_name);
+        if (lstat(child_path, &st) < 0) {
+            perror(child_path);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            strncat(child_name, "/", sizeof(child_name) - strlen(child_name) - 1);
+            result = tar_write_header(writer, child_name, &st, '5', 0, NULL);
+            if (result == 0) {
+                result = tar_add_directory(writer, child_path, child_name);
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            if (writer->large_file_size && st.st_size >= writer->large_file_size) {
+                continue;  // Передаётся отдельно
+            }
+            result = tar_write_header(writer, child_name, &st, '0', st.st_size, NULL);
+            if (result == 0) {
+                result = tar_write_file_data(writer, child_path, st.st_size);
+            }
+        } else if (S_ISLNK(st.st_mode)) {
+            ssize_t len = readlink(child_path, linkname, sizeof(linkname) - 1);
+            if (len < 0) {
+                perror(child_path);
+                continue;
+            }
+            linkname[len] = '\0';
+            result = tar_write_header(writer, child_name, &st, '2', 0, linkname);
+        } else {
+            fprintf(stderr, "Skipping special file: %s\n", child_path);
+        }
+    }
+
+    closedir(dir);
+    return result;
+}
+
+// Параметры сжатия архива каталога
+typedef struct {
+    const archive_codec_t *codec;
+    int level;              // 0 - уровень кодека по умолчанию
+    int workers;            // Потоков сжатия (gzip и zstd)
+    long long large_file_size;  // Файлы от этого размера пропускаются (0 - все)
+} archive_options_t;
+
+// Создание tar архива из каталога с записью сжатого потока в out_fd.
+// Архив формируется в памяти по частям, временный файл не создаётся
+int create_tar_archive(const char *directory, int out_fd, const archive_options_t *options) {
+    static const char zeros[TAR_BLOCK * 2];
+    archive_writer_t *writer;
+    struct stat st;
+    int result;
+
+    if (stat(directory, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Not a directory: %s\n", directory);
+        return -1;
+    }
+
+    writer = malloc(sizeof(*writer));
+    if (!writer || archive_writer_init(writer, out_fd, options->codec, options->level, options->workers) < 0) {
+        free(writer);
+        return -1;
+    }
+    writer->large_file_size = options->large_file_size;
+
+    printf("Creating tar archive from directory: %s (%s", directory, options->codec->name);
+    if (options->codec->max_level) {
+        printf(" level %d", options->level > 0 ? options->level : options->codec->default_level);
+    }
+    if (writer->parallel) {
+        printf(", %d compression threads", writer->parallel->thread_count);
+    }
+    printf(")\n");
+    result = tar_write_header(writer, "./", &st, '5', 0, NULL);
+    if (result == 0) {
+        result = tar_add_directory(writer, directory, "./");
+    }
+    // Конец архива - два нулевых блока
+    if (result == 0) {
+        result = archive_writer_write(writer, zeros, sizeof(zeros));
+    }
+    if (archive_writer_finish(writer) < 0) {
+        result = -1;
+    }
+    if (result < 0) {
+        fprintf(stderr, "Failed to create tar archive\n");
+    }
+
+    free(writer);
+    return result;
+}
+
+// Аргументы потока архивации
+typedef struct {
+    const char *directory;
+    int out_fd;
+    archive_options_t options;
+    int status;
+} archive_job_t;
+
+void *archive_worker(void *arg) {
+    archive_job_t *job = arg;
+
+    job->status = create_tar_archive(job->directory, job->out_fd, &job->options);
+    // Закрытие канала сообщает читателю о конце архива
+    close(job->out_fd);
+    return NULL;
+}
+
+// Состояния разбора tar-потока
+enum {
+    TAR_STATE_HEADER,   // накопление 512-байтного заголовка
+    TAR_STATE_DATA,     // данные текущей записи
+    TAR_STATE_META,     // данные служебной записи (длинное имя, pax)
+    TAR_STATE_PADDING,  // выравнивание до границы блока
+    TAR_STATE_END       // встречен конец архива
+};
+
+// Потоковый распаковщик tar: принимает данные порциями любого размера
+// и сразу создаёт файлы на диске
+typedef struct {
+    const char *destination;
+    int state;
+    char header[TAR_BLOCK];
+    size_t header_fill;
+    unsigned long long remaining;  // Осталось байт данных текущей записи
+    unsigned long long padding;    // Осталось байт выравнивания
+    int zero_blocks;
+    char type;                     // Тип служебной записи в TAR_STATE_META
+    char *meta;
+    size_t meta_fill;
+    char long_name[MAX_PATH * 2];  // Имя из записи 'L' или pax path
+    char long_link[MAX_PATH * 2];  // Цель ссылки из записи 'K' или pax linkpath
+    int out_fd;                    // Текущий извлекаемый файл
+    time_t mtime;
+    long long files;
+    long long bytes;
+} tar_reader_t;
+
+// Чтение числового поля tar: восьмеричное или base-256
+unsigned long long tar_get_number(const char *field, size_t width) {
+    unsigned long long value = 0;
+
+    if ((unsigned char)field[0] & 0x80) {
+        value = (unsigned char)field[0] & 0x7f;
+        for (size_t i = 1; i < width; i++) {
+            value = (value << 8) | (unsigned char)field[i];
+        }
+        return value;
+    }
+    for (size_t i = 0; i < width && field[i]; i++) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            value = value * 8 + (field[i] - '0');
+        } else if (field[i] != ' ') {
+            break;
+        }
+    }
+    return value;
+}
+
+// Проверка пути из архива: без абсолютных путей и выхода через ".."
+int tar_path_is_safe(const char *path) {
+    const char *p = path;
+
+    if (path[0] == '/') return 0;
+    while (*p) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) return 0;
+        p = strchr(p, '/');
+        if (!p) break;
+        p++;
+    }
+    return 1;
+}
+
+// Открытие (с созданием) родительского каталога записи архива. Каждый
+// каталог пути открывается через openat с O_NOFOLLOW, поэтому запись не
+// может попасть за пределы destination через ранее извлечённую ссылку.
+// Возвращает дескриптор каталога, в *leaf - последний компонент пути
+int tar_open_parent(const char *destination, const char *relative, const char **leaf) {
+    const char *component = relative;
+    const char *slash;
+    int dir_fd = open(destination, O_RDONLY | O_DIRECTORY);
+
+    while (dir_fd >= 0 && (slash = strchr(component, '/')) != NULL) {
+        char name[MAX_PATH];
+        size_t length = slash - component;
+
+        if (length >= sizeof(name)) {
+            close(dir_fd);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(name, component, length);
+        name[length] = '\0';
+        if (length > 0 && strcmp(name, ".") != 0) {
+            int next;
+
+            mkdirat(dir_fd, name, 0755);
+            next = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            close(dir_fd);
+            dir_fd = next;
+        }
+        component = slash + 1;
+    }
+    *leaf = component;
+    return dir_fd;
+}
+
+// Разбор pax-заголовка: записи вида "<len> key=value\n"
+void tar_parse_pax(tar_reader_t *tr) {
+    size_t pos = 0;
+
+    while (pos < tr->meta_fill) {
+        char *record = tr->meta + pos;
+        char *space, *equals;
+        long length = strtol(record, &space, 10);
+
+        if (length <= 0 || pos + length > tr->meta_fill || *space != ' ') break;
+        equals = memchr(space, '=', record + length - space);
+        if (equals) {
+            size_t key_len = equals - space - 1;
+            size_t value_len = record + length - equals - 2;
+            char *target = NULL;
+
+            if (key_len == 4 && strncmp(space + 1, "path", 4) == 0) target = tr->long_name;
+            if (key_len == 8 && strncmp(space + 1, "linkpath", 8) == 0) target = tr->long_link;
+            if (target && value_len < sizeof(tr->long_name)) {
+                memcpy(target, equals + 1, value_len);
+                target[value_len] = '\0';
+            }
+        }
+        pos += length;
+    }
+}
+
+// Завершение текущей записи после того, как все её данные получены
+void tar_finish_entry(tar_reader_t *tr) {
+    if (tr->state == TAR_STATE_META) {
+        tr->meta[tr->meta_fill] = '\0';
+        if (tr->type == 'L') {
+            snprintf(tr->long_name, sizeof(tr->long_name), "%s", tr->meta);
+        } else if (tr->type == 'K') {
+            snprintf(tr->long_link, sizeof(tr->long_link), "%s", tr->meta);
+        } else if (tr->type == 'x') {
+            tar_parse_pax(tr);
+        }
+    }
+    if (tr->out_fd >= 0) {
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_sec = tr->mtime;
+        times[1].tv_nsec = 0;
+        futimens(tr->out_fd, times);
+        close(tr->out_fd);
+        tr->out_fd = -1;
+    }
+    tr->state = tr->padding ? TAR_STATE_PADDING : TAR_STATE_HEADER;
+}
+
+// Обработка полностью накопленного заголовка
+int tar_process_header(tar_reader_t *tr) {
+    char name[MAX_PATH * 2];
+    char path[MAX_PATH * 4];
+    char *relative;
+    const char *leaf = NULL;
+    unsigned int checksum = 0;
+    size_t length;
+    int dir_fd = -1;
+    unsigned long long size;
+    mode_t mode;
+    char type;
+    int i;
+
+    for (i = 0; i < TAR_BLOCK && tr->header[i] == 0; i++);
+    if (i == TAR_BLOCK) {
+        // Два нулевых блока подряд - конец архива
+        if (++tr->zero_blocks == 2) tr->state = TAR_STATE_END;
+        return 0;
+    }
+    tr->zero_blocks = 0;
+
+    for (i = 0; i < TAR_BLOCK; i++) {
+        checksum += (i >= 148 && i < 156) ? ' ' : (unsigned char)tr->header[i];
+    }
+    if (checksum != tar_get_number(tr->header + 148, 8)) {
+        fprintf(stderr, "Corrupted tar header\n");
+        return -1;
+    }
+
+    type = tr->header[156];
+    size = tar_get_number(tr->header + 124, 12);
+    mode = tar_get_number(tr->header + 100, 8) & 07777;
+    tr->mtime = tar_get_number(tr->header + 136, 12);
+    tr->remaining = size;
+    tr->padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+    // Служебные записи: длинные имена и pax-заголовки
+    if (type == 'L' || type == 'K' || type == 'x' || type == 'g') {
+        if (size >= TAR_META_LIMIT) {
+            fprintf(stderr, "Tar metadata record too large\n");
+            return -1;
+        }
+        tr->type = type;
+        tr->meta_fill = 0;
+        tr->state = TAR_STATE_META;
+        if (size == 0) tar_finish_entry(tr);
+        return 0;
+    }
+
+    // Полное имя записи: длинное имя, либо prefix + name из ustar
+    if (tr->long_name[0]) {
+        snprintf(name, sizeof(name), "%s", tr->long_name);
+    } else if (tr->header[345] && memcmp(tr->header + 257, "ustar", 5) == 0) {
+        snprintf(name, sizeof(name), "%.155s/%.100s", tr->header + 345, tr->header);
+    } else {
+        snprintf(name, sizeof(name), "%.100s", tr->header);
+    }
+    if (!tr->long_link[0]) {
+        snprintf(tr->long_link, sizeof(tr->long_link), "%.100s", tr->header + 157);
+    }
+
+    relative = name;
+    while (relative[0] == '.' && relative[1] == '/') relative += 2;
+    length = strlen(relative);
+    while (length > 0 && relative[length - 1] == '/') relative[--length] = '\0';
+    snprintf(path, sizeof(path), "%s/%s", tr->destination, relative);
+
+    tr->state = TAR_STATE_DATA;
+    if (!tar_path_is_safe(relative)) {
+        fprintf(stderr, "Skipping unsafe path: %s\n", name);
+    } else if (relative[0] == '\0' || strcmp(relative, ".") == 0) {
+        // Корневой каталог архива уже создан
+    } else if (type == '2' && !tar_path_is_safe(tr->long_link)) {
+        // Ссылка наружу позволила бы следующим записям писать за пределы каталога
+        fprintf(stderr, "Skipping unsafe symlink: %s -> %s\n", name, tr->long_link);
+    } else if ((dir_fd = tar_open_parent(tr->destination, relative, &leaf)) < 0) {
+        fprintf(stderr, "Skipping %s: parent directory is not a plain directory\n", name);
+    } else if (type == '5') {
+        mkdirat(dir_fd, leaf, mode | 0700);
+    } else if (type == '0' || type == '\0' || type == '7') {
+        unlinkat(dir_fd, leaf, 0);
+        tr->out_fd = openat(dir_fd, leaf, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, mode);
+        if (tr->out_fd < 0) {
+            perror(path);
+            close(dir_fd);
+            return -1;
+        }
+        tr->files++;
+    } else if (type == '2') {
+        unlinkat(dir_fd, leaf, 0);
+        if (symlinkat(tr->long_link, dir_fd, leaf) < 0) perror(path);
+    } else if (type == '1') {
+        const char *link_relative = tr->long_link;
+        const char *target_leaf;
+        int target_fd;
+
+        while (link_relative[0] == '.' && link_relative[1] == '/') link_relative += 2;
+        if (tar_path_is_safe(link_relative) &&
+            (target_fd = tar_open_parent(tr->destination, link_relative, &target_leaf)) >= 0) {
+            unlinkat(dir_fd, leaf, 0);
+            if (linkat(target_fd, target_leaf, dir_fd, leaf, 0) < 0) perror(path);
+            close(target_fd);
+        }
+    } else {
+        fprintf(stderr, "Skipping unsupported tar entry: %s\n", name);
+    }
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+
+    tr->long_name[0] = '\0';
+    tr->long_link[0] = '\0';
+    if (size == 0) tar_finish_entry(tr);
+    return 0;
+}
+
+// Подача очередной порции распакованных данных
+int tar_reader_feed(tar_reader_t *tr, const char *data, size_t length) {
+    while (length > 0 && tr->state != TAR_STATE_END) {
+        size_t take;
+
+        switch (tr->state) {
+        case TAR_STATE_HEADER:
+            take = TAR_BLOCK - tr->header_fill;
+            if (take > length) take = length;
+            memcpy(tr->header + tr->header_fill, data, take);
+            tr->header_fill += take;
+            if (tr->header_fill == TAR_BLOCK) {
+                tr->header_fill = 0;
+                if (tar_process_header(tr) < 0) return -1;
+            }
+            break;
+        case TAR_STATE_DATA:
+        case TAR_STATE_META:
+            take = tr->remaining < length ? tr->remaining : length;
+            if (tr->state == TAR_STATE_META) {
+                memcpy(tr->meta + tr->meta_fill, data, take);
+                tr->meta_fill += take;
+            } else if (tr->out_fd >= 0) {
+                if (write_all(tr->out_fd, data, take) < 0) {
+                    perror("Failed to write extracted file");
+                    return -1;
+                }
+                tr->bytes += take;
+            }
+            tr->remaining -= take;
+            if (tr->remaining == 0) tar_finish_entry(tr);
+            break;
+        default:
+            take = tr->padding < length ? tr->padding : length;
+            tr->padding -= take;
+            if (tr->padding == 0) tr->state = TAR_STATE_HEADER;
+            break;
+        }
+        data += take;
+        length -= take;
+    }
+    return 0;
+}
+
+// Перекачка сжатого потока во вход внешнего распаковщика. Начало потока,
+// прочитанное для определения кодека, уже лежит в buffer (pending байт)
+typedef struct {
+    int in_fd;
+    int out_fd;
+    unsigned char *buffer;
+    ssize_t pending;
+    int status;
+} archive_pump_t;
+
+void *archive_pump(void *arg) {
+    archive_pump_t *pump = arg;
+
+    pump->status = 0;
+    for (ssize_t n = pump->pending; n != 0; n = read(pump->in_fd, pump->buffer, ARCHIVE_CHUNK)) {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 || write_all(pump->out_fd, (char *)pump->buffer, n) < 0) {
+            pump->status = -1;
+            break;
+        }
+    }
+    // Конец входа - сигнал распаковщику дописать остаток и выйти
+    close(pump->out_fd);
+    return NULL;
+}
+
+// Чтение начала потока, достаточного для сигнатуры кодека
+ssize_t read_archive_prefix(int fd, unsigned char *buffer, size_t size) {
+    size_t got = 0;
+
+    while (got < 4) {
+        ssize_t n = read(fd, buffer + got, size - got);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        got += n;
+    }
+    return got;
+}
+
+// Запуск распаковщика: сжатый поток из in_fd (с уже прочитанным началом)
+// уходит ему отдельным потоком, возвращается дескриптор распакованного tar
+int archive_start_decoder(const archive_codec_t *codec, int in_fd, archive_pump_t *pump,
+                          pthread_t *thread, pid_t *pid) {
+    char *argv[] = {(char *)codec->program, "-q", "-d", "-c", NULL};
+    int to_filter[2], from_filter[2];
+
+    if (pipe(to_filter) < 0) {
+        perror("pipe failed");
+        return -1;
+    }
+    if (pipe(from_filter) < 0) {
+        perror("pipe failed");
+        close(to_filter[0]);
+        close(to_filter[1]);
+        return -1;
+    }
+    *pid = spawn_filter(argv, to_filter[0], from_filter[1]);
+    close(to_filter[0]);
+    close(from_filter[1]);
+    pump->in_fd = in_fd;
+    pump->out_fd = to_filter[1];
+    if (*pid < 0 || pthread_create(thread, NULL, archive_pump, pump) != 0) {
+        close(to_filter[1]);
+        close(from_filter[0]);
+        if (*pid > 0) wait_filter(*pid, codec->program);
+        return -1;
+    }
+    return from_filter[0];
+}
+
+// Извлечение tar архива из потока (файла или сокета данных) прямо во время
+// приёма: распаковка и создание файлов идут по мере поступления байт.
+// Кодек (gzip, zstd, lz4 или без сжатия) определяется по сигнатуре
+int extract_tar_archive(int in_fd, const char *destination) {
+    const archive_codec_t *codec;
+    archive_pump_t pump;
+    pthread_t pump_thread;
+    pid_t decoder = 0;
+    tar_reader_t tr;
+    z_stream zs;
+    unsigned char *in, *out;
+    int result = 0, stream_ended = 0, source = in_fd, gzip;
+    ssize_t n;
+
+    memset(&tr, 0, sizeof(tr));
+    tr.destination = destination;
+    tr.out_fd = -1;
+    tr.meta = malloc(TAR_META_LIMIT + 1);
+    in = malloc(ARCHIVE_CHUNK);
+    out = malloc(ARCHIVE_CHUNK);
+    memset(&zs, 0, sizeof(zs));
+    // 15 + 32: автоопределение gzip/zlib заголовка
+    if (!tr.meta || !in || !out || inflateInit2(&zs, 15 + 32) != Z_OK) {
+        free(tr.meta);
+        free(in);
+        free(out);
+        return -1;
+    }
+
+    n = read_archive_prefix(in_fd, in, ARCHIVE_CHUNK);
+    codec = detect_archive_codec(in, n > 0 ? n : 0);
+    gzip = codec == &archive_codecs[CODEC_GZIP];
+    printf("Extracting %s tar archive to directory: %s\n",
+           codec->magic_length ? codec->name : "uncompressed", destination);
+
+    // Создание целевого каталога если он не существует
+    mkdir(destination, 0755);
+
+    if (n > 0 && codec->program) {
+        // Начало потока передаётся распаковщику вместе с остальным
+        pump.buffer = in;
+        pump.pending = n;
+        in = malloc(ARCHIVE_CHUNK);
+        source = in ? archive_start_decoder(codec, in_fd, &pump, &pump_thread, &decoder) : -1;
+        if (source < 0) {
+            result = -1;
+            decoder = 0;
+            free(pump.buffer);
+        } else {
+            n = read(source, in, ARCHIVE_CHUNK);
+        }
+    }
+
+    for (; result == 0 && n != 0; n = read(source, in, ARCHIVE_CHUNK)) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Failed to read archive stream");
+            result = -1;
+            break;
+        }
+        if (tr.state == TAR_STATE_END) {
+            continue;  // Хвост после конца архива просто вычитываем
+        }
+        if (!gzip) {
+            if (tar_reader_feed(&tr, (char *)in, n) < 0) {
+                result = -1;
+            }
+            continue;
+        }
+        zs.next_in = in;
+        zs.avail_in = n;
+        while (zs.avail_in > 0 && result == 0) {
+            int ret;
+
+            if (stream_ended) {
+                // Следующий gzip-член в том же потоке
+                inflateReset(&zs);
+                stream_ended = 0;
+            }
+            zs.next_out = out;
+            zs.avail_out = ARCHIVE_CHUNK;
+            ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                fprintf(stderr, "Archive decompression failed: %s\n", zs.msg ? zs.msg : "unknown error");
+                result = -1;
+                break;
+            }
+            if (tar_reader_feed(&tr, (char *)out, ARCHIVE_CHUNK - zs.avail_out) < 0) {
+                result = -1;
+            }
+            if (ret == Z_STREAM_END) {
+                stream_ended = 1;
+            }
+        }
+    }
+
+    if (decoder > 0) {
+        // При ошибке вход больше не нужен: разблокируем перекачку
+        if (result < 0) shutdown(in_fd, SHUT_RD);
+        close(source);
+        pthread_join(pump_thread, NULL);
+        free(pump.buffer);
+        if (wait_filter(decoder, codec->program) < 0 || pump.status < 0) {
+            result = -1;
+        }
+    }
+    if (result == 0 && tr.state != TAR_STATE_END) {
+        fprintf(stderr, "Archive stream ended unexpectedly\n");
+        result = -1;
+    }
+    if (tr.out_fd >= 0) close(tr.out_fd);
+    if (result == 0) {
+        printf("Extracted %lld files (%lld bytes)\n", tr.files, tr.bytes);
+    } else {
+        fprintf(stderr, "Failed to extract tar archive\n");
+    }
+
+    inflateEnd(&zs);
+    free(tr.meta);
+    free(in);
+    free(out);
+    return result;
+}
+
+// Прерывание передачи, финальный ответ которой ещё не прочитан. Сервер
+// отвечает дважды: на саму передачу (426, либо 226, если она успела
+// завершиться) и на ABOR (226 или 225). Вычитываются оба ответа, иначе
+// следующая команда получила бы устаревший 226
+int ftp_abort_transfer(ftp_client_t *client) {
+    int code;
+
+    if (send_command(client, "ABOR") < 0 || read_response(client, NULL, 0) < 0) {
+        return -1;
+    }
+    code = read_response(client, NULL, 0);
+    return code / 100 == 2 ? 0 : -1;
+}
+
+// Подготовка передачи данных: PASV, TYPE I, REST offset (если offset > 0)
+// и сама команда verb (STOR/RETR) для path. Если size задан, заодно
+// запрашивается SIZE (или -1). При включённой конвейеризации все команды
+// уходят одним пакетом и ответы разбираются по порядку, вместо трёх-четырёх
+// последовательных обменов. При успехе сокет данных открыт, а ответ
+// 150/125 остаётся в reply
+int ftp_start_transfer(ftp_client_t *client, const char *verb, const char *path, long long offset,
+                       long long *size, char *reply, int reply_size) {
+    char command[CMD_SIZE];
+    char size_command[CMD_SIZE];
+    char rest_command[CMD_SIZE];
+    char pasv_reply[BUFFER_SIZE];
+    const char *batch[5];
+    int count = 0, code, send_type, opened;
+
+    snprintf(command, sizeof(command), "%s %s", verb, path);
+    snprintf(size_command, sizeof(size_command), "SIZE %s", path);
+    snprintf(rest_command, sizeof(rest_command), "REST %lld", offset);
+
+    // SIZE не запрашиваем у серверов, которые его не поддерживают
+    if (size && !ftp_has_feature(client, FEAT_SIZE)) {
+        *size = -1;
+        size = NULL;
+    }
+
+    if (!client->pipelining) {
+        if (size) {
+            *size = ftp_size(client, path);
+        }
+
+        // Переход в пассивный режим
+        if (ftp_passive_mode(client) < 0) {
+            return -1;
+        }
+
+        // Установка бинарного режима
+        ftp_set_type(client, 'I');
+
+        if (offset > 0 && ftp_command(client, rest_command, NULL, 0) != 350) {
+            close(client->data_socket);
+            return -1;
+        }
+
+        code = ftp_command(client, command, reply, reply_size);
+        if (code != 150 && code != 125) {
+            close(client->data_socket);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (size) {
+        batch[count++] = size_command;
+    }
+    send_type = client->transfer_type != 'I';
+    if (send_type) {
+        batch[count++] = "TYPE I";
+    }
+    batch[count++] = "PASV";
+    if (offset > 0) {
+        batch[count++] = rest_command;
+    } else {
+        batch[count++] = command;
+    }
+    if (send_pipelined(client, batch, count) < 0) {
+        return -1;
+    }
+
+    if (size) {
+        char size_reply[BUFFER_SIZE];
+        *size = -1;
+        if (read_response(client, size_reply, sizeof(size_reply)) == 213) {
+            sscanf(size_reply + 4, "%lld", size);
+        }
+    }
+    if (send_type) {
+        client->transfer_type = read_response(client, NULL, 0) == 200 ? 'I' : 0;
+    }
+
+    // Соединение данных открывается, пока сервер уже обрабатывает команду
+    opened = read_response(client, pasv_reply, sizeof(pasv_reply)) == 227 &&
+             ftp_open_data_connection(client, pasv_reply) == 0;
+    if (offset > 0) {
+        // Команда передачи уходит только после подтверждения REST, иначе
+        // сервер начал бы передачу (или перезапись) с нулевого смещения
+        if (read_response(client, NULL, 0) != 350 || !opened || send_command(client, command) < 0) {
+            if (opened) close(client->data_socket);
+            return -1;
+        }
+    } else if (!opened) {
+        // Ответ на команду передачи всё равно нужно вычитать; если сервер
+        // уже начал передачу (1xx), прерываем её и вычитываем финальные ответы
+        code = read_response(client, reply, reply_size);
+        if (code / 100 == 1) {
+            ftp_abort_transfer(client);
+        }
+        return -1;
+    }
+
+    code = read_response(client, reply, reply_size);
+    if (code != 150 && code != 125) {
+        close(client->data_socket);
+        return -1;
+    }
+    return 0;
+}
+
+// Завершение передачи: закрытие сокета данных и чтение финального ответа
+int ftp_finish_transfer(ftp_client_t *client) {
+    close(client->data_socket);
+
+    // Чтение финального ответа
+    if (read_response(client, NULL, 0) / 100 != 2) {
+        return -1;
+    }
+    return 0;
+}
+
+// Отправка данных из открытого дескриптора в файл на FTP сервере. При
+// offset > 0 передача продолжается с этого смещения (REST + STOR)
+int ftp_upload_fd(ftp_client_t *client, int fd, const char *remote_file, long long offset) {
+    char buffer[BUFFER_SIZE];
+    const char *method = "copy";
+    long long bytes_sent, wire = 0;
+    progress_t progress;
+    struct stat st;
+    double started, data_end;
+    int regular, result, compressed;
+
+    client->interrupted = 0;
+    if (offset > 0 && lseek(fd, offset, SEEK_SET) < 0) {
+        perror("Failed to seek local file");
+        return -1;
+    }
+    regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+    // Смещение REST в MODE Z неоднозначно, поэтому докачка идёт без сжатия
+    compressed = offset == 0 && ftp_mode_z_useful(client, remote_file, regular ? fd : -1);
+    if (ftp_set_mode(client, compressed ? 'Z' : 'S') < 0) {
+        if (!compressed) return -1;
+        printf("Server refused MODE Z, compression disabled\n");
+        client->mode_z = 0;
+        compressed = 0;
+    }
+
+    // Команда STOR
+    started = now_seconds();
+    if (ftp_start_transfer(client, "STOR", remote_file, offset, NULL, buffer, sizeof(buffer)) < 0) {
+        client->interrupted = client->disconnected;
+        return -1;
+    }
+    client->last_setup_seconds = now_seconds() - started;
+
+    // Отправка данных; размер известен только для обычных файлов
+    started = now_seconds();
+    progress_start(&progress, client->verbose, regular ? st.st_size - offset : -1);
+    // При отправке данные идут сразу после ответа 150, отсчёт фазы data - отсюда
+    progress.first_byte = started;
+    // sendfile дешевле всего по процессору; io_uring заменяет цикл копирования.
+    // MSG_ZEROCOPY - для очень больших файлов, если ядро его поддерживает
+    bytes_sent = MSGZC_UNSUPPORTED;
+    if (compressed) {
+        method = "MODE Z";
+        bytes_sent = send_file_deflate(client->data_socket, fd, client->compress_level, &wire, &progress);
+    } else if (client->msg_zerocopy && regular && st.st_size - offset >= MSGZC_MIN_SIZE) {
+        bytes_sent = send_file_msg_zerocopy(client->data_socket, fd, &method, &progress);
+        if (bytes_sent == MSGZC_UNSUPPORTED) {
+            printf("MSG_ZEROCOPY is not supported here, using the regular path\n");
+            client->msg_zerocopy = 0;
+        }
+    }
+    if (bytes_sent != MSGZC_UNSUPPORTED) {
+        // Данные уже отправлены
+    } else if (client->zero_copy) {
+        bytes_sent = send_file_zero_copy(client->data_socket, fd, &method, &progress);
+    } else if (client->io_uring && ring_supported() && regular) {
+        bytes_sent = ring_send_file(client->data_socket, fd, client->buffer_size, &method, &progress);
+    } else {
+        bytes_sent = send_file_copy(client->data_socket, fd, 0, &progress);
+    }
+    data_end = now_seconds();
+    progress_finish(&progress);
+    client->last_transfer_bytes = bytes_sent;
+    if (client->verbose) {
+        if (bytes_sent >= 0) {
+            print_transfer_stats(method, bytes_sent, now_seconds() - started);
+            if (compressed) print_compression_stats(bytes_sent, wire);
+        }
+    }
+    if (compressed && bytes_sent > 0) {
+        ftp_mode_z_learn(client, remote_file, bytes_sent, wire);
+    }
+
+    result = ftp_finish_transfer(client);
+    metrics_transfer(client, "STOR", bytes_sent, progress.first_byte, data_end, now_seconds());
+    ftp_cache_invalidate(client, remote_file);
+    if (result < 0 || bytes_sent < 0) {
+        client->interrupted = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Переподключение с прежними сервером, пользователем и каталогом
+int ftp_reconnect(ftp_client_t *client) {
+    char server[sizeof(client->server)], username[sizeof(client->username)];
+    char password[sizeof(client->password)], directory[sizeof(client->current_dir)];
+
+    snprintf(server, sizeof(server), "%s", client->server);
+    snprintf(username, sizeof(username), "%s", client->username);
+    snprintf(password, sizeof(password), "%s", client->password);
+    snprintf(directory, sizeof(directory), "%s", client->current_dir);
+    close(client->control_socket);
+
+    if (ftp_connect(client, server, client->port) < 0 || ftp_login(client, username, password) < 0) {
+        return -1;
+    }
+    if (strcmp(directory, client->current_dir) != 0 && ftp_cwd(client, directory) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Подготовка к повтору прерванной передачи: пауза растёт с номером
+// попытки, потерянное управляющее соединение восстанавливается
+int ftp_prepare_retry(ftp_client_t *client, int attempt) {
+    usleep(RESUME_RETRY_DELAY_MS * 1000 * attempt);
+    if (client->disconnected && ftp_reconnect(client) < 0) {
+        fprintf(stderr, "Reconnect failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Сравнение overlap байт перед offset в локальном файле с данными из data
+int compare_local_tail(int fd, long long offset, const char *data, long long overlap) {
+    char *local = malloc(overlap);
+    int result;
+
+    if (!local) return -1;
+    result = pread(fd, local, overlap, offset - overlap) == overlap && memcmp(local, data, overlap) == 0 ? 0 : -1;
+    free(local);
+    return result;
+}
+
+// Приём ровно length байт из сокета данных
+int recv_exact(int socket, char *data, long long length) {
+    long long done = 0;
+
+    while (done < length) {
+        ssize_t n = recv(socket, data + done, length - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Проверка перед докачкой на сервер: последние resume_overlap байт файла
+// на сервере (длиной offset) должны совпадать с локальным файлом
+int ftp_verify_remote_tail(ftp_client_t *client, const char *remote_file, int fd, long long offset) {
+    long long overlap = client->resume_overlap < offset ? client->resume_overlap : offset;
+    char reply[BUFFER_SIZE];
+    char *data;
+    int result;
+
+    if (overlap <= 0) {
+        return 0;
+    }
+    data = malloc(overlap);
+    if (!data) {
+        return -1;
+    }
+    if (ftp_set_mode(client, 'S') < 0 ||
+        ftp_start_transfer(client, "RETR", remote_file, offset - overlap, NULL, reply, sizeof(reply)) < 0) {
+        free(data);
+        return -1;
+    }
+    result = recv_exact(client->data_socket, data, overlap);
+    if (ftp_finish_transfer(client) < 0 || result < 0) {
+        result = -1;
+    } else {
+        result = compare_local_tail(fd, offset, data, overlap);
+    }
+    free(data);
+    if (result < 0) {
+        printf("Resume check failed: last %lld bytes on the server differ from %lld bytes of the local file\n",
+               overlap, offset);
+    }
+    return result;
+}
+
+// Отправка файла на FTP сервер. resume - продолжить с длины файла на
+// сервере; после обрыва передача повторяется с докачкой до resume_retries раз
+int ftp_send_file(ftp_client_t *client, const char *local_file, const char *remote_file, int resume) {
+    long long offset = 0;
+    struct stat st;
+    int fd, result = -1;
+
+    // Открытие локального файла
+    fd = open(local_file, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open local file");
+        return -1;
+    }
+
+    if (client->verbose) {
+        printf("Uploading file: %s\n", local_file);
+    }
+    for (int attempt = 0; attempt <= client->resume_retries; attempt++) {
+        if (attempt > 0) {
+            if (!client->interrupted || ftp_prepare_retry(client, attempt) < 0) break;
+            resume = 1;
+        }
+        offset = 0;
+        if (resume) {
+            // Без SIZE длину на сервере не узнать - докачка невозможна
+            offset = ftp_size(client, remote_file);
+            if (offset < 0 || fstat(fd, &st) < 0) {
+                printf("Cannot determine remote size of %s, sending the whole file\n", remote_file);
+                offset = 0;
+            } else if (offset > st.st_size) {
+                printf("Remote file is larger than the local one, sending the whole file\n");
+                offset = 0;
+            } else if (ftp_verify_remote_tail(client, remote_file, fd, offset) < 0) {
+                break;
+            } else if (offset == st.st_size) {
+                printf("Remote file is already complete (%lld bytes)\n", offset);
+                result = 0;
+                break;
+            }
+            if (offset > 0) {
+                printf("Resuming upload at byte %lld%s\n", offset, attempt > 0 ? " after interruption" : "");
+            }
+        }
+        result = ftp_upload_fd(client, fd, remote_file, offset);
+        if (result == 0) break;
+    }
+
+    close(fd);
+    return result;
+}
+
+int ftp_upload_file(ftp_client_t *client, const char *local_file, const char *remote_file) {
+    return ftp_send_file(client, local_file, remote_file, 0);
+}
+
+// Получение файла с FTP сервера в local_file, начиная с offset. При
+// offset > 0 файл дописывается; если включена проверка перекрытия, приём
+// начинается на resume_overlap байт раньше и эти байты сверяются с уже
+// имеющимися
+int ftp_retrieve_file(ftp_client_t *client, const char *remote_file, const char *local_file, long long offset) {
+    char buffer[BUFFER_SIZE];
+    const char *method = "copy";
+    long long expected, bytes_received, overlap, start, wire = 0;
+    progress_t progress;
+    double started, data_end;
+    int fd, result, compressed;
+
+    client->interrupted = 0;
+    overlap = client->resume_overlap < offset ? client->resume_overlap : offset;
+    start = offset - overlap;
+
+    // Смещение REST в MODE Z неоднозначно, поэтому докачка идёт без сжатия
+    compressed = start == 0 && ftp_mode_z_useful(client, remote_file, -1);
+    if (ftp_set_mode(client, compressed ? 'Z' : 'S') < 0) {
+        if (!compressed) return -1;
+        printf("Server refused MODE Z, compression disabled\n");
+        client->mode_z = 0;
+        compressed = 0;
+    }
+
+    // Команда RETR; размер нужен для предварительного выделения места под файл
+    started = now_seconds();
+    if (ftp_start_transfer(client, "RETR", remote_file, start, &expected, buffer, sizeof(buffer)) < 0) {
+        client->interrupted = client->disconnected;
+        return -1;
+    }
+    client->last_setup_seconds = now_seconds() - started;
+    if (expected < 0 && start == 0) {
+        expected = parse_size_from_reply(buffer);
+    }
+
+    // Создание локального файла; при докачке имеющиеся данные сохраняются
+    fd = open(local_file, O_RDWR | O_CREAT | (offset > 0 ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+        perror("Failed to create local file");
+        ftp_finish_transfer(client);
+        return -1;
+    }
+
+    if (overlap > 0) {
+        char *data = malloc(overlap);
+        result = data ? recv_exact(client->data_socket, data, overlap) : -1;
+        if (result == 0 && compare_local_tail(fd, offset, data, overlap) < 0) {
+            printf("Resume check failed: local data before byte %lld differs from the server\n", offset);
+            result = -1;
+        }
+        free(data);
+        if (result < 0) {
+            close(fd);
+            ftp_finish_transfer(client);
+            return -1;
+        }
+    }
+    if (offset > 0 && (ftruncate(fd, offset) < 0 || lseek(fd, offset, SEEK_SET) < 0)) {
+        perror("Failed to seek local file");
+        close(fd);
+        ftp_finish_transfer(client);
+        return -1;
+    }
+
+    // Резервирование места снижает фрагментацию и ловит нехватку диска
+    // заранее; размер файла не меняется, чтобы после обрыва он отражал
+    // реально полученные данные
+    if (expected > offset && fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, expected - offset) < 0 &&
+        errno != EOPNOTSUPP) {
+        perror("fallocate failed");
+    }
+
+    // Получение данных
+    if (client->verbose) {
+        printf("Downloading file: %s\n", remote_file);
+    }
+    started = now_seconds();
+    progress_start(&progress, client->verbose, expected > offset ? expected - offset : -1);
+    if (compressed) {
+        method = "MODE Z";
+        bytes_received = recv_file_inflate(client->data_socket, fd, client->buffer_size, &wire, &progress);
+    } else if (client->zero_copy) {
+        bytes_received = recv_file_splice(client->data_socket, fd, client->buffer_size, &method, &progress);
+    } else if (client->io_uring && ring_supported()) {
+        bytes_received = ring_recv_file(client->data_socket, fd, client->buffer_size, &method, &progress);
+    } else {
+        bytes_received = recv_file_buffered(client->data_socket, fd, client->buffer_size, 0, &progress);
+    }
+    data_end = now_seconds();
+    progress_finish(&progress);
+    client->last_transfer_bytes = bytes_received;
+    if (bytes_received >= 0) {
+        // Освобождаем зарезервированное, если сервер прислал меньше
+        if (expected > 0 && offset + bytes_received != expected) {
+            ftruncate(fd, offset + bytes_received);
+        }
+        if (client->verbose) {
+            print_transfer_stats(method, bytes_received, now_seconds() - started);
+            if (compressed) print_compression_stats(bytes_received, wire);
+        }
+        if (compressed) {
+            ftp_mode_z_learn(client, remote_file, bytes_received, wire);
+        }
+    }
+
+    close(fd);
+    result = ftp_finish_transfer(client);
+    metrics_transfer(client, "RETR", bytes_received, progress.first_byte, data_end, now_seconds());
+    if (result < 0 || bytes_received < 0) {
+        client->interrupted = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Получение файла с FTP сервера. resume - продолжить с длины локального
+// файла; после обрыва приём повторяется с докачкой до resume_retries раз
+int ftp_fetch_file(ftp_client_t *client, const char *remote_file, const char *local_file, int resume) {
+    int result = -1;
+
+    for (int attempt = 0; attempt <= client->resume_retries; attempt++) {
+        long long offset = 0, size;
+        struct stat st;
+
+        if (attempt > 0) {
+            if (!client->interrupted || ftp_prepare_retry(client, attempt) < 0) break;
+            resume = 1;
+        }
+        if (resume && stat(local_file, &st) == 0 && st.st_size > 0) {
+            offset = st.st_size;
+            size = ftp_size(client, remote_file);
+            if (size >= 0 && offset > size) {
+                printf("Local file is larger than the remote one, downloading the whole file\n");
+                offset = 0;
+            } else if (size >= 0 && offset == size && client->resume_overlap == 0) {
+                printf("Local file is already complete (%lld bytes)\n", offset);
+                return 0;
+            } else {
+                printf("Resuming download at byte %lld%s\n", offset, attempt > 0 ? " after interruption" : "");
+            }
+        }
+        result = ftp_retrieve_file(client, remote_file, local_file, offset);
+        if (result == 0) break;
+    }
+    return result;
+}
+
+int ftp_download_file(ftp_client_t *client, const char *remote_file, const char *local_file) {
+    return ftp_fetch_file(client, remote_file, local_file, 0);
+}
+
+// Сравнение для сортировки замеров
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Перцентиль p (0..100) по отсортированному массиву
+double percentile(const double *sorted, int count, double p) {
+    int index;
+
+    if (count == 0) return 0;
+    index = (int)(p / 100.0 * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+// Замер задержки подготовки передачи (от первой команды до ответа 150)
+// для RETR remote_file без конвейеризации и с ней
+int ftp_bench_setup(ftp_client_t *client, const char *remote_file, int iterations) {
+    int saved_pipelining = client->pipelining;
+    int saved_verbose = client->verbose;
+    double *samples, averages[2] = {0, 0};
+    char buffer[BUFFER_SIZE];
+    int result = 0;
+
+    samples = malloc(sizeof(double) * iterations);
+    if (!samples) {
+        return -1;
+    }
+
+    client->verbose = 0;
+    if (ftp_set_mode(client, 'S') < 0) {
+        result = -1;
+    }
+    for (int mode = 0; mode < 2 && result == 0; mode++) {
+        client->pipelining = mode;
+        for (int i = 0; i < iterations; i++) {
+            long long size;
+            double started = now_seconds();
+
+            if (ftp_start_transfer(client, "RETR", remote_file, 0, &size, buffer, sizeof(buffer)) < 0) {
+                fprintf(stderr, "Transfer setup failed\n");
+                result = -1;
+                break;
+            }
+            samples[i] = (now_seconds() - started) * 1000;
+            averages[mode] += samples[i] / iterations;
+
+            // Вычитываем данные, чтобы сессия осталась синхронной
+            while (recv(client->data_socket, buffer, sizeof(buffer), 0) > 0);
+            ftp_finish_transfer(client);
+        }
+        if (result == 0) {
+            qsort(samples, iterations, sizeof(double), compare_doubles);
+            printf("%-10s setup latency over %d files: avg %.3f ms, min %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+                   mode ? "pipelined" : "sequential", iterations, averages[mode], samples[0],
+                   percentile(samples, iterations, 50), percentile(samples, iterations, 99),
+                   samples[iterations - 1]);
+        }
+    }
+    if (result == 0 && averages[1] > 0) {
+        printf("Pipelining speedup: %.2fx\n", averages[0] / averages[1]);
+    }
+
+    client->pipelining = saved_pipelining;
+    client->verbose = saved_verbose;
+    free(samples);
+    return result;
+}
+
+// Процессорное время (пользователь + ядро), секунды: who - RUSAGE_SELF
+// или RUSAGE_CHILDREN (завершённые дочерние процессы, например кодеки)
+double rusage_seconds(int who) {
+    struct rusage usage;
+    getrusage(who, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Процессорное время процесса (пользователь + ядро), секунды
+double cpu_seconds(void) {
+    return rusage_seconds(RUSAGE_SELF);
+}
+
+// Сравнение механизмов передачи: цикл копирования, sendfile/splice и io_uring.
+// Каждый выполняет iterations загрузок local_file и скачиваний обратно;
+// печатаются пропускная способность и процессорное время клиента на гигабайт
+int ftp_bench_io(ftp_client_t *client, const char *local_file, const char *remote_file, int iterations) {
+    static const char *names[] = {"copy", "zero-copy", "io_uring", "msg_zc"};
+    int saved_zero_copy = client->zero_copy;
+    int saved_io_uring = client->io_uring;
+    int saved_msg_zerocopy = client->msg_zerocopy;
+    int saved_verbose = client->verbose;
+    char scratch[MAX_PATH + 16];
+    int result = 0;
+
+    snprintf(scratch, sizeof(scratch), "%s.bench", local_file);
+    client->verbose = 0;
+    printf("%-10s %12s %14s %16s %18s\n", "engine", "upload MB/s", "download MB/s",
+           "upload CPU s/GB", "download CPU s/GB");
+    for (int engine = 0; engine < 4 && result == 0; engine++) {
+        double wall[2] = {0, 0}, cpu[2] = {0, 0};
+        long long bytes[2] = {0, 0};
+
+        if (engine == 2 && !ring_supported()) {
+            printf("%-10s not supported by this kernel\n", names[engine]);
+            continue;
+        }
+        // msg_zc: отправка через MSG_ZEROCOPY (файлы от MSGZC_MIN_SIZE), приём через splice
+        client->zero_copy = engine == 1 || engine == 3;
+        client->io_uring = engine == 2;
+        client->msg_zerocopy = engine == 3;
+        for (int i = 0; i < iterations && result == 0; i++) {
+            for (int direction = 0; direction < 2; direction++) {
+                double started = now_seconds(), cpu_started = cpu_seconds();
+
+                if (direction == 0) {
+                    result = ftp_upload_file(client, local_file, remote_file);
+                } else {
+                    result = ftp_download_file(client, remote_file, scratch);
+                }
+                if (result < 0) {
+                    fprintf(stderr, "%s %s failed\n", names[engine], direction ? "download" : "upload");
+                    break;
+                }
+                wall[direction] += now_seconds() - started;
+                cpu[direction] += cpu_seconds() - cpu_started;
+                bytes[direction] += client->last_transfer_bytes;
+            }
+        }
+        if (result == 0) {
+            double gigabytes[2] = {bytes[0] / 1e9, bytes[1] / 1e9};
+            printf("\n%-10s %12.1f %14.1f %16.3f %18.3f\n", names[engine],
+                   bytes[0] / wall[0] / (1024 * 1024), bytes[1] / wall[1] / (1024 * 1024),
+                   gigabytes[0] > 0 ? cpu[0] / gigabytes[0] : 0,
+                   gigabytes[1] > 0 ? cpu[1] / gigabytes[1] : 0);
+        }
+    }
+    unlink(scratch);
+
+    client->zero_copy = saved_zero_copy;
+    client->io_uring = saved_io_uring;
+    client->msg_zerocopy = saved_msg_zerocopy;
+    client->verbose = saved_verbose;
+    return result;
+}
+
+// Сегмент параллельной загрузки
+typedef struct {
+    const ftp_client_t *origin;  // Основная сессия (сервер, учётные данные, каталог)
+    const char *remote_file;
+    int fd;                      // Общий локальный файл, запись через pwrite
+    int index;
+    long long offset;
+    long long length;
+    long long done;              // Принято байт (читается потоком прогресса)
+    int finished;                // Под *lock; о завершении сообщает *changed
+    int status;
+    pthread_mutex_t *lock;
+    pthread_cond_t *changed;
+} ftp_segment_t;
+
+// Открытие дополнительной сессии с теми же параметрами, что у основной
+int ftp_open_session(ftp_client_t *session, const ftp_client_t *origin) {
+    ftp_client_init(session);
+    session->verbose = 0;
+    session->zero_copy = origin->zero_copy;
+    session->io_uring = origin->io_uring;
+    session->msg_zerocopy = origin->msg_zerocopy;
+    session->metrics = origin->metrics;
+    session->buffer_size = origin->buffer_size;
+    session->resume_retries = origin->resume_retries;
+    session->resume_overlap = origin->resume_overlap;
+    session->mode_z = origin->mode_z;
+    session->archive_workers = origin->archive_workers;
+    session->archive_codec = origin->archive_codec;
+    session->archive_level = origin->archive_level;
+    session->compress_level = origin->compress_level;
+    memcpy(session->incompressible, origin->incompressible, sizeof(session->incompressible));
+    session->incompressible_count = origin->incompressible_count;
+
+    if (ftp_connect(session, origin->server, origin->port) < 0) {
+        return -1;
+    }
+    if (ftp_login(session, origin->username, origin->password) < 0) {
+        close(session->control_socket);
+        return -1;
+    }
+    if (strcmp(session->current_dir, origin->current_dir) != 0 &&
+        ftp_cwd(session, origin->current_dir) < 0) {
+        close(session->control_socket);
+        return -1;
+    }
+    return 0;
+}
+
+// Поток одного сегмента: REST <offset> + RETR, приём до конца сегмента, ABOR
+void *segment_worker(void *arg) {
+    ftp_segment_t *segment = arg;
+    ftp_client_t session;
+    char command[CMD_SIZE];
+    char *data;
+    long long done = 0;
+    ssize_t n;
+    int code;
+
+    segment->status = -1;
+    if (ftp_open_session(&session, segment->origin) < 0) {
+        fprintf(stderr, "Segment %d: failed to open session\n", segment->index);
+        goto finished;
+    }
+
+    data = NULL;
+    if (posix_memalign((void **)&data, 4096, session.buffer_size) != 0) {
+        data = NULL;
+        goto out;
+    }
+    if (ftp_passive_mode(&session) < 0) {
+        goto out;
+    }
+
+    ftp_set_type(&session, 'I');
+
+    snprintf(command, sizeof(command), "REST %lld", segment->offset);
+    if (ftp_command(&session, command, NULL, 0) != 350) {
+        fprintf(stderr, "Segment %d: server does not support REST\n", segment->index);
+        close(session.data_socket);
+        goto out;
+    }
+
+    snprintf(command, sizeof(command), "RETR %s", segment->remote_file);
+    code = ftp_command(&session, command, NULL, 0);
+    if (code != 150 && code != 125) {
+        close(session.data_socket);
+        goto out;
+    }
+
+    while (done < segment->length) {
+        size_t want = session.buffer_size;
+        if ((long long)want > segment->length - done) {
+            want = segment->length - done;
+        }
+        n = recv(session.data_socket, data, want, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        if (pwrite(segment->fd, data, n, segment->offset + done) != n) {
+            perror("pwrite failed");
+            break;
+        }
+        done += n;
+        __atomic_store_n(&segment->done, done, __ATOMIC_RELAXED);
+    }
+    close(session.data_socket);
+
+    if (done == segment->length) {
+        segment->status = 0;
+    }
+    // Сервер продолжает передачу после конца сегмента - прерываем её
+    ftp_abort_transfer(&session);
+
+out:
+    free(data);
+    send_command(&session, "QUIT");
+    close(session.control_socket);
+finished:
+    pthread_mutex_lock(segment->lock);
+    segment->finished = 1;
+    pthread_cond_signal(segment->changed);
+    pthread_mutex_unlock(segment->lock);
+    return NULL;
+}
+
+// Печать прогресса по всем сегментам одной строкой
+void print_segment_progress(ftp_segment_t *segments, int count) {
+    printf("\r");
+    for (int i = 0; i < count; i++) {
+        long long done = __atomic_load_n(&segments[i].done, __ATOMIC_RELAXED);
+        int percent = segments[i].length > 0 ? (int)(done * 100 / segments[i].length) : 100;
+        printf("[%d:%3d%%] ", i, percent);
+    }
+    fflush(stdout);
+}
+
+// Параллельная загрузка файла сегментами через несколько сессий
+int ftp_parallel_download(ftp_client_t *client, const char *remote_file, const char *local_file, int count) {
+    ftp_segment_t segments[MAX_SEGMENTS];
+    pthread_t threads[MAX_SEGMENTS];
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+    long long size, total = 0;
+    double started;
+    struct stat st;
+    int fd, tty, result = 0;
+
+    size = ftp_size(client, remote_file);
+    if (size < 0) {
+        fprintf(stderr, "Parallel download requires SIZE support\n");
+        return -1;
+    }
+    // Мелкие файлы нет смысла резать на сегменты
+    if (size < (long long)count * MIN_RECV_BUFFER) {
+        count = 1;
+    }
+
+    fd = open(local_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to create local file");
+        return -1;
+    }
+    if (size > 0 && fallocate(fd, 0, 0, size) < 0 && ftruncate(fd, size) < 0) {
+        perror("Failed to preallocate local file");
+        close(fd);
+        return -1;
+    }
+
+    printf("Downloading %s (%lld bytes) in %d segments\n", remote_file, size, count);
+    started = now_seconds();
+    for (int i = 0; i < count; i++) {
+        memset(&segments[i], 0, sizeof(segments[i]));
+        segments[i].origin = client;
+        segments[i].remote_file = remote_file;
+        segments[i].fd = fd;
+        segments[i].index = i;
+        segments[i].offset = size / count * i;
+        segments[i].length = i == count - 1 ? size - segments[i].offset : size / count;
+        segments[i].lock = &lock;
+        segments[i].changed = &changed;
+        if (pthread_create(&threads[i], NULL, segment_worker, &segments[i]) != 0) {
+            segments[i].status = -1;
+            segments[i].finished = 1;
+            threads[i] = 0;
+        }
+    }
+
+    // Ожидание завершения всех сегментов; прогресс выводится только на терминал
+    tty = isatty(STDOUT_FILENO);
+    pthread_mutex_lock(&lock);
+    while (1) {
+        int running = 0;
+        for (int i = 0; i < count; i++) {
+            if (!segments[i].finished) running++;
+        }
+        if (tty) print_segment_progress(segments, count);
+        if (!running) break;
+        wait_progress(&changed, &lock, tty);
+    }
+    pthread_mutex_unlock(&lock);
+    if (tty) printf("\n");
+
+    for (int i = 0; i < count; i++) {
+        if (threads[i]) pthread_join(threads[i], NULL);
+        if (segments[i].status < 0) {
+            fprintf(stderr, "Segment %d failed at %lld/%lld bytes\n",
+                    i, segments[i].done, segments[i].length);
+            result = -1;
+        }
+        total += segments[i].done;
+    }
+
+    // Финальная проверка размера
+    if (fstat(fd, &st) < 0 || st.st_size != size || total != size) {
+        fprintf(stderr, "Size check failed: expected %lld, received %lld\n", size, total);
+        result = -1;
+    } else {
+        print_transfer_stats("parallel", total, now_seconds() - started);
+    }
+
+    close(fd);
+    return result;
+}
+
+// Отправка архивированного каталога. Архивация идёт в отдельном потоке и
+// через канал сразу уходит в сокет данных, так что сжатие и передача
+// выполняются одновременно. Файлы от large_file_size (если не 0) в архив
+// не входят - их передаёт гибридный способ отдельно
+int ftp_upload_archive(ftp_client_t *client, const char *local_dir, const char *remote_name,
+                       long long large_file_size) {
+    archive_job_t job;
+    pthread_t thread;
+    struct stat st;
+    int pipefd[2];
+    int result, saved_mode_z;
+
+    // Проверка до STOR, чтобы не оставить на сервере пустой архив
+    if (stat(local_dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Not a directory: %s\n", local_dir);
+        return -1;
+    }
+    if (!archive_codec_available(&archive_codecs[client->archive_codec])) {
+        fprintf(stderr, "%s is not installed\n", archive_codecs[client->archive_codec].program);
+        return -1;
+    }
+
+    if (pipe(pipefd) < 0) {
+        perror("pipe failed");
+        return -1;
+    }
+    fcntl(pipefd[1], F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+
+    job.directory = local_dir;
+    job.out_fd = pipefd[1];
+    job.options.codec = &archive_codecs[client->archive_codec];
+    job.options.level = client->archive_level;
+    job.options.workers = client->archive_workers;
+    job.options.large_file_size = large_file_size;
+    job.status = -1;
+    if (pthread_create(&thread, NULL, archive_worker, &job) != 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+
+    // Отправка архива по мере его создания. Сжатый архив идёт в MODE S:
+    // повторное сжатие MODE Z только тратило бы процессор
+    saved_mode_z = client->mode_z;
+    if (client->archive_codec != CODEC_NONE) {
+        client->mode_z = 0;
+    }
+    result = ftp_upload_fd(client, pipefd[0], remote_name, 0);
+    client->mode_z = saved_mode_z;
+
+    // Закрытие читающего конца прерывает архивацию, если отправка не удалась
+    close(pipefd[0]);
+    pthread_join(thread, NULL);
+
+    return result == 0 && job.status == 0 ? 0 : -1;
+}
+
+int ftp_upload_directory(ftp_client_t *client, const char *local_dir, const char *remote_name) {
+    return ftp_upload_archive(client, local_dir, remote_name, 0);
+}
+
+// Получение и извлечение архивированного каталога. Архив распаковывается
+// прямо из сокета данных, временный файл не нужен
+int ftp_download_directory(ftp_client_t *client, const char *remote_name, const char *local_dir) {
+    char buffer[BUFFER_SIZE];
+    double started;
+    int result;
+
+    // Команда RETR; архив передаётся в потоковом режиме
+    if (ftp_set_mode(client, 'S') < 0 ||
+        ftp_start_transfer(client, "RETR", remote_name, 0, NULL, buffer, sizeof(buffer)) < 0) {
+        return -1;
+    }
+
+    // Извлечение архива по мере поступления данных
+    started = now_seconds();
+    result = extract_tar_archive(client->data_socket, local_dir);
+    if (result == 0) {
+        printf("Archive received and extracted in %.3f s\n", now_seconds() - started);
+    } else {
+        fprintf(stderr, "Failed to extract archive %s after %.3f s\n", remote_name, now_seconds() - started);
+    }
+
+    if (ftp_finish_transfer(client) < 0) {
+        return -1;
+    }
+    return result;
+}
+
+// Закрытие FTP соединения
+void ftp_disconnect(ftp_client_t *client) {
+    ftp_command(client, "QUIT", NULL, 0);
+
+    close(client->control_socket);
+}
+
+void free_name_list(char **names, int count) {
+    for (int i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+// Получение списка имён файлов (NLST) в каталоге path или текущем каталоге.
+// Массив имён и сами имена освобождаются вызывающим через free_name_list
+int ftp_name_list(ftp_client_t *client, const char *path, char ***names, int *count) {
+    char command[CMD_SIZE];
+    char *data = NULL;
+    size_t used = 0, capacity = 0;
+    int code, capacity_names = 0, failed = 0;
+    ssize_t n;
+
+    *names = NULL;
+    *count = 0;
+
+    if (ftp_set_type(client, 'A') < 0 || ftp_set_mode(client, 'S') < 0 || ftp_passive_mode(client) < 0) {
+        return -1;
+    }
+
+    if (path && path[0]) {
+        snprintf(command, sizeof(command), "NLST %s", path);
+    } else {
+        snprintf(command, sizeof(command), "NLST");
+    }
+    code = ftp_command(client, command, NULL, 0);
+    if (code != 150 && code != 125) {
+        close(client->data_socket);
+        return code == 550 || code == 450 ? 0 : -1;  // Пустой каталог
+    }
+
+    // Список читается целиком, затем режется на строки
+    while (1) {
+        if (used + BUFFER_SIZE + 1 > capacity) {
+            char *grown;
+            capacity = capacity ? capacity * 2 : 64 * 1024;
+            grown = realloc(data, capacity);
+            if (!grown) {
+                // Финальный ответ вычитывается, чтобы не сбить порядок ответов
+                free(data);
+                ftp_finish_transfer(client);
+                return -1;
+            }
+            data = grown;
+        }
+        n = recv(client->data_socket, data + used, capacity - used - 1, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        used += n;
+    }
+    if (ftp_finish_transfer(client) < 0 || !data) {
+        free(data);
+        return data ? -1 : 0;
+    }
+    data[used] = '\0';
+
+    for (char *saveptr, *line = strtok_r(data, "\r\n", &saveptr); line; line = strtok_r(NULL, "\r\n", &saveptr)) {
+        if (*count == capacity_names) {
+            char **grown;
+            capacity_names = capacity_names ? capacity_names * 2 : 256;
+            grown = realloc(*names, sizeof(char *) * capacity_names);
+            if (!grown) {
+                failed = 1;
+                break;
+            }
+            *names = grown;
+        }
+        if (!((*names)[*count] = strdup(line))) {
+            failed = 1;
+            break;
+        }
+        (*count)++;
+    }
+
+    free(data);
+    // Неполный список вызывающему не отдаётся
+    if (failed) {
+        fprintf(stderr, "Out of memory while reading name list\n");
+        free_name_list(*names, *count);
+        *names = NULL;
+        *count = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Блок арены, в которой хранятся имена записей листинга
+typedef struct name_block {
+    struct name_block *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} name_block_t;
+
+// Пул интернированных имён: одинаковые имена хранятся один раз,
+// память освобождается целиком вместе с пулом
+typedef struct {
+    name_block_t *blocks;
+    const char **table;     // Хэш-таблица с открытой адресацией
+    size_t table_size;      // Степень двойки
+    size_t count;
+    size_t bytes;           // Занято арены
+} name_pool_t;
+
+// Запись каталога. Размер записи фиксирован, имя - в пуле листинга
+typedef struct {
+    const char *name;
+    long long size;         // -1, если неизвестен
+    time_t mtime;           // 0, если неизвестно
+    char type;              // 'f' - файл, 'd' - каталог, 'l' - ссылка, '?' - неизвестно
+} ftp_entry_t;
+
+typedef struct {
+    ftp_entry_t *entries;
+    int count;
+    int capacity;
+    int skipped;            // Неразобранные и слишком длинные строки
+    int from_mlsd;          // Получен через MLSD, а не LIST
+    name_pool_t names;
+} ftp_listing_t;
+
+// Обработчик записи в потоковом режиме; ненулевой результат прекращает приём
+typedef int (*ftp_entry_callback)(const ftp_entry_t *entry, void *user_data);
+
+unsigned long name_hash(const char *name, size_t length) {
+    unsigned long hash = 2166136261u;
+
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void name_pool_free(name_pool_t *pool) {
+    while (pool->blocks) {
+        name_block_t *next = pool->blocks->next;
+        free(pool->blocks);
+        pool->blocks = next;
+    }
+    free(pool->table);
+    memset(pool, 0, sizeof(*pool));
+}
+
+// Поиск имени в пуле с добавлением при отсутствии
+const char *name_pool_intern(name_pool_t *pool, const char *name, size_t length) {
+    name_block_t *block = pool->blocks;
+    size_t slot;
+    char *copy;
+
+    // Таблица заполняется не более чем наполовину
+    if ((pool->count + 1) * 2 > pool->table_size) {
+        size_t size = pool->table_size ? pool->table_size * 2 : 1024;
+        const char **table = calloc(size, sizeof(*table));
+
+        if (!table) return NULL;
+        for (size_t i = 0; i < pool->table_size; i++) {
+            const char *old = pool->table[i];
+            if (!old) continue;
+            slot = name_hash(old, strlen(old)) & (size - 1);
+            while (table[slot]) slot = (slot + 1) & (size - 1);
+            table[slot] = old;
+        }
+        free(pool->table);
+        pool->table = table;
+        pool->table_size = size;
+    }
+
+    slot = name_hash(name, length) & (pool->table_size - 1);
+    while (pool->table[slot]) {
+        const char *known = pool->table[slot];
+        if (strncmp(known, name, length) == 0 && known[length] == '\0') {
+            return known;
+        }
+        slot = (slot + 1) & (pool->table_size - 1);
+    }
+
+    if (!block || block->capacity - block->used < length + 1) {
+        size_t capacity = length + 1 > NAME_ARENA_BLOCK ? length + 1 : NAME_ARENA_BLOCK;
+        block = malloc(sizeof(*block) + capacity);
+        if (!block) return NULL;
+        block->next = pool->blocks;
+        block->used = 0;
+        block->capacity = capacity;
+        pool->blocks = block;
+    }
+    copy = block->data + block->used;
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    block->used += length + 1;
+    pool->bytes += length + 1;
+    pool->table[slot] = copy;
+    pool->count++;
+    return copy;
+}
+
+void ftp_listing_free(ftp_listing_t *listing) {
+    free(listing->entries);
+    name_pool_free(&listing->names);
+    memset(listing, 0, sizeof(*listing));
+}
+
+// Разбор отметки времени вида YYYYMMDDHHMMSS[.sss] (UTC)
+time_t parse_mdtm_stamp(const char *text) {
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(text, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+        return 0;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return timegm(&tm);
+}
+
+// Время изменения файла на сервере (MDTM), 0 - неизвестно
+time_t ftp_mdtm(ftp_client_t *client, const char *remote_file) {
+    char buffer[BUFFER_SIZE];
+    char command[CMD_SIZE];
+
+    if (!ftp_has_feature(client, FEAT_MDTM)) {
+        return 0;
+    }
+
+    snprintf(command, sizeof(command), "MDTM %s", remote_file);
+    if (ftp_command(client, command, buffer, sizeof(buffer)) == 213) {
+        return parse_mdtm_stamp(buffer + 4);
+    }
+    return 0;
+}
+
+// Разбор строки MLSD: "факт=значение;...; имя".
+// Возвращает 0 - запись, 1 - служебная запись (cdir/pdir), -1 - ошибка
+int parse_mlsd_line(char *line, ftp_entry_t *entry) {
+    char *name = strchr(line, ' ');
+    char *fact, *saveptr;
+
+    if (!name || name[1] == '\0') return -1;
+    *name++ = '\0';
+
+    entry->name = name;
+    entry->size = -1;
+    entry->mtime = 0;
+    entry->type = '?';
+    for (fact = strtok_r(line, ";", &saveptr); fact; fact = strtok_r(NULL, ";", &saveptr)) {
+        char *value = strchr(fact, '=');
+        if (!value) continue;
+        *value++ = '\0';
+        if (strcasecmp(fact, "type") == 0) {
+            if (strcasecmp(value, "cdir") == 0 || strcasecmp(value, "pdir") == 0) return 1;
+            if (strcasecmp(value, "file") == 0) entry->type = 'f';
+            else if (strcasecmp(value, "dir") == 0) entry->type = 'd';
+            else if (strncasecmp(value, "OS.unix=slink", 13) == 0 ||
+                     strncasecmp(value, "OS.unix=symlink", 15) == 0) entry->type = 'l';
+        } else if (strcasecmp(fact, "size") == 0 || strcasecmp(fact, "sizd") == 0) {
+            entry->size = strtoll(value, NULL, 10);
+        } else if (strcasecmp(fact, "modify") == 0) {
+            entry->mtime = parse_mdtm_stamp(value);
+        }
+    }
+    return 0;
+}
+
+int parse_month(const char *text) {
+    static const char *months[] = {"jan", "feb", "mar", "apr", "may", "jun",
+                                   "jul", "aug", "sep", "oct", "nov", "dec"};
+
+    for (int i = 0; i < 12; i++) {
+        if (strncasecmp(text, months[i], 3) == 0 && text[3] == ' ') return i;
+    }
+    return -1;
+}
+
+// Разбор строки LIST в формате ls -l ("-rw-r--r-- 1 u g 123 Mar 10 12:34 имя")
+// или DOS ("03-10-24  12:34PM  <DIR>  имя"). Строки, не подходящие ни под
+// один формат, считаются голым именем (так некоторые серверы отвечают на LIST файла).
+// Возвращает 0 - запись, 1 - служебная строка, -1 - ошибка
+int parse_list_line(char *line, ftp_entry_t *entry, time_t now) {
+    char *fields[9];
+    int count = 0, month = -1, day, hour = 0, minute = 0, year;
+    struct tm tm;
+    char *p = line;
+
+    entry->size = -1;
+    entry->mtime = 0;
+    entry->type = '?';
+    if (strncmp(line, "total ", 6) == 0) return 1;
+
+    while (count < 9) {
+        while (*p == ' ') p++;
+        if (!*p) break;
+        fields[count++] = p;
+        while (*p && *p != ' ') p++;
+    }
+
+    memset(&tm, 0, sizeof(tm));
+    if (count >= 4 && isdigit((unsigned char)line[0]) && line[2] == '-') {
+        int month_number, am_pm = 0;
+        char *name = fields[3];
+
+        if (sscanf(fields[0], "%2d-%2d-%d", &month_number, &day, &year) != 3 ||
+            sscanf(fields[1], "%d:%d", &hour, &minute) != 2) {
+            goto bare_name;
+        }
+        if (strchr(fields[1], 'P') || strchr(fields[1], 'p')) am_pm = 12;
+        tm.tm_year = year < 70 ? year + 100 : year < 100 ? year : year - 1900;
+        tm.tm_mon = month_number - 1;
+        tm.tm_mday = day;
+        tm.tm_hour = hour % 12 + am_pm;
+        tm.tm_min = minute;
+        entry->mtime = timegm(&tm);
+        if (strncmp(fields[2], "<DIR>", 5) == 0) {
+            entry->type = 'd';
+        } else {
+            entry->type = 'f';
+            entry->size = strtoll(fields[2], NULL, 10);
+        }
+        entry->name = name;
+        return 0;
+    }
+
+    // Месяц ищем после размера: у части серверов нет поля группы
+    for (int i = 3; count >= 7 && i + 2 < count && i < 6; i++) {
+        if (isdigit((unsigned char)fields[i - 1][0]) && (month = parse_month(fields[i])) >= 0) {
+            char *name = fields[i + 2];
+            entry->size = strtoll(fields[i - 1], NULL, 10);
+            day = atoi(fields[i + 1]);
+            if (sscanf(fields[i + 2], "%d:%d", &hour, &minute) == 2) {
+                // Без года - последние полгода; дата в будущем относится к прошлому году
+                struct tm current;
+                gmtime_r(&now, &current);
+                year = current.tm_year + 1900;
+                if (month > current.tm_mon) year--;
+            } else {
+                year = atoi(fields[i + 2]);
+                hour = minute = 0;
+            }
+            while (*name && *name != ' ') name++;
+            if (*name == ' ') name++;
+            if (!*name) return -1;
+            tm.tm_year = year - 1900;
+            tm.tm_mon = month;
+            tm.tm_mday = day;
+            tm.tm_hour = hour;
+            tm.tm_min = minute;
+            entry->mtime = timegm(&tm);
+            entry->type = line[0] == 'd' ? 'd' : line[0] == 'l' ? 'l' : line[0] == '-' ? 'f' : '?';
+            if (entry->type == 'l') {
+                char *arrow = strstr(name, " -> ");
+                if (arrow) *arrow = '\0';
+            }
+            entry->name = name;
+            return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+        }
+    }
+
+bare_name:
+    entry->name = line;
+    return 0;
+}
+
+// Потоковый приём листинга каталога path (или текущего): MLSD, если сервер
+// его поддерживает, иначе LIST. Каждая запись передаётся в callback и не
+// сохраняется, поэтому память не зависит от размера каталога. Имя записи
+// действительно только во время вызова
+int ftp_list_stream(ftp_client_t *client, const char *path, ftp_entry_callback callback,
+                    void *user_data, int *used_mlsd, int *skipped) {
+    char buffer[LISTING_LINE_MAX * 4];
+    char command[CMD_SIZE];
+    size_t start = 0, end = 0;
+    int code = 0, mlsd, discarding = 0, stopped = 0;
+    time_t now = time(NULL);
+
+    *skipped = 0;
+    mlsd = !client->no_mlsd && ftp_has_feature(client, FEAT_MLST);
+    while (1) {
+        if (ftp_set_type(client, 'A') < 0 || ftp_set_mode(client, 'S') < 0 || ftp_passive_mode(client) < 0) {
+            return -1;
+        }
+        snprintf(command, sizeof(command), "%s%s%s", mlsd ? "MLSD" : "LIST",
+                 path && path[0] ? " " : "", path && path[0] ? path : "");
+        code = ftp_command(client, command, NULL, 0);
+        if (code == 150 || code == 125) break;
+        close(client->data_socket);
+        // Сервер объявил MLST, но не понимает MLSD - повторяем через LIST
+        if (mlsd && (code == 500 || code == 502 || code == 504)) {
+            client->no_mlsd = 1;
+            mlsd = 0;
+            continue;
+        }
+        return -1;
+    }
+    *used_mlsd = mlsd;
+
+    while (!stopped) {
+        ssize_t n;
+        char *newline;
+
+        if (end == sizeof(buffer) - 1) {
+            if (start > 0) {
+                memmove(buffer, buffer + start, end - start);
+                end -= start;
+                start = 0;
+            } else {
+                // Строка не помещается в буфер - пропускаем её до конца
+                discarding = 1;
+                (*skipped)++;
+                start = end = 0;
+            }
+        }
+        n = recv(client->data_socket, buffer + end, sizeof(buffer) - 1 - end, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n > 0) {
+            end += n;
+        } else if (end > start && !discarding) {
+            buffer[end++] = '\n';  // Последняя строка без перевода строки
+        }
+
+        while (start < end && (newline = memchr(buffer + start, '\n', end - start)) != NULL) {
+            char *line = buffer + start;
+            ftp_entry_t entry;
+            int result;
+
+            *newline = '\0';
+            start = newline - buffer + 1;
+            if (discarding) {
+                discarding = 0;
+                continue;
+            }
+            if (newline > line && newline[-1] == '\r') newline[-1] = '\0';
+            if (!line[0]) continue;
+            if (newline - line > LISTING_LINE_MAX) {
+                (*skipped)++;
+                continue;
+            }
+            result = mlsd ? parse_mlsd_line(line, &entry) : parse_list_line(line, &entry, now);
+            if (result < 0 || strlen(entry.name) >= MAX_PATH) {
+                (*skipped)++;
+                continue;
+            }
+            if (result == 0 && callback(&entry, user_data) != 0) {
+                stopped = 1;
+                break;
+            }
+        }
+        if (n <= 0) break;
+    }
+
+    // При досрочной остановке сервер ответит 426 на закрытое соединение
+    code = ftp_finish_transfer(client);
+    return stopped ? 0 : code;
+}
+
+// Добавление записи в листинг с интернированием имени
+int listing_append_entry(const ftp_entry_t *entry, void *user_data) {
+    ftp_listing_t *listing = user_data;
+    ftp_entry_t *stored;
+
+    if (listing->count == listing->capacity) {
+        int capacity = listing->capacity ? listing->capacity * 2 : 256;
+        ftp_entry_t *grown = realloc(listing->entries, sizeof(ftp_entry_t) * capacity);
+        if (!grown) return -1;
+        listing->entries = grown;
+        listing->capacity = capacity;
+    }
+    stored = &listing->entries[listing->count];
+    *stored = *entry;
+    stored->name = name_pool_intern(&listing->names, entry->name, strlen(entry->name));
+    if (!stored->name) return -1;
+    listing->count++;
+    return 0;
+}
+
+// Получение разобранного листинга каталога path целиком в память.
+// Освобождается через ftp_listing_free
+int ftp_list_directory(ftp_client_t *client, const char *path, ftp_listing_t *listing) {
+    memset(listing, 0, sizeof(*listing));
+    if (ftp_list_stream(client, path, listing_append_entry, listing,
+                        &listing->from_mlsd, &listing->skipped) < 0) {
+        ftp_listing_free(listing);
+        return -1;
+    }
+    return 0;
+}
+
+// Кэш листингов сессии по абсолютному пути каталога
+typedef struct {
+    char path[MAX_PATH];    // Пустая строка - свободный слот
+    double fetched;         // Момент получения листинга
+    double used;            // Последнее обращение, для вытеснения
+    ftp_listing_t listing;
+} listing_cache_slot_t;
+
+typedef struct listing_cache {
+    listing_cache_slot_t slots[LISTING_CACHE_SLOTS];
+    ftp_listing_t uncached;   // Последний листинг при выключенном кэше, в слоты не попадает
+    long long hits;
+    long long misses;
+} listing_cache_t;
+
+void listing_cache_drop(listing_cache_slot_t *slot) {
+    ftp_listing_free(&slot->listing);
+    slot->path[0] = '\0';
+}
+
+// Очистка кэша листингов (смена сервера, пользователя, ошибка сессии)
+void ftp_cache_clear(ftp_client_t *client) {
+    if (!client->listing_cache) return;
+    for (int i = 0; i < LISTING_CACHE_SLOTS; i++) {
+        listing_cache_drop(&client->listing_cache->slots[i]);
+    }
+    ftp_listing_free(&client->listing_cache->uncached);
+    free(client->listing_cache);
+    client->listing_cache = NULL;
+}
+
+// Сброс кэша после изменения path на сервере: листинг родительского
+// каталога, самого path и всех вложенных в него каталогов
+void ftp_cache_invalidate(ftp_client_t *client, const char *path) {
+    char absolute[MAX_PATH], parent[MAX_PATH];
+    size_t length;
+
+    if (!client->listing_cache) return;
+    resolve_remote_path(client->current_dir, path, absolute, sizeof(absolute));
+    resolve_remote_path(absolute, "..", parent, sizeof(parent));
+    length = strlen(absolute);
+    for (int i = 0; i < LISTING_CACHE_SLOTS; i++) {
+        listing_cache_slot_t *slot = &client->listing_cache->slots[i];
+        if (!slot->path[0]) continue;
+        if (strcmp(slot->path, parent) == 0 ||
+            (strncmp(slot->path, absolute, length) == 0 &&
+             (slot->path[length] == '\0' || slot->path[length] == '/' || length == 1))) {
+            listing_cache_drop(slot);
+        }
+    }
+}
+
+// Листинг каталога path из кэша, если он не старше listing_ttl, иначе
+// с сервера. Листинг принадлежит кэшу и действителен до следующего
+// обращения к кэшу; age - возраст листинга в секундах, -1 - только что получен
+const ftp_listing_t *ftp_cached_listing(ftp_client_t *client, const char *path, double *age) {
+    listing_cache_t *cache = client->listing_cache;
+    listing_cache_slot_t *slot = NULL;
+    char absolute[MAX_PATH];
+    double now = now_seconds();
+
+    if (!cache) {
+        cache = client->listing_cache = calloc(1, sizeof(listing_cache_t));
+        if (!cache) return NULL;
+    }
+    resolve_remote_path(client->current_dir, path ? path : "", absolute, sizeof(absolute));
+
+    for (int i = 0; i < LISTING_CACHE_SLOTS; i++) {
+        listing_cache_slot_t *candidate = &cache->slots[i];
+        if (strcmp(candidate->path, absolute) == 0) {
+            slot = candidate;
+            break;
+        }
+        // Подходящий слот для замены: свободный или давно не использованный
+        if (!slot || (slot->path[0] && (!candidate->path[0] || candidate->used < slot->used))) {
+            slot = candidate;
+        }
+    }
+
+    if (strcmp(slot->path, absolute) == 0 && now - slot->fetched < client->listing_ttl) {
+        cache->hits++;
+        *age = now - slot->fetched;
+    } else {
+        ftp_listing_t fetched;
+
+        // Разрыв соединения во время приёма очищает кэш вместе со слотом
+        if (ftp_list_directory(client, absolute, &fetched) < 0) {
+            return NULL;
+        }
+        if (client->listing_cache != cache) {
+            ftp_listing_free(&fetched);
+            return NULL;
+        }
+        // Выключенный кэш ничего не запоминает: листинг живёт до следующего обращения
+        if (client->listing_ttl <= 0) {
+            ftp_listing_free(&cache->uncached);
+            cache->uncached = fetched;
+            *age = -1;
+            return &cache->uncached;
+        }
+        cache->misses++;
+        listing_cache_drop(slot);
+        slot->listing = fetched;
+        snprintf(slot->path, sizeof(slot->path), "%s", absolute);
+        slot->fetched = now_seconds();
+        *age = -1;
+    }
+    slot->used = now;
+    return &slot->listing;
+}
+
+void ftp_cache_print(ftp_client_t *client) {
+    listing_cache_t *cache = client->listing_cache;
+    double now = now_seconds();
+    int used = 0;
+
+    printf("Listing cache: TTL %.1f s", client->listing_ttl);
+    if (!cache) {
+        printf(", empty\n");
+        return;
+    }
+    printf(", %lld hits, %lld misses\n", cache->hits, cache->misses);
+    for (int i = 0; i < LISTING_CACHE_SLOTS; i++) {
+        listing_cache_slot_t *slot = &cache->slots[i];
+        if (!slot->path[0]) continue;
+        printf("  %-40s %6d entries, %7zu name bytes, age %.1f s%s\n", slot->path, slot->listing.count,
+               slot->listing.names.bytes, now - slot->fetched,
+               now - slot->fetched < client->listing_ttl ? "" : " (expired)");
+        used++;
+    }
+    printf("  %d of %d slots used\n", used, LISTING_CACHE_SLOTS);
+}
+
+// Изменение дерева каталогов на сервере. Кэш сбрасывается даже при
+// ошибке: сервер мог выполнить команду частично
+int ftp_delete(ftp_client_t *client, const char *path) {
+    char command[CMD_SIZE];
+    int code;
+
+    snprintf(command, sizeof(command), "DELE %s", path);
+    code = ftp_command(client, command, NULL, 0);
+    ftp_cache_invalidate(client, path);
+    return code == 250 ? 0 : -1;
+}
+
+int ftp_mkdir(ftp_client_t *client, const char *path) {
+    char command[CMD_SIZE];
+    int code;
+
+    snprintf(command, sizeof(command), "MKD %s", path);
+    code = ftp_command(client, command, NULL, 0);
+    ftp_cache_invalidate(client, path);
+    return code == 257 ? 0 : -1;
+}
+
+int ftp_rmdir(ftp_client_t *client, const char *path) {
+    char command[CMD_SIZE];
+    int code;
+
+    snprintf(command, sizeof(command), "RMD %s", path);
+    code = ftp_command(client, command, NULL, 0);
+    ftp_cache_invalidate(client, path);
+    return code == 250 ? 0 : -1;
+}
+
+int ftp_rename(ftp_client_t *client, const char *from, const char *to) {
+    char command[CMD_SIZE];
+    int code;
+
+    snprintf(command, sizeof(command), "RNFR %s", from);
+    if (ftp_command(client, command, NULL, 0) != 350) {
+        return -1;
+    }
+    snprintf(command, sizeof(command), "RNTO %s", to);
+    code = ftp_command(client, command, NULL, 0);
+    ftp_cache_invalidate(client, from);
+    ftp_cache_invalidate(client, to);
+    return code == 250 ? 0 : -1;
+}
+
+int compare_entry_names(const void *a, const void *b) {
+    return strcmp(((const ftp_entry_t *)a)->name, ((const ftp_entry_t *)b)->name);
+}
+
+int compare_entry_sizes(const void *a, const void *b) {
+    const ftp_entry_t *x = a, *y = b;
+    return x->size < y->size ? 1 : x->size > y->size ? -1 : strcmp(x->name, y->name);
+}
+
+int compare_entry_times(const void *a, const void *b) {
+    const ftp_entry_t *x = a, *y = b;
+    return x->mtime < y->mtime ? 1 : x->mtime > y->mtime ? -1 : strcmp(x->name, y->name);
+}
+
+// Те же порядки для массива указателей на записи: листинг из кэша общий
+// и при сортировке для вывода не переупорядочивается
+int compare_entry_name_refs(const void *a, const void *b) {
+    return compare_entry_names(*(const ftp_entry_t * const *)a, *(const ftp_entry_t * const *)b);
+}
+
+int compare_entry_size_refs(const void *a, const void *b) {
+    return compare_entry_sizes(*(const ftp_entry_t * const *)a, *(const ftp_entry_t * const *)b);
+}
+
+int compare_entry_time_refs(const void *a, const void *b) {
+    return compare_entry_times(*(const ftp_entry_t * const *)a, *(const ftp_entry_t * const *)b);
+}
+
+void print_entry(const ftp_entry_t *entry) {
+    char stamp[32] = "-";
+
+    if (entry->mtime) {
+        struct tm tm;
+        gmtime_r(&entry->mtime, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", &tm);
+    }
+    if (entry->size >= 0) {
+        printf("%c %14lld  %-16s  %s\n", entry->type, entry->size, stamp, entry->name);
+    } else {
+        printf("%c %14s  %-16s  %s\n", entry->type, "-", stamp, entry->name);
+    }
+}
+
+// Параметры вывода команды list
+typedef struct {
+    char sort;              // 'n' - по имени, 's' - по размеру, 't' - по времени
+    int reverse;
+    int stream;             // Печатать по мере приёма, без сортировки и хранения
+    const char *mask;       // Фильтр имён (fnmatch) или NULL
+    long long count;
+    long long bytes;
+} list_options_t;
+
+int print_streamed_entry(const ftp_entry_t *entry, void *user_data) {
+    list_options_t *options = user_data;
+
+    if (options->mask && fnmatch(options->mask, entry->name, 0) != 0) return 0;
+    print_entry(entry);
+    options->count++;
+    if (entry->type != 'd' && entry->size > 0) options->bytes += entry->size;
+    return 0;
+}
+
+// Список файлов на сервере
+int ftp_list_files(ftp_client_t *client, const char *path, list_options_t *options) {
+    const ftp_listing_t *listing;
+    const ftp_entry_t **order;
+    double age = -1;
+    int skipped = 0;
+
+    printf("\nFile listing for %s:\n", path && path[0] ? path : client->current_dir);
+    printf("----------------------------------------\n");
+    if (options->stream) {
+        int used_mlsd;
+        if (ftp_list_stream(client, path, print_streamed_entry, options, &used_mlsd, &skipped) < 0) {
+            return -1;
+        }
+    } else {
+        listing = ftp_cached_listing(client, path, &age);
+        if (!listing) {
+            return -1;
+        }
+        skipped = listing->skipped;
+        order = malloc(sizeof(ftp_entry_t *) * (listing->count ? listing->count : 1));
+        if (!order) {
+            fprintf(stderr, "Not enough memory to sort the listing\n");
+            return -1;
+        }
+        for (int i = 0; i < listing->count; i++) order[i] = &listing->entries[i];
+        qsort(order, listing->count, sizeof(ftp_entry_t *),
+              options->sort == 's' ? compare_entry_size_refs :
+              options->sort == 't' ? compare_entry_time_refs : compare_entry_name_refs);
+        for (int i = 0; i < listing->count; i++) {
+            print_streamed_entry(order[options->reverse ? listing->count - 1 - i : i], options);
+        }
+        free(order);
+    }
+    printf("----------------------------------------\n");
+    printf("%lld entries, %lld bytes", options->count, options->bytes);
+    if (skipped) printf(", %d unparsed lines skipped", skipped);
+    if (age >= 0) printf(" (from cache, %.1f s old)", age);
+    printf("\n");
+    return 0;
+}
+
+// Одна передача в пакетном задании
+typedef struct {
+    int upload;              // 1 - STOR, 0 - RETR
+    char *local_path;
+    char *remote_path;
+    long long bytes;
+    int status;
+    time_t mtime;            // Для RETR - время изменения для скачанного файла (0 - не менять)
+} ftp_job_t;
+
+// Пул сессий, разбирающих общий список заданий
+typedef struct {
+    const ftp_client_t *origin;
+    ftp_job_t *jobs;
+    int count;
+    int next;                // Индекс следующего свободного задания
+    int done;                // Под lock; о каждом выполненном задании сообщает changed
+    int failed;
+    long long bytes;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ftp_pool_t;
+
+// Выполнение одного задания в сессии
+int run_job(ftp_client_t *session, ftp_job_t *job) {
+    if (job->upload) {
+        return ftp_upload_file(session, job->local_path, job->remote_path);
+    }
+    if (ftp_download_file(session, job->remote_path, job->local_path) < 0) {
+        return -1;
+    }
+    if (job->mtime) {
+        struct timespec times[2] = {{0, UTIME_OMIT}, {job->mtime, 0}};
+        utimensat(AT_FDCWD, job->local_path, times, 0);
+    }
+    return 0;
+}
+
+// Поток пула: своя сессия, задания берутся из общего счётчика
+void *pool_worker(void *arg) {
+    ftp_pool_t *pool = arg;
+    ftp_client_t session;
+    int connected = 0;
+
+    while (1) {
+        int index = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        ftp_job_t *job;
+
+        if (index >= pool->count) break;
+        job = &pool->jobs[index];
+
+        // Сессия открывается при первом задании и заново после обрыва
+        if (!connected && ftp_open_session(&session, pool->origin) == 0) {
+            connected = 1;
+        }
+        job->status = connected ? run_job(&session, job) : -1;
+        if (job->status == 0) {
+            job->bytes = session.last_transfer_bytes;
+            __atomic_fetch_add(&pool->bytes, job->bytes, __ATOMIC_RELAXED);
+        } else {
+            fprintf(stderr, "Transfer failed: %s\n", job->upload ? job->local_path : job->remote_path);
+            __atomic_fetch_add(&pool->failed, 1, __ATOMIC_RELAXED);
+            if (connected && session.disconnected) {
+                // Следующее задание откроет новую сессию
+                close(session.control_socket);
+                connected = 0;
+            }
+        }
+        pthread_mutex_lock(&pool->lock);
+        pool->done++;
+        pthread_cond_signal(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (connected) {
+        ftp_disconnect(&session);
+    }
+    return NULL;
+}
+
+// Выполнение списка заданий пулом из workers сессий с выводом
+// суммарной пропускной способности
+int ftp_run_pool(ftp_client_t *client, ftp_job_t *jobs, int count, int workers) {
+    pthread_t threads[MAX_WORKERS];
+    ftp_pool_t pool;
+    double started, elapsed;
+    int created = 0, tty;
+
+    if (count == 0) {
+        printf("Nothing to transfer\n");
+        return 0;
+    }
+    if (workers > count) {
+        workers = count;
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    pool.origin = client;
+    pool.jobs = jobs;
+    pool.count = count;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.changed, NULL);
+
+    printf("Transferring %d files with %d sessions\n", count, workers);
+    started = now_seconds();
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&threads[created], NULL, pool_worker, &pool) == 0) {
+            created++;
+        }
+    }
+    if (created == 0) {
+        pthread_mutex_destroy(&pool.lock);
+        pthread_cond_destroy(&pool.changed);
+        return -1;
+    }
+
+    // Прогресс выводится только на терминал; ожидание заканчивается по
+    // сигналу последнего задания, а не по истечении периода перерисовки
+    tty = isatty(STDOUT_FILENO);
+    pthread_mutex_lock(&pool.lock);
+    while (pool.done < count) {
+        elapsed = now_seconds() - started;
+        if (tty) {
+            printf("\r%d/%d files, %.2f MB/s\033[K", pool.done, count,
+                   elapsed > 0 ? __atomic_load_n(&pool.bytes, __ATOMIC_RELAXED) / elapsed / (1024 * 1024) : 0.0);
+            fflush(stdout);
+        }
+        wait_progress(&pool.changed, &pool.lock, tty);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < created; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.changed);
+    // Загрузки шли через другие сессии - кэш листингов этой сессии устарел
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].upload) ftp_cache_invalidate(client, jobs[i].remote_path);
+    }
+
+    elapsed = now_seconds() - started;
+    printf("%s%d/%d files transferred, %d failed\n", tty ? "\r\033[K" : "",
+           count - pool.failed, count, pool.failed);
+    printf("Aggregate: %lld bytes in %.3f s (%.2f MB/s, %.1f files/s)\n", pool.bytes, elapsed,
+           elapsed > 0 ? pool.bytes / elapsed / (1024 * 1024) : 0.0, elapsed > 0 ? count / elapsed : 0.0);
+
+    return pool.failed ? -1 : 0;
+}
+
+void free_jobs(ftp_job_t *jobs, int count) {
+    for (int i = 0; i < count; i++) {
+        free(jobs[i].local_path);
+        free(jobs[i].remote_path);
+    }
+    free(jobs);
+}
+
+// Последний компонент пути
+const char *path_basename(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// Чтение списка путей из файла (по одному на строку)
+int read_list_file(const char *list_file, char ***paths, int *count) {
+    char line[MAX_PATH];
+    int capacity = 0, failed = 0;
+    FILE *file;
+
+    *paths = NULL;
+    *count = 0;
+    file = fopen(list_file, "r");
+    if (!file) {
+        perror(list_file);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        if (*count == capacity) {
+            char **grown;
+            capacity = capacity ? capacity * 2 : 256;
+            grown = realloc(*paths, sizeof(char *) * capacity);
+            if (!grown) {
+                failed = 1;
+                break;
+            }
+            *paths = grown;
+        }
+        if (!((*paths)[*count] = strdup(line))) {
+            failed = 1;
+            break;
+        }
+        (*count)++;
+    }
+    if (failed) {
+        fprintf(stderr, "Out of memory while reading %s\n", list_file);
+        fclose(file);
+        free_name_list(*paths, *count);
+        *paths = NULL;
+        *count = 0;
+        return -1;
+    }
+    fclose(file);
+    return 0;
+}
+
+// Загрузка на сервер файлов по маске или списку (@файл) в каталог remote_dir
+int ftp_mput(ftp_client_t *client, const char *pattern, const char *remote_dir, int workers) {
+    char **paths = NULL;
+    ftp_job_t *jobs;
+    glob_t matches;
+    int count = 0, job_count = 0, result;
+
+    if (pattern[0] == '@') {
+        if (read_list_file(pattern + 1, &paths, &count) < 0) return -1;
+    } else {
+        if (glob(pattern, 0, NULL, &matches) != 0) {
+            printf("No local files match %s\n", pattern);
+            return -1;
+        }
+        paths = malloc(sizeof(char *) * matches.gl_pathc);
+        for (size_t i = 0; paths && i < matches.gl_pathc; i++) {
+            if (!(paths[count] = strdup(matches.gl_pathv[i]))) break;
+            count++;
+        }
+        if (!paths || count < (int)matches.gl_pathc) {
+            fprintf(stderr, "Out of memory while expanding %s\n", pattern);
+            free_name_list(paths, count);
+            globfree(&matches);
+            return -1;
+        }
+        globfree(&matches);
+    }
+
+    jobs = calloc(count ? count : 1, sizeof(ftp_job_t));
+    for (int i = 0; jobs && i < count; i++) {
+        struct stat st;
+        char remote[MAX_PATH * 2];
+
+        // Каталоги и прочие не-файлы пропускаются
+        if (stat(paths[i], &st) < 0 || !S_ISREG(st.st_mode)) continue;
+        if (remote_dir && remote_dir[0]) {
+            snprintf(remote, sizeof(remote), "%s/%s", remote_dir, path_basename(paths[i]));
+        } else {
+            snprintf(remote, sizeof(remote), "%s", path_basename(paths[i]));
+        }
+        jobs[job_count].upload = 1;
+        jobs[job_count].local_path = strdup(paths[i]);
+        jobs[job_count].remote_path = strdup(remote);
+        job_count++;
+        if (!jobs[job_count - 1].local_path || !jobs[job_count - 1].remote_path) {
+            fprintf(stderr, "Out of memory while expanding %s\n", pattern);
+            free_jobs(jobs, job_count);
+            jobs = NULL;
+        }
+    }
+    free_name_list(paths, count);
+    if (!jobs) return -1;
+
+    result = ftp_run_pool(client, jobs, job_count, workers);
+    free_jobs(jobs, job_count);
+    return result;
+}
+
+// Загрузка с сервера файлов по маске (по листингу каталога) или списку (@файл) в local_dir
+int ftp_mget(ftp_client_t *client, const char *pattern, const char *local_dir, int workers) {
+    char **names = NULL;
+    char directory[MAX_PATH];
+    const char *mask = pattern;
+    ftp_job_t *jobs;
+    int count = 0, job_count = 0, result;
+
+    directory[0] = '\0';
+    if (pattern[0] == '@') {
+        if (read_list_file(pattern + 1, &names, &count) < 0) return -1;
+        mask = NULL;
+    } else {
+        // Маска применяется к именам в каталоге, указанном в шаблоне
+        const char *slash = strrchr(pattern, '/');
+        if (slash) {
+            snprintf(directory, sizeof(directory), "%.*s", (int)(slash - pattern), pattern);
+            if (directory[0] == '\0') strcpy(directory, "/");
+            mask = slash + 1;
+        }
+        const ftp_listing_t *listing;
+        double age;
+
+        // Имена берутся из кэша листингов; каталоги не скачиваются
+        listing = ftp_cached_listing(client, directory, &age);
+        if (!listing) return -1;
+        names = malloc(sizeof(char *) * (listing->count ? listing->count : 1));
+        for (int i = 0; names && i < listing->count; i++) {
+            if (listing->entries[i].type == 'd') continue;
+            if (!(names[count] = strdup(listing->entries[i].name))) {
+                free_name_list(names, count);
+                names = NULL;
+                break;
+            }
+            count++;
+        }
+        if (!names) {
+            fprintf(stderr, "Out of memory while expanding %s\n", pattern);
+            return -1;
+        }
+    }
+
+    if (local_dir && local_dir[0]) {
+        mkdir(local_dir, 0755);
+    }
+    jobs = calloc(count ? count : 1, sizeof(ftp_job_t));
+    for (int i = 0; jobs && i < count; i++) {
+        const char *name = mask ? path_basename(names[i]) : names[i];
+        char remote[MAX_PATH * 2];
+        char local[MAX_PATH * 2];
+
+        if (mask && fnmatch(mask, name, 0) != 0) continue;
+        if (mask && directory[0]) {
+            snprintf(remote, sizeof(remote), "%s%s%s", directory,
+                     directory[strlen(directory) - 1] == '/' ? "" : "/", name);
+        } else {
+            snprintf(remote, sizeof(remote), "%s", name);
+        }
+        snprintf(local, sizeof(local), "%s%s%s", local_dir && local_dir[0] ? local_dir : ".",
+                 "/", path_basename(name));
+        jobs[job_count].upload = 0;
+        jobs[job_count].local_path = strdup(local);
+        jobs[job_count].remote_path = strdup(remote);
+        job_count++;
+        if (!jobs[job_count - 1].local_path || !jobs[job_count - 1].remote_path) {
+            fprintf(stderr, "Out of memory while expanding %s\n", pattern);
+            free_jobs(jobs, job_count);
+            jobs = NULL;
+        }
+    }
+    free_name_list(names, count);
+    if (!jobs) return -1;
+
+    result = ftp_run_pool(client, jobs, job_count, workers);
+    free_jobs(jobs, job_count);
+    return result;
+}
+
+// План синхронизации дерева: задания для пула и сводка
+typedef struct {
+    ftp_job_t *jobs;
+    int count;
+    int capacity;
+    int upload;             // 1 - sync (локальное -> сервер), 0 - mirror
+    int dry_run;            // Только показать план
+    int planned;            // Файлов к передаче
+    int files;              // Просмотрено файлов
+    int errors;             // Каталоги, которые не удалось прочитать или создать
+    long long bytes;        // Объём к передаче
+    long long total_bytes;  // Объём всех просмотренных файлов
+    long long min_size;     // Файлы меньше не передаются (уходят в архив гибридной передачи)
+    const char *root;       // Корень дерева на сервере
+    const char *exclude;    // Префикс имён в корне, не входящих в mirror (архив мелких файлов)
+} sync_plan_t;
+
+// Причина передачи файла или NULL, если копии совпадают. Время из LIST
+// известно с точностью до минуты, поэтому сравнивается с допуском slack.
+// Размер сравнивается, только если известен с обеих сторон; без него
+// решает время, а если неизвестно и оно - файл передаётся
+const char *sync_reason(long long size, time_t mtime, const ftp_entry_t *remote, int upload, int slack) {
+    if (!remote) return "new";
+    if (size >= 0 && remote->size >= 0) {
+        if (remote->size != size) return "size";
+    } else if (mtime == 0 || remote->mtime == 0) {
+        return "unknown";
+    }
+    if (remote->mtime == 0 || mtime == 0) return NULL;
+    if (upload ? mtime > remote->mtime + slack : remote->mtime > mtime + slack) return "newer";
+    return NULL;
+}
+
+// Добавление файла в план; ошибка выделения памяти учитывается в
+// plan->errors, чтобы синхронизация не считалась успешной без этого файла
+int sync_plan_add(sync_plan_t *plan, const char *local, const char *remote, long long size,
+                  time_t mtime, const char *reason) {
+    ftp_job_t *job;
+
+    printf("  %s %-5s %12lld  %s\n", plan->upload ? "put" : "get", reason, size,
+           plan->upload ? remote : local);
+    plan->planned++;
+    if (size > 0) plan->bytes += size;
+    if (plan->dry_run) return 0;
+
+    if (plan->count == plan->capacity) {
+        int capacity = plan->capacity ? plan->capacity * 2 : 256;
+        ftp_job_t *grown = realloc(plan->jobs, sizeof(ftp_job_t) * capacity);
+        if (!grown) {
+            fprintf(stderr, "Out of memory while planning %s\n", plan->upload ? local : remote);
+            plan->errors++;
+            return -1;
+        }
+        plan->jobs = grown;
+        plan->capacity = capacity;
+    }
+    job = &plan->jobs[plan->count];
+    memset(job, 0, sizeof(*job));
+    job->local_path = strdup(local);
+    job->remote_path = strdup(remote);
+    if (!job->local_path || !job->remote_path) {
+        fprintf(stderr, "Out of memory while planning %s\n", plan->upload ? local : remote);
+        free(job->local_path);
+        free(job->remote_path);
+        plan->errors++;
+        return -1;
+    }
+    plan->count++;
+    job->upload = plan->upload;
+    // Скачанный файл получает время изменения с сервера, чтобы следующий
+    // проход считал его актуальным
+    job->mtime = plan->upload ? 0 : mtime;
+    return 0;
+}
+
+// Поиск записи по имени в листинге, отсортированном compare_entry_names
+const ftp_entry_t *listing_find(const ftp_listing_t *listing, const char *name) {
+    ftp_entry_t key;
+
+    key.name = name;
+    return bsearch(&key, listing->entries, listing->count, sizeof(ftp_entry_t), compare_entry_names);
+}
+
+// Обход дерева на сервере (mirror): файлы, которых нет локально или
+// которые отличаются по размеру или более новые, добавляются в план
+void mirror_walk(ftp_client_t *client, sync_plan_t *plan, const char *remote_dir, const char *local_dir) {
+    ftp_listing_t listing;
+    int slack;
+
+    if (ftp_list_directory(client, remote_dir, &listing) < 0) {
+        printf("Cannot list remote directory %s\n", remote_dir);
+        plan->errors++;
+        return;
+    }
+    if (!plan->dry_run && mkdir(local_dir, 0755) < 0 && errno != EEXIST) {
+        printf("Cannot create local directory %s: %s\n", local_dir, strerror(errno));
+        plan->errors++;
+        ftp_listing_free(&listing);
+        return;
+    }
+    slack = listing.from_mlsd ? 0 : 60;
+
+    for (int i = 0; i < listing.count; i++) {
+        ftp_entry_t *entry = &listing.entries[i];
+        char remote[MAX_PATH], local[MAX_PATH * 2];
+        struct stat st;
+        const char *reason;
+        ftp_entry_t local_entry;
+
+        if (snprintf(remote, sizeof(remote), "%s%s%s", remote_dir,
+                     remote_dir[strlen(remote_dir) - 1] == '/' ? "" : "/", entry->name) >= (int)sizeof(remote)) {
+            plan->errors++;
+            continue;
+        }
+        snprintf(local, sizeof(local), "%s/%s", local_dir, entry->name);
+        if (plan->exclude && strcmp(remote_dir, plan->root) == 0 &&
+            strncmp(entry->name, plan->exclude, strlen(plan->exclude)) == 0) {
+            continue;
+        }
+        if (entry->type == 'd') {
+            mirror_walk(client, plan, remote, local);
+            continue;
+        }
+        if (entry->type != 'f') continue;
+
+        // Листинг без размера или времени дополняется SIZE/MDTM
+        if (entry->size < 0) entry->size = ftp_size(client, remote);
+        if (entry->mtime == 0) entry->mtime = ftp_mdtm(client, remote);
+        plan->files++;
+        plan->total_bytes += entry->size > 0 ? entry->size : 0;
+
+        // Локальная копия играет роль "удалённой" стороны сравнения
+        if (stat(local, &st) == 0) {
+            local_entry.size = st.st_size;
+            local_entry.mtime = st.st_mtime;
+            reason = sync_reason(entry->size, entry->mtime, &local_entry, 1, slack);
+        } else {
+            reason = "new";
+        }
+        if (reason) {
+            sync_plan_add(plan, local, remote, entry->size, entry->mtime, reason);
+        }
+    }
+    ftp_listing_free(&listing);
+}
+
+// Обход локального дерева (sync): файлы, которых нет на сервере или
+// которые отличаются по размеру или более новые, добавляются в план.
+// Недостающие каталоги на сервере создаются сразу, до запуска пула
+void sync_walk(ftp_client_t *client, sync_plan_t *plan, const char *local_dir, const char *remote_dir) {
+    ftp_listing_t listing;
+    struct dirent *item;
+    DIR *dir;
+    int slack, have_listing;
+
+    dir = opendir(local_dir);
+    if (!dir) {
+        printf("Cannot open local directory %s: %s\n", local_dir, strerror(errno));
+        plan->errors++;
+        return;
+    }
+
+    have_listing = ftp_list_directory(client, remote_dir, &listing) == 0;
+    if (!have_listing) {
+        memset(&listing, 0, sizeof(listing));
+        printf("  mkdir %s\n", remote_dir);
+        if (!plan->dry_run && ftp_mkdir(client, remote_dir) < 0) {
+            plan->errors++;
+            closedir(dir);
+            return;
+        }
+    }
+    qsort(listing.entries, listing.count, sizeof(ftp_entry_t), compare_entry_names);
+    slack = listing.from_mlsd ? 0 : 60;
+
+    while ((item = readdir(dir)) != NULL) {
+        char local[MAX_PATH * 2], remote[MAX_PATH];
+        const ftp_entry_t *entry;
+        ftp_entry_t probe;
+        const char *reason;
+        struct stat st;
+
+        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) continue;
+        snprintf(local, sizeof(local), "%s/%s", local_dir, item->d_name);
+        if (snprintf(remote, sizeof(remote), "%s%s%s", remote_dir,
+                     remote_dir[strlen(remote_dir) - 1] == '/' ? "" : "/", item->d_name) >= (int)sizeof(remote) ||
+            stat(local, &st) < 0) {
+            plan->errors++;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            sync_walk(client, plan, local, remote);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) continue;
+
+        plan->files++;
+        plan->total_bytes += st.st_size;
+        if (st.st_size < plan->min_size) continue;
+        entry = listing_find(&listing, item->d_name);
+        if (!entry && have_listing && item->d_name[0] == '.') {
+            // Многие серверы не показывают в листинге имена с точкой -
+            // наличие такого файла проверяется через SIZE и MDTM
+            memset(&probe, 0, sizeof(probe));
+            probe.name = item->d_name;
+            probe.type = 'f';
+            probe.size = ftp_size(client, remote);
+            probe.mtime = ftp_mdtm(client, remote);
+            if (probe.size >= 0 || probe.mtime != 0) {
+                entry = &probe;
+            }
+        }
+        if (entry && entry->type == 'd') {
+            printf("Remote %s is a directory, skipping\n", remote);
+            plan->errors++;
+            continue;
+        }
+        reason = sync_reason(st.st_size, st.st_mtime, entry, 1, slack);
+        if (reason) {
+            sync_plan_add(plan, local, remote, st.st_size, st.st_mtime, reason);
+        }
+    }
+    closedir(dir);
+    ftp_listing_free(&listing);
+}
+
+// Инкрементальная синхронизация дерева: upload - локальный local_dir на
+// сервер в remote_dir (sync), иначе remote_dir в local_dir (mirror).
+// Передаются только новые и изменившиеся файлы, пулом из workers сессий;
+// при отправке файлы меньше min_size пропускаются, при получении - имена
+// в корне remote_dir, начинающиеся с exclude (если не NULL)
+int ftp_sync_tree(ftp_client_t *client, const char *local_dir, const char *remote_dir,
+                  int upload, int workers, int dry_run, long long min_size, const char *exclude) {
+    char remote[MAX_PATH];
+    sync_plan_t plan;
+    double started = now_seconds();
+    int result = 0;
+
+    memset(&plan, 0, sizeof(plan));
+    plan.upload = upload;
+    plan.dry_run = dry_run;
+    plan.min_size = min_size;
+    plan.exclude = exclude;
+    resolve_remote_path(client->current_dir, remote_dir, remote, sizeof(remote));
+    plan.root = remote;
+
+    printf("%s %s %s %s%s\n", upload ? "Syncing" : "Mirroring", upload ? local_dir : remote,
+           "->", upload ? remote : local_dir, dry_run ? " (dry run)" : "");
+    if (upload) {
+        sync_walk(client, &plan, local_dir, remote);
+    } else {
+        mirror_walk(client, &plan, remote, local_dir);
+    }
+    printf("Scanned %d files (%lld bytes) in %.3f s: %d to transfer (%lld bytes)%s\n",
+           plan.files, plan.total_bytes, now_seconds() - started,
+           plan.planned, plan.bytes, plan.errors ? ", with errors" : "");
+
+    if (!dry_run) {
+        result = ftp_run_pool(client, plan.jobs, plan.count, workers);
+        free_jobs(plan.jobs, plan.count);
+    }
+    return result < 0 || plan.errors ? -1 : 0;
+}
+
+// Способы передачи каталога
+enum { TREE_AUTO, TREE_ARCHIVE, TREE_FILES, TREE_HYBRID, TREE_STRATEGIES };
+
+static const char *tree_strategy_names[TREE_STRATEGIES] = {"auto", "archive", "files", "hybrid"};
+
+// Сводка по локальному дереву для выбора способа передачи
+typedef struct {
+    int files;
+    int small_files;
+    long long small_bytes;
+    int large_files;        // Файлы от DIR_LARGE_FILE
+    long long large_bytes;
+    int samples;            // Больших файлов, проверенных на сжимаемость
+    long long sampled_bytes;
+    long long sampled_packed;
+} tree_profile_t;
+
+// Обход дерева: количество и размеры файлов, проба сжатия больших файлов
+// (из середины файла; заведомо сжатые форматы считаются несжимаемыми)
+void profile_tree(const char *path, tree_profile_t *profile) {
+    struct dirent *entry;
+    DIR *dir = opendir(path);
+
+    if (!dir) {
+        perror(path);
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        char child[MAX_PATH * 2];
+        long long raw, packed;
+        struct stat st;
+        int fd;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        if (lstat(child, &st) < 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            profile_tree(child, profile);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) continue;
+
+        profile->files++;
+        if (st.st_size < DIR_LARGE_FILE) {
+            profile->small_files++;
+            profile->small_bytes += st.st_size;
+            continue;
+        }
+        profile->large_files++;
+        profile->large_bytes += st.st_size;
+        if (profile->samples == DIR_SAMPLE_FILES) continue;
+        if (known_compressed(entry->d_name)) {
+            raw = packed = MODEZ_SAMPLE;
+        } else {
+            fd = open(child, O_RDONLY);
+            packed = fd >= 0 ? compress_sample(fd, st.st_size / 2, &raw) : -1;
+            if (fd >= 0) close(fd);
+            if (packed < 0) continue;
+        }
+        profile->samples++;
+        profile->sampled_bytes += raw;
+        profile->sampled_packed += packed;
+    }
+    closedir(dir);
+}
+
+// Выбор способа передачи по сводке; причина выбора пишется в reason
+int choose_tree_strategy(const tree_profile_t *profile, const archive_codec_t *codec, int workers,
+                         char *reason, size_t size) {
+    double ratio = profile->sampled_bytes ? (double)profile->sampled_packed / profile->sampled_bytes : 1.0;
+
+    if (profile->small_files < DIR_BUNDLE_MIN && profile->large_files > 0) {
+        snprintf(reason, size, "only %d small files; %d large files go directly over %d sessions",
+                 profile->small_files, profile->large_files, workers);
+        return TREE_FILES;
+    }
+    if (profile->large_files == 0) {
+        snprintf(reason, size, "all %d files are below %lld MiB; one archive stream avoids per-file setup",
+                 profile->files, DIR_LARGE_FILE >> 20);
+        return TREE_ARCHIVE;
+    }
+    if (codec->max_level && ratio < DIR_COMPRESSIBLE) {
+        snprintf(reason, size, "large files compress to %.0f%% with %s; the archive saves more than parallel sessions",
+                 ratio * 100, codec->name);
+        return TREE_ARCHIVE;
+    }
+    snprintf(reason, size, "%d small files bundled; %d large files (%.0f%% after compression) go directly over %d sessions",
+             profile->small_files, profile->large_files, ratio * 100, workers);
+    return TREE_HYBRID;
+}
+
+// Тип записи на сервере ('f', 'd', ...) по листингу родительского каталога;
+// 0, если записи нет или листинг не получен
+char ftp_remote_type(ftp_client_t *client, const char *path) {
+    char absolute[MAX_PATH], parent[MAX_PATH];
+    const ftp_listing_t *listing;
+    const char *name;
+    double age;
+
+    resolve_remote_path(client->current_dir, path, absolute, sizeof(absolute));
+    if (strcmp(absolute, "/") == 0) return 'd';
+    resolve_remote_path(absolute, "..", parent, sizeof(parent));
+    name = path_basename(absolute);
+    listing = ftp_cached_listing(client, parent, &age);
+    for (int i = 0; listing && i < listing->count; i++) {
+        if (strcmp(listing->entries[i].name, name) == 0) return listing->entries[i].type;
+    }
+    return 0;
+}
+
+// Отправка каталога выбранным или автоматически подобранным способом:
+// одним архивом (remote_name - файл архива), по файлам пулом сессий или
+// гибридно - большие файлы по отдельности, мелкие одним архивом
+// DIR_BUNDLE_NAME с расширением кодека (в этих двух случаях remote_name - каталог)
+int ftp_upload_tree(ftp_client_t *client, const char *local_dir, const char *remote_name,
+                    int strategy, int workers) {
+    char reason[256], remote[MAX_PATH], bundle[MAX_PATH + sizeof(DIR_BUNDLE_NAME) + 8];
+    tree_profile_t profile;
+    double started = now_seconds();
+    struct stat st;
+    int result;
+
+    if (stat(local_dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Not a directory: %s\n", local_dir);
+        return -1;
+    }
+
+    memset(&profile, 0, sizeof(profile));
+    profile_tree(local_dir, &profile);
+    printf("Scanned %d files in %.3f s: %d small (%lld bytes), %d large (%lld bytes)",
+           profile.files, now_seconds() - started, profile.small_files, profile.small_bytes,
+           profile.large_files, profile.large_bytes);
+    if (profile.samples) {
+        printf(", samples compress to %.0f%%", 100.0 * profile.sampled_packed / profile.sampled_bytes);
+    }
+    printf("\n");
+
+    if (strategy == TREE_AUTO) {
+        strategy = choose_tree_strategy(&profile, &archive_codecs[client->archive_codec], workers,
+                                        reason, sizeof(reason));
+    } else {
+        snprintf(reason, sizeof(reason), "requested");
+    }
+    printf("Directory strategy: %s (%s)\n", tree_strategy_names[strategy], reason);
+
+    if (strategy == TREE_ARCHIVE) {
+        return ftp_upload_archive(client, local_dir, remote_name, 0);
+    }
+
+    // Архив мелких файлов от прошлой гибридной передачи (любым кодеком)
+    // при получении был бы распакован поверх свежих файлов - удаляем его;
+    // гибридная передача затем отправит новый
+    resolve_remote_path(client->current_dir, remote_name, remote, sizeof(remote));
+    for (int i = 0; i < CODEC_COUNT; i++) {
+        snprintf(bundle, sizeof(bundle), "%s%s%s%s", remote, remote[strlen(remote) - 1] == '/' ? "" : "/",
+                 DIR_BUNDLE_NAME, archive_codecs[i].extension);
+        if (ftp_remote_type(client, bundle) == 'f' && ftp_delete(client, bundle) < 0) {
+            fprintf(stderr, "Cannot delete stale bundle %s\n", bundle);
+            return -1;
+        }
+    }
+
+    result = ftp_sync_tree(client, local_dir, remote_name, 1, workers, 0,
+                           strategy == TREE_HYBRID ? DIR_LARGE_FILE : 0, NULL);
+    if (result == 0 && strategy == TREE_HYBRID) {
+        snprintf(bundle, sizeof(bundle), "%s%s%s%s", remote, remote[strlen(remote) - 1] == '/' ? "" : "/",
+                 DIR_BUNDLE_NAME, archive_codecs[client->archive_codec].extension);
+        result = ftp_upload_archive(client, local_dir, bundle, DIR_LARGE_FILE);
+    }
+    return result;
+}
+
+// Получение каталога, отправленного ftp_upload_tree: файл архива
+// распаковывается, каталог зеркалируется пулом сессий, а архив мелких
+// файлов в его корне в mirror не входит - он распаковывается прямо из
+// соединения данных, локальные файлы с тем же именем не затрагиваются
+int ftp_download_tree(ftp_client_t *client, const char *remote_name, const char *local_dir, int workers) {
+    char remote[MAX_PATH], bundle[MAX_PATH + sizeof(DIR_BUNDLE_NAME) + 8];
+    int result;
+
+    if (ftp_remote_type(client, remote_name) != 'd') {
+        return ftp_download_directory(client, remote_name, local_dir);
+    }
+
+    result = ftp_sync_tree(client, local_dir, remote_name, 0, workers, 0, 0, DIR_BUNDLE_NAME);
+    resolve_remote_path(client->current_dir, remote_name, remote, sizeof(remote));
+    // Кодек архива определяется по сигнатуре, расширение лишь указывает имя
+    for (int i = 0; i < CODEC_COUNT && result == 0; i++) {
+        snprintf(bundle, sizeof(bundle), "%s%s%s%s", remote, remote[strlen(remote) - 1] == '/' ? "" : "/",
+                 DIR_BUNDLE_NAME, archive_codecs[i].extension);
+        if (ftp_remote_type(client, bundle) == 'f') {
+            result = ftp_download_directory(client, bundle, local_dir);
+        }
+    }
+    return result;
+}
+
+// Задание постоянной очереди передач
+typedef struct {
+    int id;
+    int priority;            // Больше - срочнее
+    char state;              // 'p' - ждёт, 'r' - выполняется, 'f' - ошибка, 'd' - выполнено
+    ftp_job_t job;
+} queue_entry_t;
+
+// Очередь передач, хранимая в файле: по строке на задание
+// "id<TAB>приоритет<TAB>состояние<TAB>put|get<TAB>локальный путь<TAB>путь на сервере".
+// Выполненные задания из файла удаляются, ошибочные повторяются при следующем запуске
+typedef struct {
+    queue_entry_t *entries;
+    int count;
+    int capacity;
+    int next_id;
+} transfer_queue_t;
+
+void queue_path(const ftp_client_t *client, char *path, size_t size) {
+    const char *home = getenv("HOME");
+
+    if (client->queue_file[0]) {
+        snprintf(path, size, "%s", client->queue_file);
+    } else {
+        snprintf(path, size, "%s/%s", home ? home : ".", QUEUE_FILE);
+    }
+}
+
+// Абсолютный локальный путь: относительный дополняется текущим каталогом
+void absolute_local_path(const char *path, char *out, size_t size) {
+    char cwd[MAX_PATH];
+
+    if (path[0] == '/' || !getcwd(cwd, sizeof(cwd))) {
+        snprintf(out, size, "%s", path);
+    } else {
+        snprintf(out, size, "%s/%s", cwd, path);
+    }
+}
+
+void queue_free(transfer_queue_t *queue) {
+    for (int i = 0; i < queue->count; i++) {
+        free(queue->entries[i].job.local_path);
+        free(queue->entries[i].job.remote_path);
+    }
+    free(queue->entries);
+    memset(queue, 0, sizeof(*queue));
+}
+
+queue_entry_t *queue_append(transfer_queue_t *queue, int id, int priority, char state, int upload,
+                            const char *local, const char *remote) {
+    queue_entry_t *entry;
+
+    if (queue->count == queue->capacity) {
+        int capacity = queue->capacity ? queue->capacity * 2 : 64;
+        queue_entry_t *grown = realloc(queue->entries, sizeof(queue_entry_t) * capacity);
+        if (!grown) return NULL;
+        queue->entries = grown;
+        queue->capacity = capacity;
+    }
+    entry = &queue->entries[queue->count];
+    memset(entry, 0, sizeof(*entry));
+    entry->job.local_path = strdup(local);
+    entry->job.remote_path = strdup(remote);
+    if (!entry->job.local_path || !entry->job.remote_path) {
+        free(entry->job.local_path);
+        free(entry->job.remote_path);
+        return NULL;
+    }
+    queue->count++;
+    entry->id = id;
+    entry->priority = priority;
+    entry->state = state;
+    entry->job.upload = upload;
+    if (id >= queue->next_id) {
+        queue->next_id = id + 1;
+    }
+    return entry;
+}
+
+// Чтение очереди; отсутствующий файл - пустая очередь
+int queue_load(const char *path, transfer_queue_t *queue) {
+    char line[MAX_PATH * 2 + 64];
+    FILE *file;
+
+    memset(queue, 0, sizeof(*queue));
+    queue->next_id = 1;
+    file = fopen(path, "r");
+    if (!file) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        char *fields[6], *cursor = line;
+        int n = 0;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        while (n < 6 && (fields[n] = strsep(&cursor, "\t")) != NULL) n++;
+        if (n < 6) {
+            fprintf(stderr, "%s: skipping malformed line\n", path);
+            continue;
+        }
+        // Прерванное выполнение оставляет задание ждущим. Очередь, в которую
+        // не поместилось задание, не загружается вовсе: её сохранение
+        // потеряло бы его из файла
+        if (!queue_append(queue, atoi(fields[0]), atoi(fields[1]), fields[2][0] == 'f' ? 'f' : 'p',
+                          strcmp(fields[3], "put") == 0, fields[4], fields[5])) {
+            fprintf(stderr, "%s: out of memory while loading the queue\n", path);
+            fclose(file);
+            queue_free(queue);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+// Запись очереди через временный файл, чтобы сбой не оставил её обрезанной
+int queue_save(const char *path, const transfer_queue_t *queue) {
+    char temporary[MAX_PATH + 8];
+    FILE *file;
+
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    file = fopen(temporary, "w");
+    if (!file) {
+        perror(temporary);
+        return -1;
+    }
+    fprintf(file, "# id\tpriority\tstate\tdirection\tlocal\tremote\n");
+    for (int i = 0; i < queue->count; i++) {
+        const queue_entry_t *entry = &queue->entries[i];
+
+        if (entry->state == 'd') continue;
+        fprintf(file, "%d\t%d\t%s\t%s\t%s\t%s\n", entry->id, entry->priority,
+                entry->state == 'f' ? "failed" : "pending", entry->job.upload ? "put" : "get",
+                entry->job.local_path, entry->job.remote_path);
+    }
+    if (fclose(file) != 0 || rename(temporary, path) < 0) {
+        perror(path);
+        unlink(temporary);
+        return -1;
+    }
+    return 0;
+}
+
+queue_entry_t *queue_find(transfer_queue_t *queue, int id) {
+    for (int i = 0; i < queue->count; i++) {
+        if (queue->entries[i].id == id) return &queue->entries[i];
+    }
+    return NULL;
+}
+
+// Порядок выполнения: по убыванию приоритета, при равном - по номеру
+int compare_queue_entries(const void *a, const void *b) {
+    const queue_entry_t *x = *(queue_entry_t * const *)a;
+    const queue_entry_t *y = *(queue_entry_t * const *)b;
+
+    if (x->priority != y->priority) return x->priority > y->priority ? -1 : 1;
+    return x->id - y->id;
+}
+
+void queue_print(const transfer_queue_t *queue) {
+    queue_entry_t **order = malloc(sizeof(queue_entry_t *) * (queue->count ? queue->count : 1));
+
+    if (!order) return;
+    for (int i = 0; i < queue->count; i++) order[i] = &queue->entries[i];
+    qsort(order, queue->count, sizeof(queue_entry_t *), compare_queue_entries);
+    printf("%5s %8s %-8s %-4s %s\n", "id", "priority", "state", "op", "transfer");
+    for (int i = 0; i < queue->count; i++) {
+        const queue_entry_t *entry = order[i];
+
+        printf("%5d %8d %-8s %-4s %s -> %s\n", entry->id, entry->priority,
+               entry->state == 'f' ? "failed" : "pending", entry->job.upload ? "put" : "get",
+               entry->job.upload ? entry->job.local_path : entry->job.remote_path,
+               entry->job.upload ? entry->job.remote_path : entry->job.local_path);
+    }
+    printf("%d queued transfers\n", queue->count);
+    free(order);
+}
+
+// Очередь заданий одной сессии планировщика, по убыванию приоритета.
+// Сессия берёт задания с начала своей очереди; простаивающая сессия
+// забирает задание у другой - тоже с начала, чтобы срочное задание не
+// ждало за долгой передачей занятой сессии
+typedef struct {
+    queue_entry_t **items;
+    int head;
+    int tail;
+    pthread_mutex_t lock;
+} queue_deque_t;
+
+typedef struct {
+    const ftp_client_t *origin;
+    transfer_queue_t *queue;
+    const char *path;
+    queue_deque_t deques[MAX_WORKERS];
+    int workers;
+    pthread_mutex_t lock;    // Состояние заданий, файл очереди и вывод
+    int done;
+    int failed;
+    int stolen;
+    int sessions;            // Сессий, которым удалось подключиться
+    long long bytes;
+} queue_scheduler_t;
+
+typedef struct {
+    queue_scheduler_t *scheduler;
+    int index;
+} queue_worker_t;
+
+queue_entry_t *deque_pop(queue_deque_t *deque) {
+    queue_entry_t *entry = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        entry = deque->items[deque->head++];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return entry;
+}
+
+// Остались ли невзятые задания хотя бы в одной очереди
+int scheduler_has_work(queue_scheduler_t *scheduler) {
+    int pending = 0;
+
+    for (int i = 0; i < scheduler->workers && !pending; i++) {
+        pthread_mutex_lock(&scheduler->deques[i].lock);
+        pending = scheduler->deques[i].head < scheduler->deques[i].tail;
+        pthread_mutex_unlock(&scheduler->deques[i].lock);
+    }
+    return pending;
+}
+
+// Следующее задание сессии: своё или украденное у сессии, у которой
+// первым ждёт самое срочное задание. NULL - заданий не осталось
+queue_entry_t *scheduler_next(queue_scheduler_t *scheduler, int self) {
+    queue_entry_t *entry = deque_pop(&scheduler->deques[self]);
+
+    while (!entry) {
+        int victim = -1, best = 0;
+
+        for (int i = 0; i < scheduler->workers; i++) {
+            queue_deque_t *deque = &scheduler->deques[i];
+
+            if (i == self) continue;
+            pthread_mutex_lock(&deque->lock);
+            if (deque->head < deque->tail && (victim < 0 || deque->items[deque->head]->priority > best)) {
+                victim = i;
+                best = deque->items[deque->head]->priority;
+            }
+            pthread_mutex_unlock(&deque->lock);
+        }
+        if (victim < 0) return NULL;
+        // Между просмотром и кражей задание могли забрать - тогда ищем снова
+        entry = deque_pop(&scheduler->deques[victim]);
+        if (entry) {
+            __atomic_fetch_add(&scheduler->stolen, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return entry;
+}
+
+void *queue_worker(void *arg) {
+    queue_worker_t *worker = arg;
+    queue_scheduler_t *scheduler = worker->scheduler;
+    queue_entry_t *entry;
+    ftp_client_t session;
+    int connected = 0;
+
+    while (1) {
+        int status;
+
+        // Сессия открывается до взятия задания и заново после обрыва. Сессия,
+        // которую сервер не принял, завершается, не трогая заданий: её
+        // очередь разберут остальные
+        if (!connected) {
+            if (!scheduler_has_work(scheduler)) break;
+            if (ftp_open_session(&session, scheduler->origin) < 0) {
+                fprintf(stderr, "Queue session %d: failed to connect, leaving its jobs to other sessions\n",
+                        worker->index + 1);
+                break;
+            }
+            connected = 1;
+            __atomic_fetch_add(&scheduler->sessions, 1, __ATOMIC_RELAXED);
+        }
+        entry = scheduler_next(scheduler, worker->index);
+        if (!entry) break;
+        status = run_job(&session, &entry->job);
+
+        pthread_mutex_lock(&scheduler->lock);
+        entry->state = status == 0 ? 'd' : 'f';
+        if (status == 0) {
+            scheduler->bytes += session.last_transfer_bytes;
+        } else {
+            scheduler->failed++;
+        }
+        scheduler->done++;
+        printf("[%d] %s %s (priority %d, session %d): %s\n", entry->id, entry->job.upload ? "put" : "get",
+               entry->job.upload ? entry->job.local_path : entry->job.remote_path, entry->priority,
+               worker->index + 1, status == 0 ? "done" : "failed");
+        // Файл очереди обновляется после каждого задания: прерванный запуск
+        // продолжится с невыполненных
+        queue_save(scheduler->path, scheduler->queue);
+        pthread_mutex_unlock(&scheduler->lock);
+
+        if (status < 0 && session.disconnected) {
+            close(session.control_socket);
+            connected = 0;
+        }
+    }
+
+    if (connected) {
+        ftp_disconnect(&session);
+    }
+    return NULL;
+}
+
+// Выполнение очереди workers сессиями. Задания в порядке приоритета
+// раскладываются по очередям сессий по кругу, так что каждая сессия
+// начинает с самых срочных; закончив свои, сессия крадёт чужие
+int ftp_run_queue(ftp_client_t *client, transfer_queue_t *queue, const char *path, int workers) {
+    queue_worker_t arguments[MAX_WORKERS];
+    pthread_t threads[MAX_WORKERS];
+    queue_scheduler_t scheduler;
+    queue_entry_t **order;
+    double started, elapsed;
+    int created = 0, left = 0;
+
+    if (queue->count == 0) {
+        printf("Queue is empty\n");
+        return 0;
+    }
+    if (workers > queue->count) {
+        workers = queue->count;
+    }
+    order = malloc(sizeof(queue_entry_t *) * queue->count);
+    if (!order) return -1;
+    for (int i = 0; i < queue->count; i++) {
+        queue->entries[i].state = 'r';
+        order[i] = &queue->entries[i];
+    }
+    qsort(order, queue->count, sizeof(queue_entry_t *), compare_queue_entries);
+
+    memset(&scheduler, 0, sizeof(scheduler));
+    scheduler.origin = client;
+    scheduler.queue = queue;
+    scheduler.path = path;
+    scheduler.workers = workers;
+    for (int i = 0; i < workers; i++) {
+        queue_deque_t *deque = &scheduler.deques[i];
+
+        deque->items = malloc(sizeof(queue_entry_t *) * (queue->count / workers + 1));
+        if (!deque->items) {
+            fprintf(stderr, "Not enough memory to schedule %d transfers\n", queue->count);
+            for (int j = 0; j < i; j++) free(scheduler.deques[j].items);
+            for (int j = 0; j < queue->count; j++) queue->entries[j].state = 'p';
+            free(order);
+            return -1;
+        }
+        pthread_mutex_init(&deque->lock, NULL);
+        for (int j = i; j < queue->count; j += workers) {
+            deque->items[deque->tail++] = order[j];
+        }
+    }
+    pthread_mutex_init(&scheduler.lock, NULL);
+
+    printf("Running %d queued transfers with %d sessions\n", queue->count, workers);
+    started = now_seconds();
+    for (int i = 0; i < workers; i++) {
+        arguments[i].scheduler = &scheduler;
+        arguments[i].index = i;
+        if (pthread_create(&threads[created], NULL, queue_worker, &arguments[i]) == 0) {
+            created++;
+        }
+    }
+    for (int i = 0; i < created; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    // Невзятые задания остаются ждать следующего запуска; ошибкой они
+    // считаются, только если сервер не принял ни одной сессии
+    for (int i = 0; i < queue->count; i++) {
+        if (queue->entries[i].state != 'r') continue;
+        queue->entries[i].state = scheduler.sessions == 0 ? 'f' : 'p';
+        if (scheduler.sessions == 0) {
+            scheduler.done++;
+            scheduler.failed++;
+        }
+        left++;
+    }
+    if (left > 0) {
+        printf("%d transfers %s\n", left, scheduler.sessions == 0 ? "failed: no session could connect"
+                                                                    : "left pending after sessions were lost");
+    }
+    queue_save(path, queue);
+    for (int i = 0; i < queue->count; i++) {
+        if (queue->entries[i].job.upload) ftp_cache_invalidate(client, queue->entries[i].job.remote_path);
+    }
+
+    elapsed = now_seconds() - started;
+    printf("%d/%d transfers done, %d failed, %d stolen by idle sessions\n",
+           scheduler.done - scheduler.failed, queue->count, scheduler.failed, scheduler.stolen);
+    printf("Aggregate: %lld bytes in %.3f s (%.2f MB/s)\n", scheduler.bytes, elapsed,
+           elapsed > 0 ? scheduler.bytes / elapsed / (1024 * 1024) : 0.0);
+
+    for (int i = 0; i < workers; i++) {
+        free(scheduler.deques[i].items);
+        pthread_mutex_destroy(&scheduler.deques[i].lock);
+    }
+    pthread_mutex_destroy(&scheduler.lock);
+    free(order);
+    return scheduler.failed || left ? -1 : 0;
+}
+
+// Матрица бенчмарка: размеры файлов, буферы приёма, количества файлов и сессий
+static const long long bench_sizes[] = {
+    1LL << 10, 64LL << 10, 1LL << 20, 16LL << 20, 256LL << 20, 1LL << 30, 4LL << 30
+};
+static const size_t bench_buffers[] = {64 << 10, 1 << 20, 8 << 20};
+static const int bench_file_counts[] = {100, 1000};
+static const int bench_workers[] = {1, 8};
+
+// Одна строка результатов в формате JSON Lines. setup - задержки подготовки
+// передач (для list - полного NLST), секунды; могут отсутствовать
+void bench_write_result(FILE *out, const char *test, long long file_size, long long buffer_size,
+                        int files, int workers, int ops, long long bytes, double seconds,
+                        double cpu, double *setup, int samples) {
+    fprintf(out, "{\"test\": \"%s\", \"file_size\": %lld, \"buffer_size\": %lld, \"files\": %d, "
+            "\"workers\": %d, \"ops\": %d, \"bytes\": %lld, \"seconds\": %.6f, \"mb_per_s\": %.3f, "
+            "\"ops_per_s\": %.3f, \"cpu_seconds\": %.6f",
+            test, file_size, buffer_size, files, workers, ops, bytes, seconds,
+            seconds > 0 ? bytes / seconds / (1024 * 1024) : 0, seconds > 0 ? ops / seconds : 0, cpu);
+    if (samples > 0) {
+        qsort(setup, samples, sizeof(double), compare_doubles);
+        fprintf(out, ", \"setup_p50_ms\": %.3f, \"setup_p99_ms\": %.3f",
+                percentile(setup, samples, 50) * 1000, percentile(setup, samples, 99) * 1000);
+    }
+    fprintf(out, "}\n");
+    fflush(out);
+
+    printf("%-12s size %-11lld buf %-8lld files %-5d workers %-2d %10.2f MB/s %10.1f ops/s cpu %.3f s\n",
+           test, file_size, buffer_size, files, workers,
+           seconds > 0 ? bytes / seconds / (1024 * 1024) : 0, seconds > 0 ? ops / seconds : 0, cpu);
+}
+
+// Создание файла заданного размера с псевдослучайным (несжимаемым) содержимым
+int bench_make_file(const char *path, long long size) {
+    unsigned long long state = 0x9E3779B97F4A7C15ULL ^ (unsigned long long)size;
+    size_t chunk = 1 << 20;
+    unsigned long long *buffer = malloc(chunk);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int result = 0;
+
+    if (!buffer || fd < 0) {
+        free(buffer);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    for (size_t i = 0; i < chunk / sizeof(*buffer); i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        buffer[i] = state;
+    }
+    for (long long written = 0; written < size && result == 0; ) {
+        size_t n = size - written < (long long)chunk ? (size_t)(size - written) : chunk;
+        // Сдвиг слова в каждом мегабайте, чтобы блоки не повторялись
+        buffer[0] = (unsigned long long)written;
+        result = write_all(fd, (const char *)buffer, n);
+        written += n;
+    }
+    free(buffer);
+    close(fd);
+    return result;
+}
+
+int bench_remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag; (void)ftw;
+    remove(path);
+    return 0;
+}
+
+// Рекурсивное удаление рабочих файлов бенчмарка
+void bench_remove_tree(const char *path) {
+    nftw(path, bench_remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// Прогон операций загрузки или скачивания одного файла ops раз
+int bench_transfers(ftp_client_t *client, FILE *out, int upload, const char *local, const char *remote,
+                    long long size, long long buffer_size, int ops) {
+    const char *test = !upload ? "download" : client->msg_zerocopy ? "upload_msg_zerocopy" : "upload";
+    double *setup = malloc(sizeof(double) * ops);
+    double started, cpu_started;
+    long long bytes = 0;
+    int result = 0, done = 0;
+
+    if (!setup) return -1;
+    started = now_seconds();
+    cpu_started = cpu_seconds();
+    for (; done < ops; done++) {
+        result = upload ? ftp_upload_file(client, local, remote) : ftp_download_file(client, remote, local);
+        if (result < 0) break;
+        setup[done] = client->last_setup_seconds;
+        bytes += client->last_transfer_bytes;
+    }
+    if (result == 0) {
+        bench_write_result(out, test, size, buffer_size, 1, 1, ops, bytes,
+                           now_seconds() - started, cpu_seconds() - cpu_started, setup, done);
+    } else {
+        fprintf(stderr, "Benchmark %s of %lld bytes failed\n", test, size);
+    }
+    free(setup);
+    return result;
+}
+
+// Замер операции над множеством файлов (mput, mget, upload_dir, download_dir)
+typedef int (*bench_batch_fn)(ftp_client_t *client, const char *first, const char *second, int workers);
+
+int bench_mput(ftp_client_t *client, const char *pattern, const char *target, int workers) {
+    return ftp_mput(client, pattern, target, workers);
+}
+
+int bench_mget(ftp_client_t *client, const char *pattern, const char *target, int workers) {
+    return ftp_mget(client, pattern, target, workers);
+}
+
+int bench_upload_dir(ftp_client_t *client, const char *directory, const char *remote, int workers) {
+    (void)workers;
+    return ftp_upload_directory(client, directory, remote);
+}
+
+int bench_download_dir(ftp_client_t *client, const char *remote, const char *directory, int workers) {
+    (void)workers;
+    return ftp_download_directory(client, remote, directory);
+}
+
+int bench_batch(ftp_client_t *client, FILE *out, const char *test, bench_batch_fn run,
+                const char *first, const char *second, int files, int workers, long long bytes) {
+    double started = now_seconds(), cpu_started = cpu_seconds(), elapsed;
+
+    if (run(client, first, second, workers) < 0) {
+        fprintf(stderr, "Benchmark %s of %d files failed\n", test, files);
+        return -1;
+    }
+    elapsed = now_seconds() - started;
+    // Время ровно в период перерисовки прогресса может означать, что замерено
+    // ожидание пула, а не передачи. Честный замер тоже может так совпасть,
+    // поэтому это лишь предупреждение, прогон продолжается
+    if (files > 1 && elapsed > 1.0 / PROGRESS_RATE - BENCH_QUANTUM_TOLERANCE &&
+        elapsed < 1.0 / PROGRESS_RATE + BENCH_QUANTUM_TOLERANCE) {
+        fprintf(stderr, "Warning: %s of %d files took exactly one progress period (%.4f s); "
+                "check that the completion wait is not polled\n", test, files, elapsed);
+    }
+    bench_write_result(out, test, BENCH_SMALL_FILE, client->buffer_size, files, workers, files, bytes,
+                       elapsed, cpu_seconds() - cpu_started, NULL, 0);
+    return 0;
+}
+
+// Полный прогон матрицы против подключённого сервера. Рабочие файлы
+// создаются в work_dir, результаты пишутся построчно в JSON results_path.
+// Размеры, не помещающиеся на диск (нужно втрое больше файла), пропускаются
+int ftp_bench_suite(ftp_client_t *client, const char *work_dir, const char *results_path, long long max_size) {
+    int saved_verbose = client->verbose;
+    size_t saved_buffer = client->buffer_size;
+    char local[MAX_PATH * 2], copy[MAX_PATH * 2], remote[MAX_PATH];
+    struct utsname system;
+    int result = 0;
+    FILE *out;
+
+    mkdir(work_dir, 0755);
+    out = fopen(results_path, "w");
+    if (!out) {
+        perror(results_path);
+        return -1;
+    }
+    uname(&system);
+    fprintf(out, "{\"test\": \"meta\", \"timestamp\": %lld, \"kernel\": \"%s\", \"server\": \"%s:%d\", "
+            "\"max_size\": %lld, \"zero_copy\": %d, \"io_uring\": %d, \"pipelining\": %d}\n",
+            (long long)time(NULL), system.release, client->server, client->port, max_size,
+            client->zero_copy, client->io_uring, client->pipelining);
+    client->verbose = 0;
+
+    // Одиночные файлы: размер x буфер приёма, загрузка и скачивание
+    for (size_t i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]) && result == 0; i++) {
+        long long size = bench_sizes[i];
+        long long ops = BENCH_CASE_BYTES / size;
+        struct statvfs fs;
+
+        if (size > max_size) break;
+        if (statvfs(work_dir, &fs) == 0 && (long long)(fs.f_bavail * fs.f_frsize) < 3 * size + (64LL << 20)) {
+            printf("Skipping %lld byte files: not enough free disk space in %s\n", size, work_dir);
+            continue;
+        }
+        ops = ops < 1 ? 1 : ops > BENCH_MAX_OPS ? BENCH_MAX_OPS : ops;
+
+        snprintf(local, sizeof(local), "%s/bench_%lld.bin", work_dir, size);
+        snprintf(copy, sizeof(copy), "%s/bench_%lld.copy", work_dir, size);
+        snprintf(remote, sizeof(remote), "bench_%lld.bin", size);
+        if (bench_make_file(local, size) < 0) {
+            perror(local);
+            result = -1;
+            break;
+        }
+        for (size_t b = 0; b < sizeof(bench_buffers) / sizeof(bench_buffers[0]) && result == 0; b++) {
+            client->buffer_size = bench_buffers[b];
+            result = bench_transfers(client, out, 1, local, remote, size, bench_buffers[b], (int)ops);
+            if (result == 0) {
+                result = bench_transfers(client, out, 0, copy, remote, size, bench_buffers[b], (int)ops);
+            }
+        }
+        // Буфер приёма на отправку не влияет: MSG_ZEROCOPY замеряется один раз
+        if (result == 0 && size >= MSGZC_MIN_SIZE) {
+            int saved_msg_zerocopy = client->msg_zerocopy;
+
+            client->msg_zerocopy = 1;
+            result = bench_transfers(client, out, 1, local, remote, size, client->buffer_size, (int)ops);
+            client->msg_zerocopy = saved_msg_zerocopy;
+        }
+        unlink(local);
+        unlink(copy);
+    }
+    client->buffer_size = saved_buffer;
+
+    // Множество мелких файлов: mput/mget пулом сессий, листинг, архив каталога
+    for (size_t i = 0; i < sizeof(bench_file_counts) / sizeof(bench_file_counts[0]) && result == 0; i++) {
+        int files = bench_file_counts[i];
+        long long bytes = (long long)files * BENCH_SMALL_FILE;
+        char tree[MAX_PATH], pattern[MAX_PATH * 2], mask[64], fetched[MAX_PATH], archive[64];
+
+        snprintf(tree, sizeof(tree), "%s/files_%d", work_dir, files);
+        snprintf(fetched, sizeof(fetched), "%s/fetched_%d", work_dir, files);
+        mkdir(tree, 0755);
+        for (int f = 0; f < files && result == 0; f++) {
+            snprintf(local, sizeof(local), "%s/n%d_%d.dat", tree, files, f);
+            result = bench_make_file(local, BENCH_SMALL_FILE);
+        }
+        snprintf(pattern, sizeof(pattern), "%s/*.dat", tree);
+        snprintf(mask, sizeof(mask), "n%d_*.dat", files);
+        snprintf(archive, sizeof(archive), "tree_%d.tar", files);
+
+        for (size_t w = 0; w < sizeof(bench_workers) / sizeof(bench_workers[0]) && result == 0; w++) {
+            result = bench_batch(client, out, "mput", bench_mput, pattern, "", files, bench_workers[w], bytes);
+            if (result == 0) {
+                result = bench_batch(client, out, "mget", bench_mget, mask, fetched, files, bench_workers[w], bytes);
+            }
+            bench_remove_tree(fetched);
+        }
+
+        if (result == 0) {
+            double samples[BENCH_LIST_OPS], started = now_seconds(), cpu_started = cpu_seconds();
+
+            for (int op = 0; op < BENCH_LIST_OPS && result == 0; op++) {
+                char **names;
+                int count;
+                double op_started = now_seconds();
+
+                result = ftp_name_list(client, "", &names, &count);
+                samples[op] = now_seconds() - op_started;
+                if (result == 0) free_name_list(names, count);
+            }
+            if (result == 0) {
+                bench_write_result(out, "list", 0, client->buffer_size, files, 1, BENCH_LIST_OPS, 0,
+                                   now_seconds() - started, cpu_seconds() - cpu_started, samples, BENCH_LIST_OPS);
+            }
+        }
+        if (result == 0) {
+            result = bench_batch(client, out, "upload_dir", bench_upload_dir, tree, archive, files, 1, bytes);
+        }
+        if (result == 0) {
+            result = bench_batch(client, out, "download_dir", bench_download_dir, archive, fetched, files, 1, bytes);
+        }
+        bench_remove_tree(fetched);
+        bench_remove_tree(tree);
+    }
+
+    client->verbose = saved_verbose;
+    fclose(out);
+    printf("Benchmark %s, results in %s\n", result == 0 ? "finished" : "failed", results_path);
+    return result;
+}
+
+// Кодеки и уровни в сравнении bench_codecs; первым идёт несжатый tar,
+// его размер - база для степени сжатия
+static const struct {
+    int codec;
+    int level;
+} bench_codec_cases[] = {
+    {CODEC_NONE, 0}, {CODEC_GZIP, 1}, {CODEC_GZIP, 6}, {CODEC_GZIP, 9},
+    {CODEC_ZSTD, 1}, {CODEC_ZSTD, 3}, {CODEC_ZSTD, 9}, {CODEC_LZ4, 1}, {CODEC_LZ4, 9}
+};
+
+// Сравнение кодеков архива на локальном каталоге: для каждого кодека
+// архив пишется во временный файл и распаковывается обратно. Печатаются
+// размер относительно несжатого tar, скорость упаковки и распаковки и
+// процессорное время (включая внешние программы). Результаты можно
+// дописать в JSON Lines results_path (NULL - только таблица)
+int ftp_bench_codecs(ftp_client_t *client, const char *directory, const char *results_path) {
+    const char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char archive[MAX_PATH], extracted[MAX_PATH];
+    long long raw_bytes = 0;
+    FILE *out = NULL;
+    int fd, result = 0;
+
+    if (results_path) {
+        out = fopen(results_path, "a");
+        if (!out) {
+            perror(results_path);
+            return -1;
+        }
+    }
+    snprintf(archive, sizeof(archive), "%s/ftpcodec.XXXXXX", tmp);
+    fd = mkstemp(archive);
+    if (fd < 0) {
+        perror(archive);
+        if (out) fclose(out);
+        return -1;
+    }
+    unlink(archive);
+
+    printf("%-6s %5s %14s %8s %12s %14s %8s\n", "codec", "level", "archive bytes", "ratio",
+           "pack MB/s", "unpack MB/s", "CPU s");
+    for (size_t i = 0; i < sizeof(bench_codec_cases) / sizeof(bench_codec_cases[0]) && result == 0; i++) {
+        archive_options_t options = {&archive_codecs[bench_codec_cases[i].codec], bench_codec_cases[i].level,
+                                     client->archive_workers, 0};
+        double started, packed, unpacked, cpu_started;
+        struct stat st;
+
+        if (!archive_codec_available(options.codec)) {
+            printf("%-6s %5d not installed\n", options.codec->name, options.level);
+            continue;
+        }
+        if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+            result = -1;
+            break;
+        }
+        cpu_started = cpu_seconds() + rusage_seconds(RUSAGE_CHILDREN);
+        started = now_seconds();
+        if (create_tar_archive(directory, fd, &options) < 0 || fstat(fd, &st) < 0) {
+            result = -1;
+            break;
+        }
+        packed = now_seconds() - started;
+        if (raw_bytes == 0) {
+            raw_bytes = st.st_size;
+        }
+
+        snprintf(extracted, sizeof(extracted), "%s/ftpcodec_out.XXXXXX", tmp);
+        if (!mkdtemp(extracted) || lseek(fd, 0, SEEK_SET) < 0) {
+            perror(extracted);
+            result = -1;
+            break;
+        }
+        started = now_seconds();
+        result = extract_tar_archive(fd, extracted);
+        unpacked = now_seconds() - started;
+        bench_remove_tree(extracted);
+        if (result < 0) break;
+
+        double cpu = cpu_seconds() + rusage_seconds(RUSAGE_CHILDREN) - cpu_started;
+        double ratio = raw_bytes > 0 ? (double)st.st_size / raw_bytes : 1.0;
+        double pack_rate = packed > 0 ? raw_bytes / packed / (1024 * 1024) : 0;
+        double unpack_rate = unpacked > 0 ? raw_bytes / unpacked / (1024 * 1024) : 0;
+
+        printf("%-6s %5d %14lld %7.1f%% %12.1f %14.1f %8.2f\n", options.codec->name,
+               options.level ? options.level : options.codec->default_level, (long long)st.st_size,
+               ratio * 100, pack_rate, unpack_rate, cpu);
+        if (out) {
+            fprintf(out, "{\"test\": \"codec\", \"codec\": \"%s\", \"level\": %d, \"workers\": %d, "
+                    "\"raw_bytes\": %lld, \"archive_bytes\": %lld, \"ratio\": %.4f, \"pack_seconds\": %.6f, "
+                    "\"unpack_seconds\": %.6f, \"pack_mb_per_s\": %.3f, \"unpack_mb_per_s\": %.3f, "
+                    "\"cpu_seconds\": %.6f}\n",
+                    options.codec->name, options.level ? options.level : options.codec->default_level,
+                    options.workers, raw_bytes, (long long)st.st_size, ratio, packed, unpacked,
+                    pack_rate, unpack_rate, cpu);
+            fflush(out);
+        }
+    }
+
+    close(fd);
+    if (out) fclose(out);
+    if (result < 0) {
+        fprintf(stderr, "Codec benchmark failed\n");
+    }
+    return result;
+}
+
+// Операции асинхронной сессии
+enum {
+    ASYNC_OP_PROBE,  // Вход и выход: проверка доступности сервера
+    ASYNC_OP_RETR,   // Скачивание remote_path в local_path
+    ASYNC_OP_STOR    // Загрузка local_path в remote_path
+};
+
+// Состояния управляющего соединения асинхронной сессии
+enum {
+    ASYNC_CONNECTING,
+    ASYNC_GREETING,
+    ASYNC_USER,
+    ASYNC_PASS,
+    ASYNC_TYPE,
+    ASYNC_PASV,
+    ASYNC_TRANSFER_START,  // Ждём 150/125 на STOR/RETR
+    ASYNC_TRANSFERRING,    // Идёт передача, ждём конца данных и 226
+    ASYNC_QUIT,
+    ASYNC_DONE
+};
+
+typedef struct ftp_async_session ftp_async_session_t;
+typedef struct ftp_loop ftp_loop_t;
+
+// Вызывается один раз по завершении сессии; status 0 - успех
+typedef void (*ftp_async_callback)(ftp_async_session_t *session, int status, void *user_data);
+
+// Дескриптор, зарегистрированный в epoll: указывает на сессию и тип сокета
+typedef struct {
+    ftp_async_session_t *session;
+    int is_data;
+} ftp_async_handle_t;
+
+struct ftp_async_session {
+    ftp_client_t client;           // Управляющее соединение и буфер ответов
+    ftp_loop_t *loop;
+    int op;
+    int state;
+    char remote_path[MAX_PATH];
+    char local_path[MAX_PATH];
+    int file_fd;
+    off_t file_offset;             // Позиция sendfile при STOR
+    int data_connecting;
+    int data_open;                 // Сокет данных открыт и зарегистрирован
+    int data_done;                 // Данные переданы полностью
+    int reply_done;                // Получен финальный ответ на передачу
+    long long bytes;
+    double started;
+    double deadline;               // Время, после которого сессия считается зависшей
+    char error[256];
+    ftp_async_handle_t control_handle;
+    ftp_async_handle_t data_handle;
+    ftp_async_callback callback;
+    void *user_data;
+};
+
+// Цикл событий: один epoll на множество сессий
+struct ftp_loop {
+    int epoll_fd;
+    int active;                    // Незавершённых сессий
+    double timeout;                // Допустимый простой сессии, секунды
+    ftp_async_session_t **sessions;
+    int count;
+    int capacity;
+};
+
+int ftp_loop_init(ftp_loop_t *loop, double timeout) {
+    memset(loop, 0, sizeof(*loop));
+    loop->timeout = timeout;
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Освобождение цикла и всех завершённых сессий
+void ftp_loop_close(ftp_loop_t *loop) {
+    for (int i = 0; i < loop->count; i++) {
+        free(loop->sessions[i]);
+    }
+    free(loop->sessions);
+    close(loop->epoll_fd);
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Завершение сессии: закрытие сокетов и вызов обработчика
+void async_complete(ftp_async_session_t *session, int status, const char *error) {
+    if (session->state == ASYNC_DONE) {
+        return;
+    }
+    if (error) {
+        snprintf(session->error, sizeof(session->error), "%s", error);
+    }
+    if (session->data_open || session->data_connecting) {
+        close(session->client.data_socket);
+        session->data_open = 0;
+        session->data_connecting = 0;
+    }
+    if (session->client.control_socket >= 0) {
+        close(session->client.control_socket);
+        session->client.control_socket = -1;
+    }
+    if (session->file_fd >= 0) {
+        close(session->file_fd);
+        session->file_fd = -1;
+    }
+    session->state = ASYNC_DONE;
+    session->loop->active--;
+    if (session->callback) {
+        session->callback(session, status, session->user_data);
+    }
+}
+
+// Отправка команды по неблокирующему управляющему соединению.
+// Команды короткие и всегда помещаются в пустой буфер сокета
+int async_send(ftp_async_session_t *session, const char *command, int next_state) {
+    char line[MAX_PATH + 16];
+    int length = snprintf(line, sizeof(line), "%s\r\n", command);
+
+    if (send(session->client.control_socket, line, length, MSG_NOSIGNAL | MSG_DONTWAIT) != length) {
+        async_complete(session, -1, "control connection send failed");
+        return -1;
+    }
+    session->state = next_state;
+    return 0;
+}
+
+// Открытие неблокирующего соединения данных по ответу 227
+int async_open_data(ftp_async_session_t *session, const char *reply) {
+    struct sockaddr_in data_addr;
+    struct epoll_event event;
+    const char *start = strchr(reply, '(');
+    int ip[4], port[2], fd;
+
+    if (!start || sscanf(start + 1, "%d,%d,%d,%d,%d,%d",
+                         &ip[0], &ip[1], &ip[2], &ip[3], &port[0], &port[1]) != 6) {
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&data_addr, 0, sizeof(data_addr));
+    data_addr.sin_family = AF_INET;
+    data_addr.sin_port = htons(port[0] * 256 + port[1]);
+    data_addr.sin_addr.s_addr = htonl((ip[0] << 24) | (ip[1] << 16) | (ip[2] << 8) | ip[3]);
+    if (connect(fd, (struct sockaddr *)&data_addr, sizeof(data_addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+
+    session->client.data_socket = fd;
+    session->data_connecting = 1;
+    event.events = EPOLLOUT;
+    event.data.ptr = &session->data_handle;
+    if (epoll_ctl(session->loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        close(fd);
+        session->data_connecting = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Передача завершена, когда данные дочитаны/дописаны и пришёл 226
+void async_check_transfer_done(ftp_async_session_t *session) {
+    if (session->state == ASYNC_TRANSFERRING && session->data_done && session->reply_done) {
+        async_send(session, "QUIT", ASYNC_QUIT);
+    }
+}
+
+// Закрытие соединения данных
+void async_close_data(ftp_async_session_t *session) {
+    if (session->data_open || session->data_connecting) {
+        epoll_ctl(session->loop->epoll_fd, EPOLL_CTL_DEL, session->client.data_socket, NULL);
+        close(session->client.data_socket);
+    }
+    session->data_open = 0;
+    session->data_connecting = 0;
+    session->data_done = 1;
+    async_check_transfer_done(session);
+}
+
+// Обработка очередного ответа сервера согласно состоянию сессии
+void async_handle_reply(ftp_async_session_t *session, int code, const char *reply) {
+    char command[MAX_PATH + 16];
+
+    switch (session->state) {
+    case ASYNC_GREETING:
+        if (code == 120) break;
+        if (code != 220) {
+            async_complete(session, -1, reply);
+            break;
+        }
+        snprintf(command, sizeof(command), "USER %s", session->client.username);
+        async_send(session, command, ASYNC_USER);
+        break;
+    case ASYNC_USER:
+    case ASYNC_PASS:
+        if (session->state == ASYNC_USER && (code == 331 || code == 332)) {
+            snprintf(command, sizeof(command), "PASS %s", session->client.password);
+            async_send(session, command, ASYNC_PASS);
+        } else if (code == 230 || code == 202) {
+            if (session->op == ASYNC_OP_PROBE) {
+                async_send(session, "QUIT", ASYNC_QUIT);
+            } else {
+                async_send(session, "TYPE I", ASYNC_TYPE);
+            }
+        } else {
+            async_complete(session, -1, reply);
+        }
+        break;
+    case ASYNC_TYPE:
+        if (code != 200) {
+            async_complete(session, -1, reply);
+            break;
+        }
+        async_send(session, "PASV", ASYNC_PASV);
+        break;
+    case ASYNC_PASV:
+        if (code != 227 || async_open_data(session, reply) < 0) {
+            async_complete(session, -1, code == 227 ? "data connection failed" : reply);
+            break;
+        }
+        // Команда передачи уходит, не дожидаясь установки соединения данных
+        snprintf(command, sizeof(command), "%s %s",
+                 session->op == ASYNC_OP_STOR ? "STOR" : "RETR", session->remote_path);
+        async_send(session, command, ASYNC_TRANSFER_START);
+        break;
+    case ASYNC_TRANSFER_START:
+        if (code != 150 && code != 125) {
+            async_complete(session, -1, reply);
+            break;
+        }
+        session->state = ASYNC_TRANSFERRING;
+        async_check_transfer_done(session);
+        break;
+    case ASYNC_TRANSFERRING:
+        if (code / 100 != 2) {
+            async_complete(session, -1, reply);
+            break;
+        }
+        session->reply_done = 1;
+        async_check_transfer_done(session);
+        break;
+    case ASYNC_QUIT:
+        async_complete(session, 0, NULL);
+        break;
+    default:
+        break;
+    }
+}
+
+// События управляющего соединения
+void async_control_event(ftp_async_session_t *session, unsigned int events) {
+    char reply[BUFFER_SIZE];
+    int code = 0;
+
+    if (session->state == ASYNC_CONNECTING) {
+        struct epoll_event event;
+        int error = 0;
+        socklen_t length = sizeof(error);
+
+        getsockopt(session->client.control_socket, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error) {
+            async_complete(session, -1, strerror(error));
+            return;
+        }
+        event.events = EPOLLIN;
+        event.data.ptr = &session->control_handle;
+        epoll_ctl(session->loop->epoll_fd, EPOLL_CTL_MOD, session->client.control_socket, &event);
+        session->state = ASYNC_GREETING;
+        return;
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        // Забираем всё, что есть в сокете, затем разбираем полные ответы
+        while (fill_control_buffer(&session->client) == 0);
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            // Разбираем остаток перед тем, как считать соединение закрытым
+            while (session->state != ASYNC_DONE &&
+                   (code = parse_buffered_reply(&session->client, reply, sizeof(reply))) > 0) {
+                async_handle_reply(session, code, reply);
+            }
+            if (session->state == ASYNC_QUIT) {
+                async_complete(session, 0, NULL);
+            } else {
+                async_complete(session, -1, "control connection closed");
+            }
+            return;
+        }
+        while (session->state != ASYNC_DONE &&
+               (code = parse_buffered_reply(&session->client, reply, sizeof(reply))) > 0) {
+            async_handle_reply(session, code, reply);
+        }
+        if (code < 0) {
+            async_complete(session, -1, "reply too long");
+        }
+    }
+}
+
+// События соединения данных
+void async_data_event(ftp_async_session_t *session, unsigned int events) {
+    char buffer[64 * 1024];
+    ssize_t n;
+
+    if (session->data_connecting) {
+        struct epoll_event event;
+        int error = 0;
+        socklen_t length = sizeof(error);
+
+        getsockopt(session->client.data_socket, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error) {
+            async_complete(session, -1, strerror(error));
+            return;
+        }
+        session->data_connecting = 0;
+        session->data_open = 1;
+        event.events = session->op == ASYNC_OP_STOR ? EPOLLOUT : EPOLLIN;
+        event.data.ptr = &session->data_handle;
+        epoll_ctl(session->loop->epoll_fd, EPOLL_CTL_MOD, session->client.data_socket, &event);
+        return;
+    }
+
+    if (session->op == ASYNC_OP_STOR && (events & EPOLLOUT)) {
+        // Отправляем из файла, пока сокет принимает данные
+        while ((n = sendfile(session->client.data_socket, session->file_fd,
+                             &session->file_offset, ZERO_COPY_CHUNK)) > 0) {
+            session->bytes += n;
+        }
+        if (n == 0) {
+            async_close_data(session);
+        } else if (errno != EAGAIN && errno != EINTR) {
+            async_complete(session, -1, strerror(errno));
+        }
+        return;
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        while ((n = recv(session->client.data_socket, buffer, sizeof(buffer), 0)) > 0) {
+            if (write_all(session->file_fd, buffer, n) < 0) {
+                async_complete(session, -1, strerror(errno));
+                return;
+            }
+            session->bytes += n;
+        }
+        if (n == 0) {
+            async_close_data(session);
+        } else if (errno != EAGAIN && errno != EINTR) {
+            async_complete(session, -1, strerror(errno));
+        }
+    }
+}
+
+// Запуск новой асинхронной сессии в цикле. Разрешение имени выполняется
+// сразу (блокирующе), всё остальное - через epoll в ftp_loop_run
+ftp_async_session_t *ftp_async_start(ftp_loop_t *loop, const char *server, int port,
+                                     const char *username, const char *password, int op,
+                                     const char *remote_path, const char *local_path,
+                                     ftp_async_callback callback, void *user_data) {
+    ftp_async_session_t *session;
+    struct addrinfo hints, *address;
+    struct epoll_event event;
+    char port_text[16];
+    int fd;
+
+    session = calloc(1, sizeof(*session));
+    if (!session) {
+        return NULL;
+    }
+    if (loop->count == loop->capacity) {
+        ftp_async_session_t **grown;
+        loop->capacity = loop->capacity ? loop->capacity * 2 : 64;
+        grown = realloc(loop->sessions, sizeof(*grown) * loop->capacity);
+        if (!grown) {
+            free(session);
+            return NULL;
+        }
+        loop->sessions = grown;
+    }
+    loop->sessions[loop->count++] = session;
+    loop->active++;
+
+    ftp_client_init(&session->client);
+    session->client.verbose = 0;
+    snprintf(session->client.server, sizeof(session->client.server), "%s", server);
+    snprintf(session->client.username, sizeof(session->client.username), "%s", username);
+    snprintf(session->client.password, sizeof(session->client.password), "%s", password);
+    session->client.port = port;
+    session->loop = loop;
+    session->op = op;
+    session->file_fd = -1;
+    session->callback = callback;
+    session->user_data = user_data;
+    session->control_handle.session = session;
+    session->data_handle.session = session;
+    session->data_handle.is_data = 1;
+    session->started = now_seconds();
+    session->deadline = session->started + loop->timeout;
+    session->state = ASYNC_CONNECTING;
+    if (remote_path) snprintf(session->remote_path, sizeof(session->remote_path), "%s", remote_path);
+    if (local_path) snprintf(session->local_path, sizeof(session->local_path), "%s", local_path);
+
+    if (op == ASYNC_OP_STOR) {
+        session->file_fd = open(local_path, O_RDONLY);
+    } else if (op == ASYNC_OP_RETR) {
+        session->file_fd = open(local_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (op != ASYNC_OP_PROBE && session->file_fd < 0) {
+        async_complete(session, -1, strerror(errno));
+        return session;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_text, sizeof(port_text), "%d", port);
+    if (getaddrinfo(server, port_text, &hints, &address) != 0) {
+        async_complete(session, -1, "failed to resolve hostname");
+        return session;
     }
 
-    // Получение данных
-    printf("Downloading file: %s\n", remote_file);
-    while ((bytes_received = recv(client->data_socket, buffer, sizeof(buffer), 0)) > 0) {
-        fwrite(buffer, 1, bytes_received, file);
-        printf(".");
-        fflush(stdout);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    session->client.control_socket = fd;
+    if (fd < 0 || (connect(fd, address->ai_addr, address->ai_addrlen) < 0 && errno != EINPROGRESS)) {
+        freeaddrinfo(address);
+        async_complete(session, -1, strerror(errno));
+        return session;
     }
-    printf("\n");
+    freeaddrinfo(address);
 
-    fclose(file);
-    close(client->data_socket);
+    event.events = EPOLLOUT;
+    event.data.ptr = &session->control_handle;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        async_complete(session, -1, strerror(errno));
+    }
+    return session;
+}
 
-    // Чтение финального ответа
-    read_response(client->control_socket, buffer, sizeof(buffer));
+// Обработка событий до завершения всех сессий цикла
+int ftp_loop_run(ftp_loop_t *loop) {
+    struct epoll_event events[256];
 
-    return 0;
-}
+    while (loop->active > 0) {
+        int n = epoll_wait(loop->epoll_fd, events, 256, 100);
+        double now;
 
-// Отправка архивированного каталога
-int ftp_upload_directory(ftp_client_t *client, const char *local_dir, const char *remote_name) {
-    char archive_name[MAX_PATH];
-    int result;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            return -1;
+        }
+        now = now_seconds();
+        for (int i = 0; i < n; i++) {
+            ftp_async_handle_t *handle = events[i].data.ptr;
+            ftp_async_session_t *session = handle->session;
 
-    // Создание временного имени архива
-    snprintf(archive_name, sizeof(archive_name), "/tmp/%s.tar.gz", remote_name);
+            if (session->state == ASYNC_DONE) continue;
+            session->deadline = now + loop->timeout;
+            if (handle->is_data) {
+                async_data_event(session, events[i].events);
+            } else {
+                async_control_event(session, events[i].events);
+            }
+        }
 
-    // Создание архива
-    if (create_tar_archive(local_dir, archive_name) < 0) {
-        return -1;
+        // Снятие зависших сессий
+        for (int i = 0; i < loop->count; i++) {
+            ftp_async_session_t *session = loop->sessions[i];
+            if (session->state != ASYNC_DONE && now > session->deadline) {
+                async_complete(session, -1, "timed out");
+            }
+        }
     }
+    return 0;
+}
 
-    // Отправка архива
-    result = ftp_upload_file(client, archive_name, remote_name);
-
-    // Удаление временного архива
-    unlink(archive_name);
+// Цель для fanout: строка файла хостов "host port user password"
+typedef struct {
+    char server[256];
+    int port;
+    char username[256];
+    char password[256];
+} fanout_target_t;
 
-    return result;
-}
+// Результаты fanout, общие для всех потоков-циклов
+typedef struct {
+    pthread_mutex_t lock;
+    int succeeded;
+    int failed;
+    long long bytes;
+} fanout_summary_t;
 
-// Получение и извлечение архивированного каталога
-int ftp_download_directory(ftp_client_t *client, const char *remote_name, const char *local_dir) {
-    char archive_name[MAX_PATH];
-    int result;
+typedef struct {
+    fanout_target_t *targets;
+    int first;
+    int count;
+    int stride;                  // Цели first, first + stride, ...
+    int op;
+    const char *remote_path;
+    const char *local_path;      // Для RETR - каталог, для STOR - файл
+    fanout_summary_t *summary;
+} fanout_thread_t;
 
-    // Создание временного имени архива
-    snprintf(archive_name, sizeof(archive_name), "/tmp/%s", remote_name);
+// Обработчик завершения сессии fanout
+void fanout_completed(ftp_async_session_t *session, int status, void *user_data) {
+    fanout_summary_t *summary = user_data;
+    double elapsed = now_seconds() - session->started;
 
-    // Скачивание архива
-    result = ftp_download_file(client, remote_name, archive_name);
-    if (result < 0) {
-        return -1;
+    pthread_mutex_lock(&summary->lock);
+    if (status == 0) {
+        summary->succeeded++;
+        summary->bytes += session->bytes;
+        printf("%s:%d OK %lld bytes in %.3f s\n", session->client.server, session->client.port,
+               session->bytes, elapsed);
+    } else {
+        summary->failed++;
+        if (session->op == ASYNC_OP_RETR) {
+            unlink(session->local_path);
+        }
+        session->error[strcspn(session->error, "\r\n")] = '\0';
+        printf("%s:%d FAILED after %.3f s: %s\n", session->client.server, session->client.port,
+               elapsed, session->error);
     }
+    fflush(stdout);
+    pthread_mutex_unlock(&summary->lock);
+}
 
-    // Извлечение архива
-    result = extract_tar_archive(archive_name, local_dir);
+// Поток со своим циклом событий, ведущий свою часть целей
+void *fanout_worker(void *arg) {
+    fanout_thread_t *job = arg;
+    ftp_loop_t loop;
 
-    // Удаление временного архива
-    unlink(archive_name);
+    if (ftp_loop_init(&loop, 30.0) < 0) {
+        return NULL;
+    }
+    for (int i = job->first; i < job->count; i += job->stride) {
+        fanout_target_t *target = &job->targets[i];
+        char local[MAX_PATH * 2];
 
-    return result;
+        if (job->op == ASYNC_OP_RETR) {
+            // Одинаковые хосты в списке допустимы, поэтому имя включает номер строки
+            snprintf(local, sizeof(local), "%s/%d_%s_%d_%s", job->local_path, i + 1,
+                     target->server, target->port, path_basename(job->remote_path));
+        } else {
+            snprintf(local, sizeof(local), "%s", job->local_path ? job->local_path : "");
+        }
+        ftp_async_start(&loop, target->server, target->port, target->username, target->password,
+                        job->op, job->remote_path, local, fanout_completed, job->summary);
+    }
+    ftp_loop_run(&loop);
+    ftp_loop_close(&loop);
+    return NULL;
 }
 
-// Список файлов на сервере
-int ftp_list_files(ftp_client_t *client) {
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
+// Одна и та же операция на всех серверах из файла хостов одновременно
+int ftp_fanout(const char *hosts_file, int op, const char *remote_path, const char *local_path) {
+    fanout_thread_t jobs[MAX_WORKERS];
+    pthread_t threads[MAX_WORKERS];
+    fanout_target_t *targets = NULL;
+    fanout_summary_t summary;
+    char line[MAX_PATH * 2];
+    int count = 0, capacity = 0, threads_count;
+    double started;
+    FILE *file;
 
-    // Переход в пассивный режим
-    if (ftp_passive_mode(client) < 0) {
+    file = fopen(hosts_file, "r");
+    if (!file) {
+        perror(hosts_file);
         return -1;
     }
+    while (fgets(line, sizeof(line), file)) {
+        fanout_target_t target;
 
-    // Команда LIST
-    send_command(client, "LIST");
-    read_response(client->control_socket, buffer, sizeof(buffer));
-
-    if (strncmp(buffer, "150", 3) != 0 && strncmp(buffer, "125", 3) != 0) {
-        close(client->data_socket);
+        memset(&target, 0, sizeof(target));
+        target.port = 21;
+        strcpy(target.username, "anonymous");
+        strcpy(target.password, "anonymous@");
+        if (line[0] == '#' || sscanf(line, "%255s %d %255s %255s", target.server, &target.port,
+                                     target.username, target.password) < 1) {
+            continue;
+        }
+        if (count == capacity) {
+            fanout_target_t *grown;
+            capacity = capacity ? capacity * 2 : 64;
+            grown = realloc(targets, sizeof(*targets) * capacity);
+            if (!grown) break;
+            targets = grown;
+        }
+        targets[count++] = target;
+    }
+    fclose(file);
+    if (count == 0) {
+        printf("No servers in %s\n", hosts_file);
+        free(targets);
         return -1;
     }
-
-    // Получение списка файлов
-    printf("\nFile listing for %s:\n", client->current_dir);
-    printf("----------------------------------------\n");
-    while ((bytes_received = recv(client->data_socket, buffer, sizeof(buffer) - 1, 0)) > 0) {
-        buffer[bytes_received] = '\0';
-        printf("%s", buffer);
+    if (op == ASYNC_OP_RETR) {
+        mkdir(local_path, 0755);
     }
-    printf("----------------------------------------\n");
-
-    close(client->data_socket);
-
-    // Чтение финального ответа
-    read_response(client->control_socket, buffer, sizeof(buffer));
-
-    return 0;
-}
 
-// Закрытие FTP соединения
-void ftp_disconnect(ftp_client_t *client) {
-    char buffer[BUFFER_SIZE];
+    // Несколько циклов событий по числу ядер, но не больше 4
+    threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads_count < 1) threads_count = 1;
+    if (threads_count > 4) threads_count = 4;
+    if (threads_count > count) threads_count = count;
 
-    send_command(client, "QUIT");
-    read_response(client->control_socket, buffer, sizeof(buffer));
+    memset(&summary, 0, sizeof(summary));
+    pthread_mutex_init(&summary.lock, NULL);
+    started = now_seconds();
+    for (int i = 0; i < threads_count; i++) {
+        jobs[i].targets = targets;
+        jobs[i].first = i;
+        jobs[i].count = count;
+        jobs[i].stride = threads_count;
+        jobs[i].op = op;
+        jobs[i].remote_path = remote_path;
+        jobs[i].local_path = local_path;
+        jobs[i].summary = &summary;
+        if (pthread_create(&threads[i], NULL, fanout_worker, &jobs[i]) != 0) {
+            fanout_worker(&jobs[i]);
+            threads[i] = 0;
+        }
+    }
+    for (int i = 0; i < threads_count; i++) {
+        if (threads[i]) pthread_join(threads[i], NULL);
+    }
 
-    close(client->control_socket);
+    printf("Fan-out: %d servers, %d succeeded, %d failed, %lld bytes in %.3f s\n",
+           count, summary.succeeded, summary.failed, summary.bytes, now_seconds() - started);
+    pthread_mutex_destroy(&summary.lock);
+    free(targets);
+    return summary.failed ? -1 : 0;
 }
 
 // Функция для отображения помощи
@@ -459,11 +7536,41 @@ void print_help() {
     printf("login <username> <password> - Login to FTP server\n");
     printf("pwd                         - Show current directory\n");
     printf("cd <directory>              - Change directory\n");
-    printf("list                        - List files on server\n");
+    printf("list [-S|-t] [-r] [-u] [path|glob] - List files (by size/time, reversed, streamed)\n");
+    printf("delete|mkdir|rmdir <path>   - Remove file, create or remove directory\n");
+    printf("rename <from> <to>          - Rename file or directory\n");
     printf("upload <local_file> <remote_file> - Upload file\n");
     printf("download <remote_file> <local_file> - Download file\n");
-    printf("upload_dir <local_dir> <remote_name> - Upload directory as archive\n");
-    printf("download_dir <remote_name> <local_dir> - Download and extract archive\n");
+    printf("reget <remote_file> <local_file> - Continue download from local file length\n");
+    printf("reput <local_file> <remote_file> - Continue upload from remote file length\n");
+    printf("resume <retries|off> [overlap] - Auto-resume interrupted transfers, verify overlap\n");
+    printf("pdownload <remote_file> <local_file> [-n N] - Download in N parallel segments\n");
+    printf("mput <glob|@list> [remote_dir] [-j K] - Upload many files with K sessions\n");
+    printf("mget <glob|@list> [local_dir] [-j K]  - Download many files with K sessions\n");
+    printf("mirror <remote_dir> <local_dir> [-n] [-jK] - Download new and changed files\n");
+    printf("sync <local_dir> <remote_dir> [-n] [-jK]   - Upload new and changed files\n");
+    printf("fanout <hosts_file> <probe|get|put> [...] - Run on many servers concurrently\n");
+    printf("upload_dir <local_dir> <remote_name> [auto|archive|files|hybrid] [-jK] - Upload directory\n");
+    printf("download_dir <remote_name> <local_dir> [-jK] - Download directory or archive\n");
+    printf("queue put|get <src> <dst> [priority] - Add a transfer to the persistent queue\n");
+    printf("queue [list] | prio <id> <n> | cancel <id> - Show, reprioritize or remove queued transfers\n");
+    printf("queue run [-jK] | file [path] - Run the queue with K sessions, or set the queue file\n");
+    printf("archive_threads <N|auto>    - Compression threads for upload_dir\n");
+    printf("archive_codec <gzip|zstd|lz4|none> [level] - Compression of upload_dir archives\n");
+    printf("zerocopy <on|off>           - Toggle sendfile/splice transfers\n");
+    printf("iouring <on|off>            - Use io_uring when zero-copy is off (if supported)\n");
+    printf("msgzerocopy <on|off>        - Upload large files from mmap with MSG_ZEROCOPY\n");
+    printf("bufsize <bytes[K|M]>        - Set receive buffer size\n");
+    printf("pipeline <on|off>           - Toggle pipelined transfer setup\n");
+    printf("modez <on|off> [level]      - Compress transfers with MODE Z (level 1-9)\n");
+    printf("status                      - Show cached session state\n");
+    printf("cache [seconds|off|clear]   - Show or configure the listing cache\n");
+    printf("bench_setup <remote_file> [count] - Measure setup latency with/without pipelining\n");
+    printf("bench_io <local_file> <remote_file> [count] - Compare copy, zero-copy and io_uring\n");
+    printf("bench_suite <work_dir> <results.jsonl> [max_size] - Run the benchmark matrix\n");
+    printf("bench_codecs <local_dir> [results.jsonl] - Compare archive codecs: time vs ratio\n");
+    printf("metrics <on|off|show>       - Collect command and transfer latency metrics\n");
+    printf("metrics save <stats.json> [trace.json] - Export statistics and Chrome trace\n");
     printf("quit                        - Disconnect and exit\n");
     printf("help                        - Show this help\n");
     printf("----------------------------------------\n");
@@ -482,10 +7589,12 @@ void print_prompt(ftp_client_t *client, int logged_in) {
 int main() {
     ftp_client_t client;
     char command[CMD_SIZE];
-    char arg1[256], arg2[256], arg3[256];
+    char arg1[256], arg2[256], arg3[256], arg4[256], arg5[256];
     int connected = 0, logged_in = 0;
 
-    memset(&client, 0, sizeof(client));
+    ftp_client_init(&client);
+    // Ошибки записи в закрытый сокет или канал обрабатываются по кодам возврата
+    signal(SIGPIPE, SIG_IGN);
 
     printf("FTP Client with Directory Navigation Support\n");
     printf("Type 'help' for available commands\n\n");
@@ -504,7 +7613,9 @@ int main() {
         memset(arg1, 0, sizeof(arg1));
         memset(arg2, 0, sizeof(arg2));
         memset(arg3, 0, sizeof(arg3));
-        int args = sscanf(command, "%s %s %s", arg1, arg2, arg3);
+        memset(arg4, 0, sizeof(arg4));
+        memset(arg5, 0, sizeof(arg5));
+        int args = sscanf(command, "%255s %255s %255s %255s %255s", arg1, arg2, arg3, arg4, arg5);
 
         if (args == 0) {
             continue;
@@ -575,7 +7686,66 @@ int main() {
                 continue;
             }
 
-            ftp_list_files(&client);
+            list_options_t options;
+            const char *path = NULL;
+            char directory[MAX_PATH];
+            char *parts[] = {arg2, arg3, arg4, arg5};
+
+            memset(&options, 0, sizeof(options));
+            options.sort = 'n';
+            for (int i = 0; i < args - 1; i++) {
+                if (strcmp(parts[i], "-S") == 0) options.sort = 's';
+                else if (strcmp(parts[i], "-t") == 0) options.sort = 't';
+                else if (strcmp(parts[i], "-r") == 0) options.reverse = 1;
+                else if (strcmp(parts[i], "-u") == 0) options.stream = 1;
+                else path = parts[i];
+            }
+            // Шаблон в последнем компоненте пути фильтрует имена каталога
+            if (path && strpbrk(path_basename(path), "*?[")) {
+                const char *slash = strrchr(path, '/');
+                options.mask = path_basename(path);
+                snprintf(directory, sizeof(directory), "%.*s", slash ? (int)(slash - path) : 0, path);
+                if (slash && directory[0] == '\0') strcpy(directory, "/");
+                path = directory;
+            }
+            if (ftp_list_files(&client, path, &options) < 0) {
+                printf("Failed to list directory\n");
+            }
+        }
+        else if (strcmp(arg1, "delete") == 0 || strcmp(arg1, "mkdir") == 0 || strcmp(arg1, "rmdir") == 0) {
+            int result;
+
+            if (!logged_in) {
+                printf("Not logged in. Use 'login' first.\n");
+                continue;
+            }
+
+            if (args < 2) {
+                printf("Usage: %s <remote_path>\n", arg1);
+                continue;
+            }
+
+            result = arg1[0] == 'd' ? ftp_delete(&client, arg2) :
+                     arg1[0] == 'm' ? ftp_mkdir(&client, arg2) : ftp_rmdir(&client, arg2);
+            printf("%s %s\n", arg1[0] == 'd' ? "Delete" : arg1[0] == 'm' ? "Directory creation" : "Directory removal",
+                   result == 0 ? "succeeded" : "failed");
+        }
+        else if (strcmp(arg1, "rename") == 0) {
+            if (!logged_in) {
+                printf("Not logged in. Use 'login' first.\n");
+                continue;
+            }
+
+            if (args < 3) {
+                printf("Usage: rename <from> <to>\n");
+                continue;
+            }
+
+            if (ftp_rename(&client, arg2, arg3) == 0) {
+                printf("Renamed %s to %s\n", arg2, arg3);
+            } else {
+                printf("Rename failed\n");
+            }
         }
         else if (strcmp(arg1, "upload") == 0) {
             if (!logged_in) {
@@ -611,38 +7781,490 @@ int main() {
                 printf("Download failed\n");
             }
         }
-        else if (strcmp(arg1, "upload_dir") == 0) {
+        else if (strcmp(arg1, "reget") == 0 || strcmp(arg1, "reput") == 0) {
+            int result;
+
             if (!logged_in) {
                 printf("Not logged in. Use 'login' first.\n");
                 continue;
             }
 
             if (args < 3) {
-                printf("Usage: upload_dir <local_directory> <remote_archive_name>\n");
+                printf("Usage: %s\n", arg1[2] == 'g' ? "reget <remote_file> <local_file>"
+                                                     : "reput <local_file> <remote_file>");
                 continue;
             }
 
-            if (ftp_upload_directory(&client, arg2, arg3) == 0) {
-                printf("Directory uploaded successfully as archive\n");
+            if (arg1[2] == 'g') {
+                result = ftp_fetch_file(&client, arg2, arg3, 1);
             } else {
-                printf("Directory upload failed\n");
+                result = ftp_send_file(&client, arg2, arg3, 1);
+            }
+            printf("%s %s\n", arg1[2] == 'g' ? "Download" : "Upload", result == 0 ? "completed" : "failed");
+        }
+        else if (strcmp(arg1, "archive_codec") == 0) {
+            const archive_codec_t *codec = args >= 2 ? find_archive_codec(arg2) : &archive_codecs[client.archive_codec];
+
+            if (!codec) {
+                printf("Usage: archive_codec <gzip|zstd|lz4|none> [level]\n");
+                continue;
+            }
+            if (!archive_codec_available(codec)) {
+                printf("%s is not installed\n", codec->program);
+                continue;
+            }
+            if (args >= 3 && (atoi(arg3) < 1 || atoi(arg3) > codec->max_level)) {
+                if (codec->max_level) {
+                    printf("Level for %s must be between 1 and %d\n", codec->name, codec->max_level);
+                } else {
+                    printf("%s has no compression level\n", codec->name);
+                }
+                continue;
+            }
+            if (args >= 2) {
+                client.archive_codec = (int)(codec - archive_codecs);
+                client.archive_level = args >= 3 ? atoi(arg3) : 0;
+            }
+            printf("Archive codec: %s", codec->name);
+            if (codec->max_level) {
+                printf(" level %d", client.archive_level ? client.archive_level : codec->default_level);
+            }
+            printf("\n");
+        }
+        else if (strcmp(arg1, "archive_threads") == 0) {
+            if (args >= 2 && strcmp(arg2, "auto") == 0) {
+                client.archive_workers = default_archive_workers();
+            } else if (args >= 2) {
+                int workers = atoi(arg2);
+
+                if (workers < 1 || workers > MAX_ARCHIVE_WORKERS) {
+                    printf("Thread count must be between 1 and %d\n", MAX_ARCHIVE_WORKERS);
+                    continue;
+                }
+                client.archive_workers = workers;
+            }
+            printf("Archive compression threads: %d\n", client.archive_workers);
+        }
+        else if (strcmp(arg1, "modez") == 0) {
+            if (args >= 2 && (strcmp(arg2, "on") == 0 || strcmp(arg2, "off") == 0)) {
+                client.mode_z = strcmp(arg2, "on") == 0;
+                if (args >= 3) {
+                    int level = atoi(arg3);
+
+                    if (level < 1 || level > 9) {
+                        printf("Level must be between 1 and 9\n");
+                        continue;
+                    }
+                    client.compress_level = level;
+                }
+            } else if (args >= 2) {
+                printf("Usage: modez <on|off> [level]\n");
+                continue;
+            }
+            printf("MODE Z compression %s (level %d)%s\n", client.mode_z ? "enabled" : "disabled",
+                   client.compress_level,
+                   client.mode_z && client.features_known && !(client.features & FEAT_MODEZ) ?
+                   ", not supported by server" : "");
+        }
+        else if (strcmp(arg1, "resume") == 0) {
+            if (args >= 2 && strcmp(arg2, "off") == 0) {
+                client.resume_retries = 0;
+                client.resume_overlap = 0;
+            } else if (args >= 2 && isdigit((unsigned char)arg2[0])) {
+                client.resume_retries = atoi(arg2);
+                if (args >= 3) {
+                    client.resume_overlap = parse_size(arg3);
+                    if (client.resume_overlap < 0 || client.resume_overlap > MAX_RECV_BUFFER) {
+                        printf("Overlap must be between 0 and %d bytes\n", MAX_RECV_BUFFER);
+                        client.resume_overlap = 0;
+                    }
+                }
+            } else if (args >= 2) {
+                printf("Usage: resume <retries|off> [overlap_bytes]\n");
+                continue;
             }
+            printf("Resume on interruption: %d retries, overlap check %lld bytes\n",
+                   client.resume_retries, client.resume_overlap);
         }
-        else if (strcmp(arg1, "download_dir") == 0) {
+        else if (strcmp(arg1, "pdownload") == 0) {
+            int segments = 4;
+
             if (!logged_in) {
                 printf("Not logged in. Use 'login' first.\n");
                 continue;
             }
 
-            if (args < 3) {
-                printf("Usage: download_dir <remote_archive_name> <local_directory>\n");
+            if (args == 5 && strcmp(arg4, "-n") == 0) {
+                segments = atoi(arg5);
+            }
+            if (args < 3 || args == 4 || (args == 5 && strcmp(arg4, "-n") != 0) ||
+                segments < 1 || segments > MAX_SEGMENTS) {
+                printf("Usage: pdownload <remote_file> <local_file> [-n 1..%d]\n", MAX_SEGMENTS);
                 continue;
             }
 
-            if (ftp_download_directory(&client, arg2, arg3) == 0) {
-                printf("Archive downloaded and extracted successfully\n");
+            if (ftp_parallel_download(&client, arg2, arg3, segments) == 0) {
+                printf("File downloaded successfully\n");
+            } else {
+                printf("Download failed\n");
+            }
+        }
+        else if (strcmp(arg1, "mirror") == 0 || strcmp(arg1, "sync") == 0) {
+            char *parts[] = {arg4, arg5};
+            int workers = 4, dry_run = 0, usage = args < 3, result;
+
+            if (!logged_in) {
+                printf("Not logged in. Use 'login' first.\n");
+                continue;
+            }
+
+            // Необязательные ключи: -n (только план) и -jK
+            for (int i = 0; i < args - 3; i++) {
+                if (strcmp(parts[i], "-n") == 0) dry_run = 1;
+                else if (strncmp(parts[i], "-j", 2) == 0) workers = atoi(parts[i] + 2);
+                else usage = 1;
+            }
+            if (usage || workers < 1 || workers > MAX_WORKERS) {
+                printf("Usage: %s\n", arg1[0] == 'm' ? "mirror <remote_dir> <local_dir> [-n] [-jK]"
+                                                     : "sync <local_dir> <remote_dir> [-n] [-jK]");
+                continue;
+            }
+
+            if (arg1[0] == 'm') {
+                result = ftp_sync_tree(&client, arg3, arg2, 0, workers, dry_run, 0, NULL);
+            } else {
+                result = ftp_sync_tree(&client, arg2, arg3, 1, workers, dry_run, 0, NULL);
+            }
+            printf("%s %s\n", arg1[0] == 'm' ? "Mirror" : "Sync", result == 0 ? "completed" : "failed");
+        }
+        else if (strcmp(arg1, "mput") == 0 || strcmp(arg1, "mget") == 0) {
+            const char *target = "";
+            int workers = 4, usage = args < 2;
+
+            if (!logged_in) {
+                printf("Not logged in. Use 'login' first.\n");
+                continue;
+            }
+
+            // Необязательные аргументы: каталог назначения и -j K
+            if (args >= 3 && strcmp(arg3, "-j") == 0) {
+                workers = atoi(arg4);
+                usage |= args != 4;
+            } else if (args >= 3) {
+                target = arg3;
+                if (args >= 4) {
+                    usage |= strcmp(arg4, "-j") != 0 || args != 5;
+                    workers = atoi(arg5);
+                }
+            }
+            if (usage || workers < 1 || workers > MAX_WORKERS) {
+                printf("Usage: %s <glob|@list_file> [%s] [-j 1..%d]\n", arg1,
+                       arg1[1] == 'p' ? "remote_dir" : "local_dir", MAX_WORKERS);
+                continue;
+            }
+
+            if (arg1[1] == 'p') {
+                ftp_mput(&client, arg2, target, workers);
+            } else {
+                ftp_mget(&client, arg2, target, workers);
+            }
+        }
+        else if (strcmp(arg1, "fanout") == 0) {
+            int op = -1;
+
+            // Сессии fanout независимы от текущего соединения
+            if (args >= 3 && strcmp(arg3, "probe") == 0) op = ASYNC_OP_PROBE;
+            else if (args >= 4 && strcmp(arg3, "get") == 0) op = ASYNC_OP_RETR;
+            else if (args >= 5 && strcmp(arg3, "put") == 0) op = ASYNC_OP_STOR;
+            if (op < 0) {
+                printf("Usage: fanout <hosts_file> probe\n"
+                       "       fanout <hosts_file> get <remote_file> [local_dir]\n"
+                       "       fanout <hosts_file> put <local_file> <remote_file>\n");
+                continue;
+            }
+
+            if (op == ASYNC_OP_STOR) {
+                ftp_fanout(arg2, op, arg5, arg4);
+            } else {
+                ftp_fanout(arg2, op, arg4, args >= 5 ? arg5 : ".");
+            }
+        }
+        else if (strcmp(arg1, "upload_dir") == 0 || strcmp(arg1, "download_dir") == 0) {
+            char *parts[] = {arg4, arg5};
+            int upload = arg1[0] == 'u', strategy = TREE_AUTO, workers = 4, usage = args < 3, result;
+
+            if (!logged_in) {
+                printf("Not logged in. Use 'login' first.\n");
+                continue;
+            }
+
+            // Необязательные способ передачи (только upload_dir) и -jK
+            for (int i = 0; i < args - 3; i++) {
+                int found = 0;
+
+                for (int s = 0; upload && s < TREE_STRATEGIES; s++) {
+                    if (strcmp(parts[i], tree_strategy_names[s]) == 0) {
+                        strategy = s;
+                        found = 1;
+                    }
+                }
+                if (found) continue;
+                if (strncmp(parts[i], "-j", 2) == 0) workers = atoi(parts[i] + 2);
+                else usage = 1;
+            }
+            if (usage || workers < 1 || workers > MAX_WORKERS) {
+                printf("Usage: %s\n", upload ? "upload_dir <local_dir> <remote_name> [auto|archive|files|hybrid] [-jK]"
+                                             : "download_dir <remote_name> <local_dir> [-jK]");
+                continue;
+            }
+
+            if (upload) {
+                result = ftp_upload_tree(&client, arg2, arg3, strategy, workers);
+            } else {
+                result = ftp_download_tree(&client, arg2, arg3, workers);
+            }
+            printf("Directory %s %s\n", upload ? "upload" : "download", result == 0 ? "completed" : "failed");
+        }
+        else if (strcmp(arg1, "queue") == 0) {
+            transfer_queue_t queue;
+            queue_entry_t *entry;
+            char path[MAX_PATH];
+            int workers = 4;
+
+            if (args >= 2 && strcmp(arg2, "file") == 0) {
+                if (args >= 3) snprintf(client.queue_file, sizeof(client.queue_file), "%s", arg3);
+                queue_path(&client, path, sizeof(path));
+                printf("Queue file: %s\n", path);
+                continue;
+            }
+            queue_path(&client, path, sizeof(path));
+            if (queue_load(path, &queue) < 0) {
+                perror(path);
+                continue;
+            }
+
+            if (args < 2 || strcmp(arg2, "list") == 0) {
+                queue_print(&queue);
+            } else if ((strcmp(arg2, "put") == 0 || strcmp(arg2, "get") == 0) && args >= 4) {
+                int upload = arg2[0] == 'p';
+                char local[MAX_PATH * 2], remote[MAX_PATH];
+
+                // Пути запоминаются абсолютными: очередь может выполняться
+                // позже, из другого локального и удалённого каталога
+                absolute_local_path(upload ? arg3 : arg4, local, sizeof(local));
+                resolve_remote_path(client.current_dir, upload ? arg4 : arg3, remote, sizeof(remote));
+                if (upload && access(local, R_OK) < 0) {
+                    perror(local);
+                } else if (strchr(arg3, '\t') || strchr(arg4, '\t')) {
+                    printf("Paths with tabs cannot be queued\n");
+                } else {
+                    entry = queue_append(&queue, queue.next_id, args >= 5 ? atoi(arg5) : 0, 'p', upload,
+                                         local, remote);
+                    if (!entry) {
+                        printf("Not enough memory to queue the transfer\n");
+                    } else if (queue_save(path, &queue) == 0) {
+                        printf("Queued transfer %d (priority %d)\n", entry->id, entry->priority);
+                    }
+                }
+            } else if ((strcmp(arg2, "prio") == 0 && args >= 4) || (strcmp(arg2, "cancel") == 0 && args >= 3)) {
+                entry = queue_find(&queue, atoi(arg3));
+                if (!entry) {
+                    printf("No queued transfer %s\n", arg3);
+                } else {
+                    if (arg2[0] == 'p') {
+                        entry->priority = atoi(arg4);
+                    } else {
+                        entry->state = 'd';
+                    }
+                    if (queue_save(path, &queue) == 0) {
+                        printf("Transfer %d %s\n", entry->id, arg2[0] == 'p' ? "reprioritized" : "cancelled");
+                    }
+                }
+            } else if (strcmp(arg2, "run") == 0) {
+                if (args >= 3 && strncmp(arg3, "-j", 2) == 0) workers = atoi(arg3 + 2);
+                if (workers < 1 || workers > MAX_WORKERS || (args >= 3 && strncmp(arg3, "-j", 2) != 0)) {
+                    printf("Usage: queue run [-jK] (K = 1..%d)\n", MAX_WORKERS);
+                } else if (!logged_in) {
+                    printf("Not logged in. Use 'login' first.\n");
+                } else {
+                    ftp_run_queue(&client, &queue, path, workers);
+                }
+            } else {
+                printf("Usage: queue [list] | put|get <src> <dst> [priority] | prio <id> <n> | cancel <id>"
+                       " | run [-jK] | file [path]\n");
+            }
+            queue_free(&queue);
+        }
+        else if (strcmp(arg1, "zerocopy") == 0) {
+            if (args < 2 || (strcmp(arg2, "on") != 0 && strcmp(arg2, "off") != 0)) {
+                printf("Zero-copy transfers are %s\n", client.zero_copy ? "on" : "off");
+                printf("Usage: zerocopy <on|off>\n");
+                continue;
+            }
+
+            client.zero_copy = strcmp(arg2, "on") == 0;
+            printf("Zero-copy transfers %s\n", client.zero_copy ? "enabled" : "disabled");
+        }
+        else if (strcmp(arg1, "iouring") == 0) {
+            if (args < 2 || (strcmp(arg2, "on") != 0 && strcmp(arg2, "off") != 0)) {
+                printf("io_uring transfers are %s (%s by this kernel)\n", client.io_uring ? "on" : "off",
+                       ring_supported() ? "supported" : "not supported");
+                printf("Usage: iouring <on|off>\n");
+                continue;
+            }
+
+            client.io_uring = strcmp(arg2, "on") == 0;
+            printf("io_uring transfers %s\n", client.io_uring ? "enabled" : "disabled");
+        }
+        else if (strcmp(arg1, "msgzerocopy") == 0) {
+            if (args < 2 || (strcmp(arg2, "on") != 0 && strcmp(arg2, "off") != 0)) {
+                printf("MSG_ZEROCOPY uploads are %s\n", client.msg_zerocopy ? "on" : "off");
+                printf("Usage: msgzerocopy <on|off>\n");
+                continue;
+            }
+
+            client.msg_zerocopy = strcmp(arg2, "on") == 0;
+            printf("MSG_ZEROCOPY uploads %s (files from %lld MiB)\n", client.msg_zerocopy ? "enabled" : "disabled",
+                   MSGZC_MIN_SIZE >> 20);
+        }
+        else if (strcmp(arg1, "bufsize") == 0) {
+            long long size = args < 2 ? -1 : parse_size(arg2);
+
+            if (size < MIN_RECV_BUFFER || size > MAX_RECV_BUFFER) {
+                printf("Receive buffer is %zu bytes\n", client.buffer_size);
+                printf("Usage: bufsize <bytes[K|M]> (%d..%d)\n", MIN_RECV_BUFFER, MAX_RECV_BUFFER);
+                continue;
+            }
+
+            client.buffer_size = (size_t)size;
+            printf("Receive buffer set to %zu bytes\n", client.buffer_size);
+        }
+        else if (strcmp(arg1, "pipeline") == 0) {
+            if (args < 2 || (strcmp(arg2, "on") != 0 && strcmp(arg2, "off") != 0)) {
+                printf("Pipelining is %s\n", client.pipelining ? "on" : "off");
+                printf("Usage: pipeline <on|off>\n");
+                continue;
+            }
+
+            client.pipelining = strcmp(arg2, "on") == 0;
+            printf("Pipelining %s\n", client.pipelining ? "enabled" : "disabled");
+        }
+        else if (strcmp(arg1, "status") == 0) {
+            if (!connected) {
+                printf("Not connected to server.\n");
+                continue;
+            }
+
+            printf("Server:        %s:%d\n", client.server, client.port);
+            printf("Directory:     %s%s\n", client.current_dir, client.cwd_confirmed ? "" : " (unconfirmed)");
+            printf("Transfer type: %s\n", client.transfer_type ? (client.transfer_type == 'I' ? "binary" : "ascii") : "unknown");
+            printf("Transfer mode: %s\n", client.transfer_mode == 'Z' ? "deflate (MODE Z)" : "stream");
+            if (client.features_known) {
+                printf("Features:     %s%s%s%s%s%s%s\n",
+                       client.features & FEAT_SIZE ? " SIZE" : "",
+                       client.features & FEAT_MDTM ? " MDTM" : "",
+                       client.features & FEAT_REST ? " REST" : "",
+                       client.features & FEAT_MLST ? " MLST" : "",
+                       client.features & FEAT_EPSV ? " EPSV" : "",
+                       client.features & FEAT_MODEZ ? " MODE-Z" : "",
+                       client.features & FEAT_UTF8 ? " UTF8" : "");
+            } else {
+                printf("Features:      not queried yet\n");
+            }
+        }
+        else if (strcmp(arg1, "cache") == 0) {
+            if (args >= 2 && strcmp(arg2, "clear") == 0) {
+                ftp_cache_clear(&client);
+                printf("Listing cache cleared\n");
+            } else if (args >= 2 && strcmp(arg2, "off") == 0) {
+                client.listing_ttl = 0;
+                ftp_cache_clear(&client);
+                printf("Listing cache disabled\n");
+            } else if (args >= 2 && isdigit((unsigned char)arg2[0])) {
+                client.listing_ttl = atof(arg2);
+                printf("Listing cache TTL set to %.1f s\n", client.listing_ttl);
+            } else {
+                ftp_cache_print(&client);
+            }
+        }
+        else if (strcmp(arg1, "bench_setup") == 0) {
+            int iterations = args >= 3 ? atoi(arg3) : 20;
+
+            if (!logged_in) {
+                printf("Not logged in. Use 'login' first.\n");
+                continue;
+            }
+
+            if (args < 2 || iterations < 1) {
+                printf("Usage: bench_setup <remote_file> [count]\n");
+                continue;
+            }
+
+            ftp_bench_setup(&client, arg2, iterations);
+        }
+        else if (strcmp(arg1, "bench_io") == 0) {
+            int iterations = args >= 4 ? atoi(arg4) : 3;
+
+            if (!logged_in) {
+                printf("Not logged in. Use 'login' first.\n");
+                continue;
+            }
+
+            if (args < 3 || iterations < 1) {
+                printf("Usage: bench_io <local_file> <remote_file> [count]\n");
+                continue;
+            }
+
+            ftp_bench_io(&client, arg2, arg3, iterations);
+        }
+        else if (strcmp(arg1, "bench_suite") == 0) {
+            long long max_size = args >= 4 ? parse_size(arg4) : 4LL << 30;
+
+            if (!logged_in) {
+                printf("Not logged in. Use 'login' first.\n");
+                continue;
+            }
+
+            if (args < 3 || max_size < 0) {
+                printf("Usage: bench_suite <work_dir> <results.jsonl> [max_file_size]\n");
+                continue;
+            }
+
+            ftp_bench_suite(&client, arg2, arg3, max_size);
+        }
+        else if (strcmp(arg1, "bench_codecs") == 0) {
+            if (args < 2) {
+                printf("Usage: bench_codecs <local_dir> [results.jsonl]\n");
+                continue;
+            }
+
+            ftp_bench_codecs(&client, arg2, args >= 3 ? arg3 : NULL);
+        }
+        else if (strcmp(arg1, "metrics") == 0) {
+            if (args >= 2 && strcmp(arg2, "on") == 0) {
+                if (!client.metrics) {
+                    client.metrics = metrics_create();
+                    client.session_id = 0;
+                    client.pending_count = 0;
+                }
+                printf("Metrics collection %s\n", client.metrics ? "enabled" : "failed");
+            } else if (args >= 2 && strcmp(arg2, "off") == 0) {
+                metrics_free(client.metrics);
+                client.metrics = NULL;
+                printf("Metrics collection disabled\n");
+            } else if (!client.metrics) {
+                printf("Metrics collection is off. Use 'metrics on' first.\n");
+            } else if (args >= 2 && strcmp(arg2, "show") == 0) {
+                metrics_print(client.metrics);
+            } else if (args >= 3 && strcmp(arg2, "save") == 0) {
+                if (metrics_save_stats(client.metrics, arg3) == 0) {
+                    printf("Statistics saved to %s\n", arg3);
+                }
+                if (args >= 4 && metrics_save_trace(client.metrics, arg4) == 0) {
+                    printf("Trace saved to %s\n", arg4);
+                }
             } else {
-                printf("Directory download failed\n");
+                printf("Usage: metrics <on|off|show|save <stats.json> [trace.json]>\n");
             }
         }
         else if (strcmp(arg1, "quit") == 0) {
@@ -656,6 +8278,8 @@ int main() {
         }
     }
 
+    metrics_free(client.metrics);
+    ftp_cache_clear(&client);
     printf("\nGoodbye!\n");
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,879 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <signal.h>
+#include <limits.h>
+
+#define DEFAULT_PORT 2121
+#define DEFAULT_ROOT "ftp_root"
+#define MAX_EVENTS 256
+#define CONTROL_BUFFER_SIZE 8192
+#define REPLY_BUFFER_SIZE 8192
+#define MAX_PATH 512
+#define SENDFILE_CHUNK (8 * 1024 * 1024)    // Порция sendfile за один вызов
+#define PIPE_BUFFER_SIZE (1024 * 1024)      // Канал для splice при приёме (STOR)
+
+// Что стоит за дескриптором, зарегистрированным в epoll
+enum {
+    HANDLE_LISTENER,
+    HANDLE_CONTROL,
+    HANDLE_PASSIVE,
+    HANDLE_DATA
+};
+
+// Передача данных, ожидающая соединения или идущая в нём
+enum {
+    TRANSFER_NONE,
+    TRANSFER_LIST,
+    TRANSFER_RETR,
+    TRANSFER_STOR
+};
+
+typedef struct session session_t;
+
+typedef struct {
+    int kind;
+    session_t *session;
+} handle_t;
+
+struct session {
+    int control_fd;
+    int passive_fd;             // Слушающий сокет после PASV/EPSV
+    int data_fd;                // Принятое соединение данных
+    handle_t control_handle;
+    handle_t passive_handle;
+    handle_t data_handle;
+    char input[CONTROL_BUFFER_SIZE];   // Принятые, но не обработанные команды
+    size_t input_length;
+    char output[REPLY_BUFFER_SIZE];    // Ответы, не ушедшие в сокет
+    size_t output_length;
+    char cwd[MAX_PATH];
+    int user_given;
+    int logged_in;
+    char type;
+    long long rest;             // Смещение из REST для следующей передачи
+    char rename_from[MAX_PATH]; // Путь из RNFR, ожидающий RNTO
+    int transfer;
+    int data_active;            // Соединение данных зарегистрировано в epoll
+    int file_fd;
+    off_t file_offset;
+    off_t file_end;
+    char *listing;
+    size_t listing_length;
+    size_t listing_sent;
+    int closing;                // После QUIT: закрыть, когда ответы уйдут
+    int closed;                 // Закрыта; память освобождается после пачки событий
+    int want_write;             // В epoll запрошен EPOLLOUT для управляющего сокета
+    session_t *next_closed;
+};
+
+// Общее состояние сервера
+static int epoll_fd = -1;
+static char root[PATH_MAX];
+static int splice_pipe[2] = {-1, -1};
+static handle_t listener_handle = {HANDLE_LISTENER, NULL};
+static session_t *closed_sessions;  // Закрытые в текущей пачке событий
+
+void session_close(session_t *session);
+void process_commands(session_t *session);
+
+// Перерегистрация управляющего сокета: запись ждём, только если есть хвост ответов
+void update_control_events(session_t *session) {
+    struct epoll_event event;
+
+    if (session->want_write == (session->output_length > 0)) {
+        return;
+    }
+    session->want_write = session->output_length > 0;
+    event.events = EPOLLIN | (session->output_length ? EPOLLOUT : 0);
+    event.data.ptr = &session->control_handle;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->control_fd, &event);
+}
+
+// Отправка накопленных ответов; остаток ждёт EPOLLOUT
+int flush_output(session_t *session) {
+    size_t sent = 0;
+
+    while (sent < session->output_length) {
+        ssize_t n = send(session->control_fd, session->output + sent,
+                         session->output_length - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        sent += n;
+    }
+    memmove(session->output, session->output + sent, session->output_length - sent);
+    session->output_length -= sent;
+    update_control_events(session);
+    return 0;
+}
+
+// Постановка ответа в очередь и попытка сразу его отправить
+void reply(session_t *session, const char *format, ...) {
+    size_t room = sizeof(session->output) - session->output_length;
+    va_list args;
+    int n;
+
+    va_start(args, format);
+    n = vsnprintf(session->output + session->output_length, room, format, args);
+    va_end(args);
+    if (n < 0 || (size_t)n + 2 >= room) {
+        fprintf(stderr, "Reply buffer overflow, dropping reply\n");
+        return;
+    }
+    session->output_length += n;
+    memcpy(session->output + session->output_length, "\r\n", 2);
+    session->output_length += 2;
+    flush_output(session);
+}
+
+// Разрешение пути клиента в виртуальный путь от корня. Компоненты ".."
+// снимаются со стека, поэтому выйти за пределы корня нельзя
+void resolve_path(const session_t *session, const char *argument, char *path, size_t size) {
+    char combined[MAX_PATH * 2];
+    char *component, *saveptr;
+    size_t length = 0;
+
+    if (argument[0] == '/') {
+        snprintf(combined, sizeof(combined), "%s", argument);
+    } else {
+        snprintf(combined, sizeof(combined), "%s/%s", session->cwd, argument);
+    }
+
+    path[0] = '\0';
+    for (component = strtok_r(combined, "/", &saveptr); component;
+         component = strtok_r(NULL, "/", &saveptr)) {
+        if (strcmp(component, ".") == 0) {
+            continue;
+        }
+        if (strcmp(component, "..") == 0) {
+            char *slash = strrchr(path, '/');
+            length = slash ? (size_t)(slash - path) : 0;
+            path[length] = '\0';
+            continue;
+        }
+        if (length + strlen(component) + 2 > size) {
+            break;
+        }
+        length += snprintf(path + length, size - length, "/%s", component);
+    }
+    if (length == 0) {
+        snprintf(path, size, "/");
+    }
+}
+
+// Путь в файловой системе сервера для виртуального пути
+void real_path(const char *path, char *real, size_t size) {
+    snprintf(real, size, "%s%s", root, strcmp(path, "/") == 0 ? "" : path);
+}
+
+// Закрытие соединения данных и освобождение ресурсов передачи
+void close_data(session_t *session) {
+    if (session->passive_fd >= 0) {
+        close(session->passive_fd);
+        session->passive_fd = -1;
+    }
+    if (session->data_fd >= 0) {
+        close(session->data_fd);
+        session->data_fd = -1;
+    }
+    if (session->file_fd >= 0) {
+        close(session->file_fd);
+        session->file_fd = -1;
+    }
+    free(session->listing);
+    session->listing = NULL;
+    session->data_active = 0;
+    session->transfer = TRANSFER_NONE;
+    session->rest = 0;
+}
+
+// Завершение передачи с финальным ответом; затем разбираются команды,
+// пришедшие пакетом вслед за командой передачи
+void finish_transfer(session_t *session, const char *text) {
+    close_data(session);
+    reply(session, "%s", text);
+    process_commands(session);
+}
+
+// Регистрация соединения данных, когда есть и соединение, и команда
+void start_data(session_t *session) {
+    struct epoll_event event;
+
+    if (session->data_fd < 0 || session->transfer == TRANSFER_NONE || session->data_active) {
+        return;
+    }
+    event.events = session->transfer == TRANSFER_STOR ? EPOLLIN : EPOLLOUT;
+    event.data.ptr = &session->data_handle;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, session->data_fd, &event) < 0) {
+        finish_transfer(session, "425 Can't open data connection");
+        return;
+    }
+    session->data_active = 1;
+}
+
+// Ожидание соединения данных для команды передачи
+void begin_transfer(session_t *session, int transfer) {
+    session->transfer = transfer;
+    start_data(session);
+}
+
+// PASV/EPSV: слушающий сокет на адресе управляющего соединения
+void open_passive(session_t *session, int extended) {
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    struct epoll_event event;
+    unsigned char *ip;
+    int port;
+
+    close_data(session);
+    if (getsockname(session->control_fd, (struct sockaddr *)&address, &length) < 0) {
+        reply(session, "425 Can't open passive connection");
+        return;
+    }
+    address.sin_port = 0;
+    session->passive_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (session->passive_fd < 0 ||
+        bind(session->passive_fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(session->passive_fd, 1) < 0 ||
+        getsockname(session->passive_fd, (struct sockaddr *)&address, &length) < 0) {
+        close_data(session);
+        reply(session, "425 Can't open passive connection");
+        return;
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = &session->passive_handle;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, session->passive_fd, &event);
+
+    port = ntohs(address.sin_port);
+    ip = (unsigned char *)&address.sin_addr.s_addr;
+    if (extended) {
+        reply(session, "229 Entering Extended Passive Mode (|||%d|)", port);
+    } else {
+        reply(session, "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)",
+              ip[0], ip[1], ip[2], ip[3], port >> 8, port & 255);
+    }
+}
+
+// Приём соединения данных на пассивном сокете
+void accept_data(session_t *session) {
+    int fd = accept4(session->passive_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0) {
+        return;
+    }
+    close(session->passive_fd);
+    session->passive_fd = -1;
+    session->data_fd = fd;
+    start_data(session);
+}
+
+// Добавление строки к листингу
+int listing_append(session_t *session, size_t *capacity, const char *text, size_t length) {
+    if (session->listing_length + length > *capacity) {
+        size_t grown_capacity = *capacity ? *capacity * 2 : 4096;
+        char *grown;
+
+        while (grown_capacity < session->listing_length + length) grown_capacity *= 2;
+        grown = realloc(session->listing, grown_capacity);
+        if (!grown) return -1;
+        session->listing = grown;
+        *capacity = grown_capacity;
+    }
+    memcpy(session->listing + session->listing_length, text, length);
+    session->listing_length += length;
+    return 0;
+}
+
+// Формирование листинга каталога: LIST - в формате ls -l, NLST - только имена,
+// MLSD - машиночитаемые факты (RFC 3659)
+int build_listing(session_t *session, const char *real, char format) {
+    char line[MAX_PATH * 2], entry_path[PATH_MAX + MAX_PATH], date[32];
+    size_t capacity = 0;
+    struct dirent *entry;
+    struct stat st;
+    time_t now = time(NULL);
+    DIR *dir;
+
+    session->listing_length = 0;
+    session->listing_sent = 0;
+    if (stat(real, &st) == 0 && !S_ISDIR(st.st_mode)) {
+        // LIST для файла показывает одну строку, MLSD применим только к каталогам
+        const char *name = strrchr(real, '/');
+        int n = snprintf(line, sizeof(line), "%s\r\n", name ? name + 1 : real);
+        if (format == 'M') return -1;
+        return listing_append(session, &capacity, line, n);
+    }
+    dir = opendir(real);
+    if (!dir) {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        int n;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        snprintf(entry_path, sizeof(entry_path), "%s/%s", real, entry->d_name);
+        if (format == 'N') {
+            n = snprintf(line, sizeof(line), "%s\r\n", entry->d_name);
+        } else if (format == 'M') {
+            struct tm tm;
+
+            if (stat(entry_path, &st) < 0) continue;
+            gmtime_r(&st.st_mtime, &tm);
+            strftime(date, sizeof(date), "%Y%m%d%H%M%S", &tm);
+            n = snprintf(line, sizeof(line), "type=%s;size=%lld;modify=%s; %s\r\n",
+                         S_ISDIR(st.st_mode) ? "dir" : "file", (long long)st.st_size, date, entry->d_name);
+        } else {
+            struct tm tm;
+
+            if (stat(entry_path, &st) < 0) continue;
+            gmtime_r(&st.st_mtime, &tm);
+            // Файлы старше полугода показываются с годом, как у ls
+            strftime(date, sizeof(date), now - st.st_mtime > 180 * 24 * 3600 ? "%b %d  %Y" : "%b %d %H:%M", &tm);
+            n = snprintf(line, sizeof(line), "%crw-r--r-- 1 ftp ftp %12lld %s %s\r\n",
+                         S_ISDIR(st.st_mode) ? 'd' : '-', (long long)st.st_size, date, entry->d_name);
+        }
+        if (n >= (int)sizeof(line) || listing_append(session, &capacity, line, n) < 0) {
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+// Отправка файла через sendfile, пока сокет принимает данные
+void send_file_data(session_t *session) {
+    while (session->file_offset < session->file_end) {
+        off_t left = session->file_end - session->file_offset;
+        ssize_t n = sendfile(session->data_fd, session->file_fd, &session->file_offset,
+                             left < SENDFILE_CHUNK ? left : SENDFILE_CHUNK);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return;
+            finish_transfer(session, "426 Connection closed; transfer aborted");
+            return;
+        }
+        if (n == 0) {
+            break;  // Файл укоротился во время передачи
+        }
+    }
+    finish_transfer(session, "226 Transfer complete");
+}
+
+// Отправка листинга из буфера
+void send_listing(session_t *session) {
+    while (session->listing_sent < session->listing_length) {
+        ssize_t n = send(session->data_fd, session->listing + session->listing_sent,
+                         session->listing_length - session->listing_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return;
+            finish_transfer(session, "426 Connection closed; transfer aborted");
+            return;
+        }
+        session->listing_sent += n;
+    }
+    finish_transfer(session, "226 Transfer complete");
+}
+
+// Приём файла: сокет -> канал -> файл через splice, при отказе splice -
+// через промежуточный буфер
+void receive_file_data(session_t *session) {
+    static char buffer[256 * 1024];
+
+    while (1) {
+        ssize_t n = splice(session->data_fd, NULL, splice_pipe[1], NULL, PIPE_BUFFER_SIZE,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        int use_buffer = n < 0 && (errno == EINVAL || errno == ENOSYS);
+
+        if (use_buffer) {
+            n = recv(session->data_fd, buffer, sizeof(buffer), 0);
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return;
+            finish_transfer(session, "426 Connection closed; transfer aborted");
+            return;
+        }
+        if (n == 0) {
+            finish_transfer(session, "226 Transfer complete");
+            return;
+        }
+
+        // Канал общий для всех сессий, поэтому опустошается сразу целиком
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t out = use_buffer
+                ? pwrite(session->file_fd, buffer + done, n - done, session->file_offset)
+                : splice(splice_pipe[0], NULL, session->file_fd, &session->file_offset, n - done, SPLICE_F_MOVE);
+            if (out < 0) {
+                if (errno == EINTR) continue;
+                if (!use_buffer) {
+                    // Сбрасываем непринятые данные, чтобы канал остался чистым
+                    while (done < n) {
+                        ssize_t dropped = read(splice_pipe[0], buffer, n - done < (ssize_t)sizeof(buffer)
+                                               ? (size_t)(n - done) : sizeof(buffer));
+                        if (dropped <= 0) break;
+                        done += dropped;
+                    }
+                }
+                finish_transfer(session, "451 Local error in processing");
+                return;
+            }
+            if (use_buffer) session->file_offset += out;
+            done += out;
+        }
+    }
+}
+
+// Команды передачи: LIST/NLST/MLSD, RETR, STOR/APPE
+void command_transfer(session_t *session, const char *command, const char *argument) {
+    char path[MAX_PATH], real[PATH_MAX + MAX_PATH];
+    struct stat st;
+
+    if (session->passive_fd < 0 && session->data_fd < 0) {
+        reply(session, "425 Use PASV or EPSV first");
+        return;
+    }
+
+    if (strcmp(command, "LIST") == 0 || strcmp(command, "NLST") == 0 || strcmp(command, "MLSD") == 0) {
+        // Ключи вида "-la" игнорируются
+        resolve_path(session, argument[0] && argument[0] != '-' ? argument : ".", path, sizeof(path));
+        real_path(path, real, sizeof(real));
+        if (build_listing(session, real, command[0]) < 0) {
+            close_data(session);
+            reply(session, "550 Failed to list directory");
+            return;
+        }
+        reply(session, "150 Here comes the directory listing");
+        begin_transfer(session, TRANSFER_LIST);
+        return;
+    }
+
+    resolve_path(session, argument, path, sizeof(path));
+    real_path(path, real, sizeof(real));
+    if (strcmp(command, "RETR") == 0) {
+        session->file_fd = open(real, O_RDONLY | O_CLOEXEC);
+        if (session->file_fd < 0 || fstat(session->file_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            close_data(session);
+            reply(session, "550 Failed to open file");
+            return;
+        }
+        session->file_offset = session->rest < st.st_size ? session->rest : st.st_size;
+        session->file_end = st.st_size;
+        reply(session, "150 Opening BINARY mode data connection for %s (%lld bytes)",
+              argument, (long long)st.st_size);
+        begin_transfer(session, TRANSFER_RETR);
+        return;
+    }
+
+    // STOR с REST дописывает с указанного смещения, APPE - в конец файла
+    session->file_fd = open(real, O_WRONLY | O_CREAT | O_CLOEXEC |
+                            (strcmp(command, "STOR") == 0 && session->rest == 0 ? O_TRUNC : 0), 0644);
+    if (session->file_fd < 0 || fstat(session->file_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close_data(session);
+        reply(session, "553 Could not create file");
+        return;
+    }
+    if (strcmp(command, "APPE") == 0) {
+        session->file_offset = st.st_size;
+    } else {
+        session->file_offset = session->rest;
+        if (session->rest > 0 && ftruncate(session->file_fd, session->rest) < 0) {
+            close_data(session);
+            reply(session, "451 Failed to set restart position");
+            return;
+        }
+    }
+    reply(session, "150 Ok to send data");
+    begin_transfer(session, TRANSFER_STOR);
+}
+
+// Обработка одной команды
+void handle_command(session_t *session, char *line) {
+    char path[MAX_PATH], real[PATH_MAX + MAX_PATH];
+    char *argument = strchr(line, ' ');
+    struct stat st;
+
+    if (argument) {
+        *argument++ = '\0';
+    } else {
+        argument = line + strlen(line);
+    }
+    for (char *p = line; *p; p++) {
+        if (*p >= 'a' && *p <= 'z') *p -= 'a' - 'A';
+    }
+
+    if (strcmp(line, "USER") == 0) {
+        session->user_given = 1;
+        session->logged_in = 0;
+        reply(session, "331 Please specify the password");
+        return;
+    }
+    if (strcmp(line, "PASS") == 0) {
+        if (!session->user_given) {
+            reply(session, "503 Login with USER first");
+            return;
+        }
+        session->logged_in = 1;
+        reply(session, "230 Login successful");
+        return;
+    }
+    if (strcmp(line, "QUIT") == 0) {
+        reply(session, "221 Goodbye");
+        session->closing = 1;
+        return;
+    }
+    if (strcmp(line, "SYST") == 0) {
+        reply(session, "215 UNIX Type: L8");
+        return;
+    }
+    if (strcmp(line, "FEAT") == 0) {
+        reply(session, "211-Features:\r\n SIZE\r\n MDTM\r\n REST STREAM\r\n MLST type*;size*;modify*;\r\n EPSV\r\n PASV\r\n211 End");
+        return;
+    }
+    if (strcmp(line, "NOOP") == 0) {
+        reply(session, "200 NOOP ok");
+        return;
+    }
+    if (!session->logged_in) {
+        reply(session, "530 Please login with USER and PASS");
+        return;
+    }
+
+    if (strcmp(line, "PWD") == 0 || strcmp(line, "XPWD") == 0) {
+        reply(session, "257 \"%s\" is the current directory", session->cwd);
+    } else if (strcmp(line, "CWD") == 0 || strcmp(line, "CDUP") == 0) {
+        resolve_path(session, line[1] == 'D' ? ".." : argument, path, sizeof(path));
+        real_path(path, real, sizeof(real));
+        if (stat(real, &st) == 0 && S_ISDIR(st.st_mode)) {
+            snprintf(session->cwd, sizeof(session->cwd), "%s", path);
+            reply(session, "250 Directory successfully changed");
+        } else {
+            reply(session, "550 Failed to change directory");
+        }
+    } else if (strcmp(line, "TYPE") == 0) {
+        char type = argument[0] >= 'a' ? argument[0] - ('a' - 'A') : argument[0];
+        if (type == 'A' || type == 'I') {
+            session->type = type;
+            reply(session, "200 Switching to %s mode", type == 'I' ? "Binary" : "ASCII");
+        } else {
+            reply(session, "504 Unsupported type");
+        }
+    } else if (strcmp(line, "PASV") == 0 || strcmp(line, "EPSV") == 0) {
+        open_passive(session, line[0] == 'E');
+    } else if (strcmp(line, "REST") == 0) {
+        char *end;
+        long long offset = strtoll(argument, &end, 10);
+        if (end == argument || offset < 0) {
+            reply(session, "501 Invalid restart position");
+        } else {
+            session->rest = offset;
+            reply(session, "350 Restart position accepted (%lld)", offset);
+        }
+    } else if (strcmp(line, "SIZE") == 0 || strcmp(line, "MDTM") == 0) {
+        resolve_path(session, argument, path, sizeof(path));
+        real_path(path, real, sizeof(real));
+        if (stat(real, &st) < 0 || !S_ISREG(st.st_mode)) {
+            reply(session, "550 Could not get file %s", line[0] == 'S' ? "size" : "modification time");
+        } else if (line[0] == 'S') {
+            reply(session, "213 %lld", (long long)st.st_size);
+        } else {
+            struct tm tm;
+            char stamp[32];
+            gmtime_r(&st.st_mtime, &tm);
+            strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &tm);
+            reply(session, "213 %s", stamp);
+        }
+    } else if (strcmp(line, "MKD") == 0 || strcmp(line, "RMD") == 0 || strcmp(line, "DELE") == 0) {
+        resolve_path(session, argument, path, sizeof(path));
+        real_path(path, real, sizeof(real));
+        if (line[0] == 'M') {
+            if (mkdir(real, 0755) == 0) {
+                reply(session, "257 \"%s\" created", path);
+            } else {
+                reply(session, "550 Create directory operation failed");
+            }
+        } else if (strcmp(path, "/") != 0 && (line[0] == 'R' ? rmdir(real) : unlink(real)) == 0) {
+            reply(session, "250 %s operation successful", line[0] == 'R' ? "Remove directory" : "Delete");
+        } else {
+            reply(session, "550 %s operation failed", line[0] == 'R' ? "Remove directory" : "Delete");
+        }
+    } else if (strcmp(line, "RNFR") == 0) {
+        resolve_path(session, argument, path, sizeof(path));
+        real_path(path, real, sizeof(real));
+        if (strcmp(path, "/") != 0 && lstat(real, &st) == 0) {
+            snprintf(session->rename_from, sizeof(session->rename_from), "%s", path);
+            reply(session, "350 Ready for RNTO");
+        } else {
+            reply(session, "550 RNFR command failed");
+        }
+    } else if (strcmp(line, "RNTO") == 0) {
+        char from[PATH_MAX + MAX_PATH];
+
+        if (!session->rename_from[0]) {
+            reply(session, "503 RNFR required first");
+            return;
+        }
+        resolve_path(session, argument, path, sizeof(path));
+        real_path(path, real, sizeof(real));
+        real_path(session->rename_from, from, sizeof(from));
+        session->rename_from[0] = '\0';
+        if (strcmp(path, "/") != 0 && rename(from, real) == 0) {
+            reply(session, "250 Rename successful");
+        } else {
+            reply(session, "550 Rename failed");
+        }
+    } else if (strcmp(line, "LIST") == 0 || strcmp(line, "NLST") == 0 || strcmp(line, "MLSD") == 0 ||
+               strcmp(line, "RETR") == 0 ||
+               strcmp(line, "STOR") == 0 || strcmp(line, "APPE") == 0) {
+        command_transfer(session, line, argument);
+    } else if (strcmp(line, "ABOR") == 0) {
+        reply(session, "225 No transfer to abort");
+    } else {
+        reply(session, "502 Command not implemented");
+    }
+}
+
+// Разбор команд из входного буфера. Пока идёт передача, команды ждут
+// в буфере (кроме ABOR); обработка продолжится в finish_transfer
+void process_commands(session_t *session) {
+    char line[CONTROL_BUFFER_SIZE];
+
+    while (!session->closing) {
+        char *newline = memchr(session->input, '\n', session->input_length);
+        size_t length;
+
+        if (!newline) {
+            if (session->input_length == sizeof(session->input)) {
+                // Строка длиннее буфера - отбрасываем её
+                session->input_length = 0;
+                reply(session, "500 Command line too long");
+            }
+            return;
+        }
+        // Ответы не успевают уходить - ждём, пока клиент их заберёт
+        if (session->output_length > sizeof(session->output) / 2) {
+            return;
+        }
+
+        length = newline - session->input;
+        if (session->transfer != TRANSFER_NONE &&
+            (length < 4 || strncasecmp(session->input, "ABOR", 4) != 0)) {
+            return;
+        }
+
+        // Строка изымается из буфера до обработки: завершение передачи
+        // внутри обработчика снова вызывает process_commands
+        memcpy(line, session->input, length);
+        line[length] = '\0';
+        if (length > 0 && line[length - 1] == '\r') {
+            line[length - 1] = '\0';
+        }
+        memmove(session->input, newline + 1, session->input_length - length - 1);
+        session->input_length -= length + 1;
+
+        if (session->transfer != TRANSFER_NONE) {
+            close_data(session);
+            reply(session, "426 Transfer aborted");
+            reply(session, "226 Abort successful");
+        } else {
+            handle_command(session, line);
+        }
+    }
+}
+
+// Данные на управляющем соединении
+void control_event(session_t *session, unsigned int events) {
+    if (events & EPOLLOUT) {
+        if (flush_output(session) < 0) {
+            session_close(session);
+            return;
+        }
+        process_commands(session);
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        while (session->input_length < sizeof(session->input)) {
+            ssize_t n = recv(session->control_fd, session->input + session->input_length,
+                             sizeof(session->input) - session->input_length, 0);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                session_close(session);
+                return;
+            }
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            session->input_length += n;
+        }
+        process_commands(session);
+    }
+    if (session->closing && session->output_length == 0) {
+        session_close(session);
+    }
+}
+
+// Событие на соединении данных
+void data_event(session_t *session) {
+    switch (session->transfer) {
+    case TRANSFER_RETR:
+        send_file_data(session);
+        break;
+    case TRANSFER_LIST:
+        send_listing(session);
+        break;
+    case TRANSFER_STOR:
+        receive_file_data(session);
+        break;
+    default:
+        break;
+    }
+}
+
+// Закрытие сессии. В текущей пачке событий могут остаться события этой
+// сессии, поэтому память освобождается только после её обработки
+void session_close(session_t *session) {
+    if (session->closed) {
+        return;
+    }
+    close_data(session);
+    close(session->control_fd);
+    session->closed = 1;
+    session->next_closed = closed_sessions;
+    closed_sessions = session;
+}
+
+// Новое управляющее соединение
+void accept_control(int listener) {
+    struct epoll_event event;
+    session_t *session;
+    int fd, one = 1;
+
+    while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        session = calloc(1, sizeof(*session));
+        if (!session) {
+            close(fd);
+            continue;
+        }
+        // Ответы короткие - без задержки Нейгла
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        session->control_fd = fd;
+        session->passive_fd = -1;
+        session->data_fd = -1;
+        session->file_fd = -1;
+        session->type = 'A';
+        strcpy(session->cwd, "/");
+        session->control_handle.kind = HANDLE_CONTROL;
+        session->control_handle.session = session;
+        session->passive_handle.kind = HANDLE_PASSIVE;
+        session->passive_handle.session = session;
+        session->data_handle.kind = HANDLE_DATA;
+        session->data_handle.session = session;
+
+        event.events = EPOLLIN;
+        event.data.ptr = &session->control_handle;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close(fd);
+            free(session);
+            continue;
+        }
+        reply(session, "220 FTP server ready");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct epoll_event event, events[MAX_EVENTS];
+    struct sockaddr_in address;
+    int port = argc > 1 ? atoi(argv[1]) : DEFAULT_PORT;
+    const char *directory = argc > 2 ? argv[2] : DEFAULT_ROOT;
+    int listener, one = 1;
+
+    if (port <= 0 || port > 65535) {
+        fprintf(stderr, "Usage: %s [port] [root_directory]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    mkdir(directory, 0755);
+    if (!realpath(directory, root)) {
+        perror(directory);
+        return 1;
+    }
+
+    if (pipe2(splice_pipe, O_CLOEXEC) < 0) {
+        perror("pipe failed");
+        return 1;
+    }
+    fcntl(splice_pipe[1], F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+
+    // Только loopback: сервер пускает любого пользователя
+    listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, 512) < 0) {
+        perror("Failed to listen");
+        return 1;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    event.events = EPOLLIN;
+    event.data.ptr = &listener_handle;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener, &event);
+
+    printf("FTP server listening on 127.0.0.1:%d, root %s\n", port, root);
+    fflush(stdout);
+
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            handle_t *handle = events[i].data.ptr;
+
+            if (handle->session && handle->session->closed) {
+                continue;
+            }
+            switch (handle->kind) {
+            case HANDLE_LISTENER:
+                accept_control(listener);
+                break;
+            case HANDLE_CONTROL:
+                control_event(handle->session, events[i].events);
+                break;
+            case HANDLE_PASSIVE:
+                accept_data(handle->session);
+                break;
+            case HANDLE_DATA:
+                data_event(handle->session);
+                break;
+            }
+        }
+        while (closed_sessions) {
+            session_t *next = closed_sessions->next_closed;
+            free(closed_sessions);
+            closed_sessions = next;
+        }
+    }
+}
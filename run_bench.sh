@@ -0,0 +1,32 @@
+#!/bin/sh
+# Запуск матрицы бенчмарка клиента против локального ftp_server.
+# Использование: run_bench.sh <ftp_client> <ftp_server> [results.jsonl] [max_file_size] [port]
+# Результаты - JSON Lines, по строке на замер (см. команду bench_suite клиента)
+
+CLIENT=${1:?usage: run_bench.sh <ftp_client> <ftp_server> [results.jsonl] [max_file_size] [port]}
+SERVER=${2:?usage: run_bench.sh <ftp_client> <ftp_server> [results.jsonl] [max_file_size] [port]}
+RESULTS=${3:-bench_results.jsonl}
+MAX_SIZE=${4:-4G}
+PORT=${5:-2199}
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/ftpbench.XXXXXX") || exit 1
+mkdir -p "$WORK/server" "$WORK/client"
+
+"$SERVER" "$PORT" "$WORK/server" > "$WORK/server.log" 2>&1 &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$WORK"' EXIT INT TERM
+
+# Ждём, пока сервер начнёт принимать соединения
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    grep -q listening "$WORK/server.log" && break
+    sleep 0.2
+done
+if ! kill -0 $SERVER_PID 2>/dev/null; then
+    cat "$WORK/server.log"
+    exit 1
+fi
+
+printf 'connect 127.0.0.1 %s\nlogin bench bench\nbench_suite %s %s %s\nquit\n' \
+    "$PORT" "$WORK/client" "$RESULTS" "$MAX_SIZE" | "$CLIENT" | tee "$WORK/client.log"
+
+grep -q 'Benchmark finished' "$WORK/client.log"